@@ -10,11 +10,26 @@ void CommandStruct::Init() {
 	traces_file = "";
 	ans_file = "";
 	output_file = "";
+	image_file = "";
 
 	rules_shuffle = 0;
     lookup_round = 1;
     force_test = 0;
 	print_mode = 0;
+	lookup_batch = 1;
+	tuple_pruning = 0;
+	hash_type = 0;
+	flow_cache_lines = 0;
+	pext_beam_width = 1;
+	pext_lookahead = 0;
+	pext_node_budget = 0;
+	pext_build_budget = 0;
+	pext_compare_greedy = 0;
+	lookup_threads_num = 4;
+	x1 = -1;
+	y1 = -1;
+	x2 = -1;
+	y2 = -1;
 }
 CommandStruct command_empty;
 CommandStruct ParseCommandLine(int argc, char *argv[]) {
@@ -30,15 +45,31 @@ CommandStruct ParseCommandLine(int argc, char *argv[]) {
        {"traces_file", required_argument, NULL, 0},
        {"ans_file", required_argument, NULL, 0},
        {"output_file", required_argument, NULL, 0},
+       {"image_file", required_argument, NULL, 0},
        {"rules_shuffle", required_argument, NULL, 0},
        {"lookup_round", required_argument, NULL, 0},
        {"force_test", required_argument, NULL, 0},
        {"print_mode", required_argument, NULL, 0},
+       {"lookup_batch", required_argument, NULL, 0},
+       {"tuple_pruning", required_argument, NULL, 0},
+       {"hash_type", required_argument, NULL, 0},
+       {"flow_cache_lines", required_argument, NULL, 0},
+       {"pext_beam_width", required_argument, NULL, 0},
+       {"pext_lookahead", required_argument, NULL, 0},
+       {"pext_node_budget", required_argument, NULL, 0},
+       {"pext_build_budget", required_argument, NULL, 0},
+       {"pext_compare_greedy", required_argument, NULL, 0},
        {"prefix_dims_num", required_argument, NULL, 0},
        {"lookup_thread_time", required_argument, NULL, 0},
        {"update_thread_speed", required_argument, NULL, 0},
        {"reconstruct_thread_time", required_argument, NULL, 0},
+       {"lookup_threads_num", required_argument, NULL, 0},
        {"next_layer_rules_num", required_argument, NULL, 0},
+       {"migrate_rules_num", required_argument, NULL, 0},
+       {"x1", required_argument, NULL, 0},
+       {"y1", required_argument, NULL, 0},
+       {"x2", required_argument, NULL, 0},
+       {"y2", required_argument, NULL, 0},
        {0, 0, 0, 0}
    };
     int opt, option_index;
@@ -60,6 +91,8 @@ CommandStruct ParseCommandLine(int argc, char *argv[]) {
             	command.ans_file = optarg;
 			} else if (strcmp(long_opts[option_index].name, "output_file") == 0) {
             	command.output_file = optarg;
+			} else if (strcmp(long_opts[option_index].name, "image_file") == 0) {
+            	command.image_file = optarg;
 			} else if (strcmp(long_opts[option_index].name, "rules_shuffle") == 0) {
             	command.rules_shuffle = strtoul(optarg, NULL, 0);
 			} else if (strcmp(long_opts[option_index].name, "lookup_round") == 0) {
@@ -72,6 +105,32 @@ CommandStruct ParseCommandLine(int argc, char *argv[]) {
             	command.force_test = strtoul(optarg, NULL, 0);
 			} else if (strcmp(long_opts[option_index].name, "print_mode") == 0) {
             	command.print_mode = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "lookup_batch") == 0) {
+            	command.lookup_batch = strtoul(optarg, NULL, 0);
+            	if (command.lookup_batch <= 0) {
+            		printf("lookup_batch should > 0\n");
+            		flag = false;
+            	}
+			} else if (strcmp(long_opts[option_index].name, "tuple_pruning") == 0) {
+            	command.tuple_pruning = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "hash_type") == 0) {
+            	command.hash_type = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "flow_cache_lines") == 0) {
+            	command.flow_cache_lines = strtoul(optarg, NULL, 0);
+            	if (command.flow_cache_lines < 0 || (command.flow_cache_lines & (command.flow_cache_lines - 1))) {
+            		printf("flow_cache_lines should be 0 or a power of 2\n");
+            		flag = false;
+            	}
+			} else if (strcmp(long_opts[option_index].name, "pext_beam_width") == 0) {
+            	command.pext_beam_width = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "pext_lookahead") == 0) {
+            	command.pext_lookahead = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "pext_node_budget") == 0) {
+            	command.pext_node_budget = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "pext_build_budget") == 0) {
+            	command.pext_build_budget = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "pext_compare_greedy") == 0) {
+            	command.pext_compare_greedy = strtoul(optarg, NULL, 0);
 			} else if (strcmp(long_opts[option_index].name, "prefix_dims_num") == 0) {
             	command.prefix_dims_num = strtoul(optarg, NULL, 0);
 			} else if (strcmp(long_opts[option_index].name, "lookup_thread_time") == 0) {
@@ -80,8 +139,24 @@ CommandStruct ParseCommandLine(int argc, char *argv[]) {
             	command.update_thread_speed = strtoul(optarg, NULL, 0);
 			} else if (strcmp(long_opts[option_index].name, "reconstruct_thread_time") == 0) {
             	command.reconstruct_thread_time = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "lookup_threads_num") == 0) {
+            	command.lookup_threads_num = strtoul(optarg, NULL, 0);
+            	if (command.lookup_threads_num <= 0 || command.lookup_threads_num > 64) {
+            		printf("lookup_threads_num should be in [1, 64]\n");
+            		flag = false;
+            	}
 			} else if (strcmp(long_opts[option_index].name, "next_layer_rules_num") == 0) {
             	command.next_layer_rules_num = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "migrate_rules_num") == 0) {
+            	command.migrate_rules_num = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "x1") == 0) {
+            	command.x1 = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "y1") == 0) {
+            	command.y1 = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "x2") == 0) {
+            	command.x2 = strtoul(optarg, NULL, 0);
+			} else if (strcmp(long_opts[option_index].name, "y2") == 0) {
+            	command.y2 = strtoul(optarg, NULL, 0);
 			} else {
 				flag = false;
 				printf("Wrong command %s\n", long_opts[option_index].name);
@@ -95,6 +170,15 @@ CommandStruct ParseCommandLine(int argc, char *argv[]) {
 		printf("prefix_dims_num should be 2 or 5\n");
 		exit(1);
 	}
+	// 33 : no upper region on that dim
+	if (command.x1 > 33 || command.y1 > 33 || command.x2 > 33 || command.y2 > 33) {
+		printf("x1 y1 x2 y2 should <= 33\n");
+		flag = false;
+	}
+	if ((command.x2 >= 0 && command.x1 > command.x2) || (command.y2 >= 0 && command.y1 > command.y2)) {
+		printf("x1 should <= x2 and y1 should <= y2\n");
+		flag = false;
+	}
 	if (!flag)
 		exit(1);
     return command;
@@ -120,6 +204,12 @@ void ProgramState::AccessCal() {
     access_rules.Update();
 }
 
+int Classifier::LookupBatch(Trace **traces, int n, int *out) {
+	for (int i = 0; i < n; ++i)
+		out[i] = Lookup(traces[i], 0);
+	return 0;
+}
+
 bool SameRule(Rule *rule1, Rule *rule2) {
 	for (int i = 0; i < 5; ++i)
 		for (int j = 0; j < 2; ++j)
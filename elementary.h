@@ -23,19 +23,36 @@ struct CommandStruct {
 	string traces_file;
 	string ans_file;
 	string output_file;
+	string image_file;  // image 模式写出并映射的 IRSS 镜像文件
 
 	int rules_shuffle;
     int lookup_round;
     int force_test;  // 0表示不验证，1表示使用全部规则，2表示使用%4！=0的规则
 	int print_mode;
+	int lookup_batch;  // 每次 LookupBatch 查找的包数, 1表示逐包 Lookup
+	int tuple_pruning;  // 1表示查找元组前用源/目的IP前缀树剪枝
+	int hash_type;  // 0 mult, 1 crc32c, 2 xorshift, 3 tabulation
+	int flow_cache_lines;  // 每个查找线程的流缓存行数(2的幂), 0表示不用流缓存
+	int pext_beam_width;  // PextCuts 每个节点保留的候选切分数, 1表示贪心
+	int pext_lookahead;  // 1表示按子节点的贪心切分比较候选切分
+	int pext_node_budget;  // 每个节点切分搜索的毫秒数, 0表示不限
+	int pext_build_budget;  // 建树切分搜索的总毫秒数, 超出后贪心建树, 0表示不限
+	int pext_compare_greedy;  // 1表示计时之外另建搜索树与贪心树, 比较搜索节省的内存与查找路径
 
 	int prefix_dims_num;
 
-	int lookup_thread_time;
-	int update_thread_speed;
+	int lookup_thread_time;  // stress 运行秒数
+	int update_thread_speed;  // stress 每秒更新数, 0表示不限速
 	int reconstruct_thread_time;
+	int lookup_threads_num;  // stress 查找线程数
 
 	int next_layer_rules_num;
+	int migrate_rules_num;  // 每次更新在哈希节点与下一层之间迁移的最大规则数
+
+	int x1;  // MultilayerTuple 源/目的IP区域划分阈值, -1表示使用默认值
+	int y1;
+	int x2;
+	int y2;
 
 	void Init();
 };
@@ -108,7 +125,14 @@ struct ProgramState {
     int hash_node_num;
     int bucket_sum;
     int bucket_use;
+    int slot_sum;
+    uint64_t hash_chain_sum;  // 每个 hash_node 从初始桶开始需要探测的桶数之和
+    int hash_chain_max;
 	int next_layer_num;
+	uint64_t pruned_tuples;  // 被前缀树剪枝跳过的元组探测数
+	uint64_t fingerprint_collisions;  // 查找时指纹相同但键不同的槽数
+	uint64_t flow_cache_hits;  // 流缓存命中的查找数
+	uint64_t flow_cache_lookups;  // 经过流缓存的查找数
 
 	AccessNum access_tuples;
 	AccessNum access_tables;
@@ -177,6 +201,13 @@ struct ProgramState {
 	int tree_real_rules_num;
 	int tree_child_num;
 	int tree_real_child_num;
+	int tree_shared_num;  // 共享的子树数
+	uint64_t tree_shared_memory_size;  // 共享子树节省的内存 B
+	uint64_t tree_build_memory_size;  // 建树临时内存(规则表与 arena)的峰值 B, 不是 RSS
+	uint64_t build_peak_rss;  // Create 之后的进程峰值 RSS B
+	uint64_t build_peak_rss_growth;  // Create 期间进程峰值 RSS 的增长 B
+	int64_t tree_search_saved_memory_size;  // 切分搜索比贪心建树节省的内存 B
+	int tree_search_saved_height;  // 切分搜索比贪心建树减少的各树最长查找路径之和
 };
 struct Rule {
     uint32_t range[5][2];
@@ -281,6 +312,8 @@ public:
     virtual int InsertRule(Rule *rule) = 0;
     virtual int DeleteRule(Rule *rule) = 0;
     virtual int Lookup(Trace *trace, int priority) = 0;
+    // out[i] = Lookup(traces[i], 0), classifiers may overlap the memory accesses of the n packets
+    virtual int LookupBatch(Trace **traces, int n, int *out);
     virtual int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) = 0;
 
     virtual int Reconstruct() = 0;
@@ -291,8 +324,6 @@ public:
     virtual int Test(void *ptr) = 0;
 
     int test_num;
-    pthread_mutex_t lookup_mutex;
-    pthread_mutex_t update_mutex;
 };
 
 bool SameRule(Rule *rule1, Rule *rule2);
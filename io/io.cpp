@@ -66,10 +66,13 @@ vector<Rule*> ReadRules(string rules_file, int rules_shuffle) {
 		printf("Cannot open the file %s\n", rules_file.c_str());
     int priority = 0;
     while (fgets(buf,1000,fp)!=NULL)
-        ++priority;
+        if (buf[0] == '@')
+            ++priority;
     
     fp = fopen(rules_file.c_str(), "rb");
 	while (fgets(buf,1000,fp)!=NULL) { 
+        if (buf[0] != '@')  // 跳过表头
+            continue;
         string str = buf + 1;
         vector<string> vc = StrSplit(str, "\t /:");
 
@@ -98,7 +101,7 @@ vector<Rule*> ReadRules(string rules_file, int rules_shuffle) {
         rule->priority = priority--;
         // label
         rule->label = std::stoi(vc.back()); // 最后一个字段是 label
-        if(rule->label == 0){
+        if(rule->label == 1){
             rule_tree.push_back(rule);
             tree_num++;
             continue;
@@ -130,10 +133,13 @@ vector<Rule*> ReadRuletree(string rules_file, int rules_shuffle) {
 		printf("Cannot open the file %s\n", rules_file.c_str());
     int priority = 0;
     while (fgets(buf,1000,fp)!=NULL)
-        ++priority;
+        if (buf[0] == '@')
+            ++priority;
     
     fp = fopen(rules_file.c_str(), "rb");
 	while (fgets(buf,1000,fp)!=NULL) { 
+        if (buf[0] != '@')  // 跳过表头
+            continue;
         string str = buf + 1;
         vector<string> vc = StrSplit(str, "\t /:");
 
@@ -551,17 +557,13 @@ bool SameTrace(Trace *trace1, Trace *trace2) {
 //     return ans;
 // }
 
-extern int prefix_dims_num;
-
-vector<int> GenerateAns(vector<Rule*> &rules, vector<Trace*> &traces, CommandStruct command) {
+template<int DIMS>
+vector<int> GenerateAnsDims(vector<Rule*> &rules, vector<Trace*> &traces, CommandStruct command) {
     vector<int> ans;
-    if (command.force_test == 0)
-        return ans;
     int rules_num = rules.size();
     int traces_num = traces.size();
 
-    MultilayerTuple multilayertuple;
-    prefix_dims_num = command.prefix_dims_num;
+    MultilayerTuple<DIMS> multilayertuple;
     multilayertuple.Init(1, true);
     multilayertuple.Create(rules, true);
     if (command.force_test == 2)
@@ -588,6 +590,14 @@ vector<int> GenerateAns(vector<Rule*> &rules, vector<Trace*> &traces, CommandStr
     return ans;
 }
 
+vector<int> GenerateAns(vector<Rule*> &rules, vector<Trace*> &traces, CommandStruct command) {
+    if (command.force_test == 0)
+        return vector<int>();
+    if (command.prefix_dims_num == 5)
+        return GenerateAnsDims<5>(rules, traces, command);
+    return GenerateAnsDims<2>(rules, traces, command);
+}
+
 void PrintAns(string output_file, vector<int> &ans) {
     int ans_num = ans.size();
 	FILE *fp = fopen(output_file.c_str(), "wb");
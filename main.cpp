@@ -5,7 +5,8 @@ using namespace std;
 
 int main(int argc, char *argv[]) {
     CommandStruct command = ParseCommandLine(argc, argv);
-    if (command.run_mode == "classification") {
+    if (command.run_mode == "classification" || command.run_mode == "tune" || command.run_mode == "stress" ||
+        command.run_mode == "image") {
         ClassificationMain(command);
     } else {
     	printf("run_mode does not exist\n");
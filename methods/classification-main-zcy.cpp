@@ -6,10 +6,12 @@ using namespace std;
 TupleInfo main_tuple_info;
 extern int reduce_prefix_type;
 
-extern int prefix_dims_num;
 extern int max_layers_num;
 extern uint32_t create_next_layer_rules_num;
-extern uint32_t delete_next_layer_rules_num;
+extern uint32_t migrate_rules_num;
+extern bool tuple_pruning;
+extern bool concurrent_lookup;
+extern int max_prefix_len[5];
 
 void PerformClassificationZcy(CommandStruct &command, ProgramState *program_state, 
                        Classifier &classifier, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans, 
@@ -21,11 +23,17 @@ void PerformClassificationZcy(CommandStruct &command, ProgramState *program_stat
 
     timeval timeval_start, timeval_end;
 
-    // build
+    // build, ru_maxrss is the peak RSS of the process in KB
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t peak_rss = usage.ru_maxrss * 1024ULL;
     gettimeofday(&timeval_start,NULL);
     classifier.Create(rules, true);
     gettimeofday(&timeval_end,NULL);
     program_state->build_time = GetRunTimeUs(timeval_start, timeval_end) / 1000000.0;
+    getrusage(RUSAGE_SELF, &usage);
+    program_state->build_peak_rss = usage.ru_maxrss * 1024ULL;
+    program_state->build_peak_rss_growth = program_state->build_peak_rss - peak_rss;
 
     // lookup
     //printf("lookup\n");
@@ -33,14 +41,30 @@ void PerformClassificationZcy(CommandStruct &command, ProgramState *program_stat
     // printf("lookup_round %d\n", lookup_round);
     // classifier.Reconstruct();
 
+    int lookup_batch = command.lookup_batch;
+    vector<int> batch_out(traces_num);
     vector<uint64_t> lookup_times;
     for (int k = 0; k < lookup_round; ++k) {
         gettimeofday(&timeval_start,NULL);
-        for (int i = 0; i < traces_num; ++i)
-            (classifier.*Lookup)(traces[i], 0);
+        if (lookup_batch > 1) {
+            for (int i = 0; i < traces_num; i += lookup_batch)
+                classifier.LookupBatch(&traces[i], min(lookup_batch, traces_num - i), &batch_out[i]);
+        } else {
+            for (int i = 0; i < traces_num; ++i)
+                (classifier.*Lookup)(traces[i], 0);
+        }
         gettimeofday(&timeval_end,NULL);
         lookup_times.push_back(GetRunTimeUs(timeval_start, timeval_end));
     }
+    // ans may be the answers after the deletes, the batch lookups are checked against the lookups of the same rules
+    if (lookup_batch > 1 && command.force_test > 0)
+        for (int i = 0; i < traces_num; ++i) {
+            int priority = (classifier.*Lookup)(traces[i], 0);
+            if (priority != batch_out[i]) {
+                printf("May be wrong : %d lookup %d batch lookup %d\n", i, priority, batch_out[i]);
+                exit(1);
+            }
+        }
     uint64_t lookup_time = GetAvgTime(lookup_times);
     program_state->lookup_speed = traces_num / (lookup_time / 1.0);
 
@@ -86,6 +110,11 @@ void PerformClassificationZcy(CommandStruct &command, ProgramState *program_stat
                 printf("May be wrong : %d ans %d lookup %d\n", i, ans[i], priority);
                 exit(1);
             }
+            // LookupAccess is not cached, the cached lookups after the updates are checked here
+            if (command.flow_cache_lines > 0 && (classifier.*Lookup)(traces[i], 0) != priority) {
+                printf("May be wrong : %d ans %d flow cache lookup %d\n", i, ans[i], (classifier.*Lookup)(traces[i], 0));
+                exit(1);
+            }
             if (priority != 0)
                 ++hit_num;
             //printf("%d\n", priority);
@@ -103,23 +132,588 @@ void PerformClassificationZcy(CommandStruct &command, ProgramState *program_stat
     classifier.Free(false);
 }
 
-int ClassificationMainZcy(CommandStruct command, ProgramState *program_state,ProgramState *program_state_tree, vector<Rule*> &rules,vector<Rule*> & rule_tree,
+void SetIRSSParameters(CommandStruct &command) {
+    tuple_pruning = command.tuple_pruning > 0;
+    if (SetHashType(command.hash_type) > 0)
+        exit(1);
+    if (command.next_layer_rules_num > 0)
+        create_next_layer_rules_num = command.next_layer_rules_num;
+    if (command.migrate_rules_num > 0)
+        migrate_rules_num = command.migrate_rules_num;
+    SetDefaultRegion(command.x1, command.y1, command.x2, command.y2);
+    if (SetPextSearch(command.pext_beam_width, command.pext_lookahead, command.pext_node_budget, command.pext_build_budget) > 0)
+        exit(1);
+}
+
+// the searched and the greedy trees of the tree rules, built after the timed build
+static void CompareGreedyTrees(ProgramState *program_state, vector<Rule*> &rules) {
+    vector<Rule*> tree_rules;
+    int rules_num = rules.size();
+    for (int i = 0; i < rules_num; ++i)
+        if (rules[i]->label == IRSS_TREE_LABEL)
+            tree_rules.push_back(rules[i]);
+    MultiPextCuts search;
+    search.Build(tree_rules, true);
+    MultiPextCuts greedy;
+    greedy.Build(tree_rules, false);
+    program_state->tree_search_saved_memory_size = (int64_t)greedy.MemorySize() - (int64_t)search.MemorySize();
+    program_state->tree_search_saved_height = greedy.RealHeightSum() - search.RealHeightSum();
+    search.Free(false);
+    greedy.Free(false);
+}
+
+int ClassificationMainZcy(CommandStruct command, ProgramState *program_state, vector<Rule*> &rules,
                           vector<Trace*> &traces, vector<int> &ans) {
      if (command.method_name == "IRSS") {
-        //建立树
-        MultiPextCuts multipextcuts;
-        PerformClassificationZcy(command, program_state_tree, multipextcuts, rule_tree, traces, ans, &Classifier::Lookup, &Classifier::LookupAccess);
-        //建立元组
-        MultilayerTuple multilayertuple;
-        prefix_dims_num = command.prefix_dims_num;
-        if (command.next_layer_rules_num > 0) {
-            create_next_layer_rules_num = command.next_layer_rules_num;
-            delete_next_layer_rules_num = command.next_layer_rules_num / 2;
+        // 树与元组在同一个分类器中, 每个包只查找一次
+        SetIRSSParameters(command);
+        IRSSClassifier<5> irss5;
+        IRSSClassifier<2> irss2;
+        Classifier *irss = &irss2;
+        if (command.prefix_dims_num == 5)
+            irss = &irss5;
+        if (command.flow_cache_lines > 0) {
+            FlowCacheClassifier flow_cache(irss, command.flow_cache_lines);
+            PerformClassificationZcy(command, program_state, flow_cache, rules, traces, ans, &Classifier::Lookup, &Classifier::LookupAccess);
+        } else {
+            PerformClassificationZcy(command, program_state, *irss, rules, traces, ans, &Classifier::Lookup, &Classifier::LookupAccess);
         }
-        multilayertuple.Init(1, true);
-        PerformClassificationZcy(command, program_state, multilayertuple, rules, traces, ans, &Classifier::Lookup, &Classifier::LookupAccess);
+        if (command.pext_compare_greedy)
+            CompareGreedyTrees(program_state, rules);
     } else {
         printf("No such method %s\n", command.method_name.c_str());
     }
     return 0;
-}
\ No newline at end of file
+}
+// 区域阈值调优: 先按元组数与哈希节点规则数估计代价剪枝, 再对少量候选实际建表测查找速度与内存
+#define TUNEGRIDSTEP 8  // 粗搜索网格步长
+#define TUNESTARTS 4  // 从代价最低的几个网格点开始局部搜索
+#define TUNELOOKUPCANDIDATES 8  // 按查找代价实测的候选数
+#define TUNEMEMORYCANDIDATES 4  // 按哈希节点数实测的候选数
+#define TUNESLOWDOWN 2  // 内存最优的候选查找代价与速度不差于最优的 1/TUNESLOWDOWN
+
+struct RegionCandidate {
+    int region[4];  // x1 y1 x2 y2
+    int tuples_num;
+    int hash_node_num;
+    double probe_cost;  // 元组数 + 命中的哈希节点平均规则数
+    double lookup_speed;  // Mlps
+    double memory_size;  // MB
+};
+
+bool CmpProbeCost(const RegionCandidate &candidate1, const RegionCandidate &candidate2) {
+    return candidate1.probe_cost < candidate2.probe_cost;
+}
+
+bool CmpHashNodeNum(const RegionCandidate &candidate1, const RegionCandidate &candidate2) {
+    return candidate1.tuples_num + candidate1.hash_node_num < candidate2.tuples_num + candidate2.hash_node_num;
+}
+
+// thresholds that give the same tuples and hash nodes
+bool SamePartition(const RegionCandidate &candidate1, const RegionCandidate &candidate2) {
+    return candidate1.tuples_num == candidate2.tuples_num && candidate1.hash_node_num == candidate2.hash_node_num && 
+           candidate1.probe_cost == candidate2.probe_cost;
+}
+
+int RegionId(int *region) {
+    return ((region[0] * 34 + region[1]) * 34 + region[2]) * 34 + region[3];
+}
+
+// the tuples and hash nodes the tuple rules fall into, without building them
+template<int DIMS>
+RegionCandidate EstimateRegion(vector<Rule*> &tuple_rules, int *region) {
+    typedef typename MKeyTraits<DIMS>::Key Key;
+    RegionCandidate candidate;
+    for (int i = 0; i < 4; ++i)
+        candidate.region[i] = region[i];
+    MultilayerTuple<DIMS> multilayertuple;
+    multilayertuple.Init(1, true);
+    multilayertuple.SetRegion(region[0], region[1], region[2], region[3]);
+
+    int n = tuple_rules.size();
+    vector<pair<uint32_t, Key> > keys(n);
+    uint32_t prefix_len[5], prefix_len_zero[DIMS], fields[DIMS], hash;
+    for (int i = 0; i < n; ++i) {
+        uint32_t prefix_pair = multilayertuple.GetReducedPrefix(prefix_len, tuple_rules[i]);
+        for (int j = 0; j < DIMS; ++j) {
+            prefix_len_zero[j] = max_prefix_len[j] - prefix_len[j];
+            fields[j] = tuple_rules[i]->range[j][0];
+        }
+        keys[i] = make_pair(prefix_pair, GetKey<DIMS>(fields, prefix_len_zero, hash, multilayertuple.hash_type));
+    }
+    sort(keys.begin(), keys.end());
+
+    // a packet matching a rule scans the whole hash node of that rule
+    candidate.tuples_num = 0;
+    candidate.hash_node_num = 0;
+    double scan_sum = 0;
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && keys[j] == keys[i]; ++j);
+        if (i == 0 || keys[i].first != keys[i - 1].first)
+            ++candidate.tuples_num;
+        ++candidate.hash_node_num;
+        scan_sum += 1.0 * (j - i) * (j - i);
+    }
+    candidate.probe_cost = candidate.tuples_num + scan_sum / max(n, 1);
+    candidate.lookup_speed = 0;
+    candidate.memory_size = 0;
+    return candidate;
+}
+
+template<int DIMS>
+RegionCandidate& EstimateRegionOnce(map<int, RegionCandidate> &estimated, vector<Rule*> &tuple_rules, int *region) {
+    int id = RegionId(region);
+    if (estimated.find(id) == estimated.end())
+        estimated[id] = EstimateRegion<DIMS>(tuple_rules, region);
+    return estimated[id];
+}
+
+template<int DIMS>
+void MeasureRegion(CommandStruct &command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans, 
+                   RegionCandidate &candidate) {
+    int traces_num = traces.size();
+    timeval timeval_start, timeval_end;
+    IRSSClassifier<DIMS> irss;
+    irss.SetRegion(candidate.region[0], candidate.region[1], candidate.region[2], candidate.region[3]);
+    irss.Create(rules, true);
+
+    int lookup_batch = command.lookup_batch;
+    vector<int> out(traces_num);
+    vector<uint64_t> lookup_times;
+    for (int k = 0; k < command.lookup_round; ++k) {
+        gettimeofday(&timeval_start,NULL);
+        if (lookup_batch > 1) {
+            for (int i = 0; i < traces_num; i += lookup_batch)
+                irss.LookupBatch(&traces[i], min(lookup_batch, traces_num - i), &out[i]);
+        } else {
+            for (int i = 0; i < traces_num; ++i)
+                out[i] = irss.Lookup(traces[i], 0);
+        }
+        gettimeofday(&timeval_end,NULL);
+        lookup_times.push_back(GetRunTimeUs(timeval_start, timeval_end));
+    }
+    if (command.force_test > 0)
+        for (int i = 0; i < traces_num; ++i)
+            if (ans[i] != out[i]) {
+                printf("May be wrong : %d ans %d lookup %d\n", i, ans[i], out[i]);
+                exit(1);
+            }
+    candidate.lookup_speed = traces_num / (max(GetAvgTime(lookup_times), (uint64_t)1) / 1.0);
+    candidate.memory_size = irss.MemorySize() / 1024.0 / 1024.0;
+    irss.Free(false);
+}
+
+template<int DIMS>
+int TuneRegion(CommandStruct &command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans) {
+    vector<Rule*> tuple_rules;
+    for (int i = 0; i < rules.size(); ++i)
+        if (rules[i]->label != IRSS_TREE_LABEL)
+            tuple_rules.push_back(rules[i]);
+    map<int, RegionCandidate> estimated;
+
+    // current thresholds, the globals after the command line
+    MultilayerTuple<DIMS> defaults;
+    defaults.Init(1, true);
+    int default_region[4] = {defaults.x1, defaults.y1, defaults.x2, defaults.y2};
+    EstimateRegionOnce<DIMS>(estimated, tuple_rules, default_region);
+
+    // coarse grid, 33 : no upper region
+    vector<int> grid;
+    for (int v = 0; v <= 32; v += TUNEGRIDSTEP)
+        grid.push_back(v);
+    grid.push_back(33);
+    int region[4];
+    for (int a = 0; a < grid.size(); ++a)
+        for (int b = a; b < grid.size(); ++b)
+            for (int c = 0; c < grid.size(); ++c)
+                for (int d = c; d < grid.size(); ++d) {
+                    region[0] = grid[a];
+                    region[1] = grid[c];
+                    region[2] = grid[b];
+                    region[3] = grid[d];
+                    EstimateRegionOnce<DIMS>(estimated, tuple_rules, region);
+                }
+
+    // local search with halving steps from the best grid points
+    vector<RegionCandidate> starts;
+    for (map<int, RegionCandidate>::iterator it = estimated.begin(); it != estimated.end(); ++it)
+        starts.push_back(it->second);
+    sort(starts.begin(), starts.end(), CmpProbeCost);
+    starts.resize(min((int)starts.size(), TUNESTARTS));
+    for (int k = 0; k < starts.size(); ++k) {
+        RegionCandidate best = starts[k];
+        for (int step = TUNEGRIDSTEP / 2; step > 0; step /= 2) {
+            bool improved = true;
+            while (improved) {
+                improved = false;
+                for (int i = 0; i < 4; ++i)
+                    for (int delta = -step; delta <= step; delta += 2 * step) {
+                        for (int j = 0; j < 4; ++j)
+                            region[j] = best.region[j];
+                        region[i] += delta;
+                        if (region[i] < 0 || region[i] > 33 || region[0] > region[2] || region[1] > region[3])
+                            continue;
+                        RegionCandidate &candidate = EstimateRegionOnce<DIMS>(estimated, tuple_rules, region);
+                        if (candidate.probe_cost < best.probe_cost) {
+                            best = candidate;
+                            improved = true;
+                        }
+                    }
+            }
+        }
+    }
+    printf("tuple rules %d  estimated regions %d\n\n", (int)tuple_rules.size(), (int)estimated.size());
+
+    // measure the cheapest by probe cost, the fewest hash nodes among the cheap ones, and the current thresholds
+    vector<RegionCandidate> candidates;
+    for (map<int, RegionCandidate>::iterator it = estimated.begin(); it != estimated.end(); ++it) {
+        bool same = false;
+        for (int i = 0; i < candidates.size() && !same; ++i)
+            same = SamePartition(candidates[i], it->second);
+        if (!same)
+            candidates.push_back(it->second);
+    }
+    vector<RegionCandidate> measured;
+    measured.push_back(estimated[RegionId(default_region)]);
+    sort(candidates.begin(), candidates.end(), CmpProbeCost);
+    double max_probe_cost = candidates[0].probe_cost * TUNESLOWDOWN;
+    for (int i = 0; i < candidates.size() && i < TUNELOOKUPCANDIDATES; ++i)
+        measured.push_back(candidates[i]);
+    sort(candidates.begin(), candidates.end(), CmpHashNodeNum);
+    for (int i = 0, k = 0; i < candidates.size() && k < TUNEMEMORYCANDIDATES; ++i)
+        if (candidates[i].probe_cost <= max_probe_cost) {
+            measured.push_back(candidates[i]);
+            ++k;
+        }
+
+    set<int> measured_ids;
+    for (int i = 0; i < measured.size(); ++i) {
+        RegionCandidate &candidate = measured[i];
+        if (!measured_ids.insert(RegionId(candidate.region)).second) {
+            candidate.lookup_speed = 0;
+            continue;
+        }
+        MeasureRegion<DIMS>(command, rules, traces, ans, candidate);
+        printf("x1 %2d y1 %2d x2 %2d y2 %2d  tuples %3d  hash_nodes %7d  probe_cost %8.2f  lookup %7.3f Mlps  memory %8.3f MB%s\n",
+               candidate.region[0], candidate.region[1], candidate.region[2], candidate.region[3],
+               candidate.tuples_num, candidate.hash_node_num, candidate.probe_cost,
+               candidate.lookup_speed, candidate.memory_size, 
+               RegionId(candidate.region) == RegionId(default_region) ? "  (current)" : "");
+    }
+    int best_lookup = 0, best_memory = -1;
+    for (int i = 1; i < measured.size(); ++i)
+        if (measured[i].lookup_speed > measured[best_lookup].lookup_speed)
+            best_lookup = i;
+    for (int i = 0; i < measured.size(); ++i)
+        if (measured[i].lookup_speed * TUNESLOWDOWN >= measured[best_lookup].lookup_speed &&
+            (best_memory < 0 || measured[i].memory_size < measured[best_memory].memory_size))
+            best_memory = i;
+    int *lookup_region = measured[best_lookup].region;
+    int *memory_region = measured[best_memory].region;
+    printf("\nbest lookup: --x1 %d --y1 %d --x2 %d --y2 %d\t%.3f Mlps\t%.3f MB\n", 
+           lookup_region[0], lookup_region[1], lookup_region[2], lookup_region[3],
+           measured[best_lookup].lookup_speed, measured[best_lookup].memory_size);
+    printf("best memory: --x1 %d --y1 %d --x2 %d --y2 %d\t%.3f Mlps\t%.3f MB\n", 
+           memory_region[0], memory_region[1], memory_region[2], memory_region[3],
+           measured[best_memory].lookup_speed, measured[best_memory].memory_size);
+    return 0;
+}
+
+int TuneMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans) {
+    if (command.method_name != "IRSS") {
+        printf("No such method %s\n", command.method_name.c_str());
+        return 1;
+    }
+    SetIRSSParameters(command);
+    if (command.prefix_dims_num == 5)
+        return TuneRegion<5>(command, rules, traces, ans);
+    return TuneRegion<2>(command, rules, traces, ans);
+}
+
+// 并发查找压力测试: 规则 i % 4 == 0 反复删除与插入, 其余规则始终存在
+struct StressShared {
+    Classifier *classifier;
+    vector<Trace*> *traces;
+    vector<int> stable_ans;  // 始终存在的规则中的最高优先级
+    vector<vector<int> > churn_ans;  // 高于 stable_ans 的反复更新规则的优先级, 升序
+    int lookup_batch;
+    bool stop;
+};
+
+struct StressThread {
+    StressShared *shared;
+    int id;
+    pthread_t thread;
+    uint64_t lookup_num;
+    uint64_t wrong_num;
+};
+
+// the result of the trace with the churned rules present or not
+bool StressResultValid(StressShared *shared, int i, int priority) {
+    if (priority == shared->stable_ans[i])
+        return true;
+    vector<int> &churn = shared->churn_ans[i];
+    return binary_search(churn.begin(), churn.end(), priority);
+}
+
+void* StressLookup(void *arg) {
+    StressThread *stress_thread = (StressThread*)arg;
+    StressShared *shared = stress_thread->shared;
+    vector<Trace*> &traces = *shared->traces;
+    int traces_num = traces.size();
+    int lookup_batch = shared->lookup_batch;
+    vector<int> out(lookup_batch);
+    uint64_t lookup_num = 0, wrong_num = 0;
+    while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < traces_num; i += lookup_batch) {
+            int n = min(lookup_batch, traces_num - i);
+            if (lookup_batch > 1)
+                shared->classifier->LookupBatch(&traces[i], n, &out[0]);
+            else
+                out[0] = shared->classifier->Lookup(traces[i], 0);
+            for (int j = 0; j < n; ++j)
+                if (!StressResultValid(shared, i + j, out[j])) {
+                    if (wrong_num == 0)
+                        printf("Wrong: thread %d trace %d lookup %d stable %d\n", stress_thread->id, i + j, out[j], shared->stable_ans[i + j]);
+                    ++wrong_num;
+                }
+            lookup_num += n;
+        }
+    }
+    stress_thread->lookup_num = lookup_num;
+    stress_thread->wrong_num = wrong_num;
+    return NULL;
+}
+
+template<int DIMS>
+int StressMultilayerTuple(CommandStruct &command, vector<Rule*> &rules, vector<Trace*> &traces) {
+    vector<Rule*> tuple_rules;
+    for (int i = 0; i < rules.size(); ++i)
+        if (rules[i]->label != IRSS_TREE_LABEL)
+            tuple_rules.push_back(rules[i]);
+    int rules_num = tuple_rules.size();
+    int traces_num = traces.size();
+
+    StressShared shared;
+    shared.traces = &traces;
+    shared.stable_ans.assign(traces_num, 0);
+    shared.churn_ans.resize(traces_num);
+    shared.lookup_batch = command.lookup_batch;
+    shared.stop = false;
+    for (int i = 0; i < traces_num; ++i) {
+        for (int j = 0; j < rules_num; ++j)
+            if (j % 4 != 0 && tuple_rules[j]->priority > shared.stable_ans[i] && MatchRuleTrace(tuple_rules[j], traces[i]))
+                shared.stable_ans[i] = tuple_rules[j]->priority;
+        for (int j = 0; j < rules_num; j += 4)
+            if (tuple_rules[j]->priority > shared.stable_ans[i] && MatchRuleTrace(tuple_rules[j], traces[i]))
+                shared.churn_ans[i].push_back(tuple_rules[j]->priority);
+        sort(shared.churn_ans[i].begin(), shared.churn_ans[i].end());
+    }
+
+    concurrent_lookup = true;
+    MultilayerTuple<DIMS> multilayertuple;
+    multilayertuple.Init(1, true);
+    multilayertuple.Create(tuple_rules, true);
+    shared.classifier = &multilayertuple;
+
+    int threads_num = command.lookup_threads_num;
+    vector<StressThread> threads(threads_num);
+    for (int i = 0; i < threads_num; ++i) {
+        threads[i].shared = &shared;
+        threads[i].id = i;
+        threads[i].lookup_num = 0;
+        threads[i].wrong_num = 0;
+        pthread_create(&threads[i].thread, NULL, StressLookup, &threads[i]);
+    }
+
+    // delete all churned rules, insert them back, until the time is up
+    int seconds = command.lookup_thread_time > 0 ? command.lookup_thread_time : 3;
+    timeval timeval_start, timeval_now;
+    gettimeofday(&timeval_start, NULL);
+    uint64_t update_num = 0;
+    uint64_t run_time = 0;
+    bool present = true;
+    while (run_time < seconds * 1000000ULL) {
+        for (int j = 0; j < rules_num; j += 4) {
+            if (present)
+                multilayertuple.DeleteRule(tuple_rules[j]);
+            else
+                multilayertuple.InsertRule(tuple_rules[j]);
+            ++update_num;
+            // update_thread_speed updates per second at most
+            while (true) {
+                gettimeofday(&timeval_now, NULL);
+                run_time = GetRunTimeUs(timeval_start, timeval_now);
+                if (command.update_thread_speed <= 0 || update_num * 1000000ULL <= run_time * command.update_thread_speed)
+                    break;
+                usleep(100);
+            }
+        }
+        present = !present;
+    }
+    __atomic_store_n(&shared.stop, true, __ATOMIC_RELAXED);
+    uint64_t lookup_num = 0, wrong_num = 0;
+    for (int i = 0; i < threads_num; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        lookup_num += threads[i].lookup_num;
+        wrong_num += threads[i].wrong_num;
+    }
+    gettimeofday(&timeval_now, NULL);
+    run_time = GetRunTimeUs(timeval_start, timeval_now);
+
+    // all rules present again, the result is exact
+    if (!present)
+        for (int j = 0; j < rules_num; j += 4)
+            multilayertuple.InsertRule(tuple_rules[j]);
+    for (int i = 0; i < traces_num; ++i) {
+        int priority = shared.churn_ans[i].empty() ? shared.stable_ans[i] : shared.churn_ans[i].back();
+        if (multilayertuple.Lookup(traces[i], 0) != priority) {
+            printf("Wrong: after the updates trace %d ans %d lookup %d\n", i, priority, multilayertuple.Lookup(traces[i], 0));
+            ++wrong_num;
+        }
+    }
+    multilayertuple.Free(false);
+    concurrent_lookup = false;
+
+    printf("lookup threads %d  time %.3f s\n", threads_num, run_time / 1000000.0);
+    printf("updates %lu  %.3f Kups\n", update_num, 1000.0 * update_num / run_time);
+    printf("lookups %lu  %.3f Mlps\n", lookup_num, 1.0 * lookup_num / run_time);
+    printf("wrong results %lu\n", wrong_num);
+    if (wrong_num > 0)
+        exit(1);
+    return 0;
+}
+
+int StressMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces) {
+    if (command.method_name != "IRSS") {
+        printf("No such method %s\n", command.method_name.c_str());
+        return 1;
+    }
+    SetIRSSParameters(command);
+    if (tuple_pruning)
+        printf("tuple_pruning is off with concurrent lookups\n");
+    if (command.prefix_dims_num == 5)
+        return StressMultilayerTuple<5>(command, rules, traces);
+    return StressMultilayerTuple<2>(command, rules, traces);
+}
+
+template<int DIMS>
+static uint64_t ImageLookupTime(CommandStruct &command, Classifier *irss, IRSSImage<DIMS> *image, vector<Trace*> &traces) {
+    int traces_num = traces.size();
+    timeval timeval_start, timeval_end;
+    vector<uint64_t> lookup_times;
+    for (int k = 0; k < command.lookup_round; ++k) {
+        gettimeofday(&timeval_start, NULL);
+        if (irss) {
+            for (int i = 0; i < traces_num; ++i)
+                irss->Lookup(traces[i], 0);
+        } else {
+            for (int i = 0; i < traces_num; ++i)
+                image->Lookup(traces[i], 0);
+        }
+        gettimeofday(&timeval_end, NULL);
+        lookup_times.push_back(GetRunTimeUs(timeval_start, timeval_end));
+    }
+    return max(GetAvgTime(lookup_times), (uint64_t)1);
+}
+
+template<int DIMS>
+static int ImageIRSS(CommandStruct &command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans) {
+    const char *file = command.image_file.c_str();
+    timeval timeval_start, timeval_end;
+    IRSSClassifier<DIMS> irss;
+    gettimeofday(&timeval_start, NULL);
+    irss.Create(rules, true);
+    gettimeofday(&timeval_end, NULL);
+    double build_time = GetRunTimeUs(timeval_start, timeval_end) / 1000000.0;
+
+    gettimeofday(&timeval_start, NULL);
+    int wrong = IRSSImage<DIMS>::Save(irss, file);
+    gettimeofday(&timeval_end, NULL);
+    double save_time = GetRunTimeUs(timeval_start, timeval_end) / 1000000.0;
+    IRSSImage<DIMS> image;
+    gettimeofday(&timeval_start, NULL);
+    if (wrong == 0)
+        wrong = image.Load(file);
+    gettimeofday(&timeval_end, NULL);
+    double load_time = GetRunTimeUs(timeval_start, timeval_end) / 1000000.0;
+    if (wrong > 0) {
+        irss.Free(false);
+        return 1;
+    }
+
+    int traces_num = traces.size();
+    int wrong_num = 0;
+    for (int i = 0; i < traces_num; ++i) {
+        int priority = image.Lookup(traces[i], 0);
+        int irss_priority = irss.Lookup(traces[i], 0);
+        if (priority != irss_priority || (command.force_test > 0 && priority != ans[i])) {
+            if (wrong_num == 0)
+                printf("May be wrong : %d lookup %d image lookup %d\n", i, irss_priority, priority);
+            ++wrong_num;
+        }
+    }
+    uint64_t lookup_time = ImageLookupTime<DIMS>(command, &irss, NULL, traces);
+    uint64_t image_lookup_time = ImageLookupTime<DIMS>(command, NULL, &image, traces);
+    uint64_t memory_size = irss.MemorySize();
+
+    printf("image_file: %s\timage_size: %.3f MB\n", file, image.ImageSize() / 1024.0 / 1024.0);
+    printf("build_time: %.3f S\tsave_time: %.3f S\tload_time: %.6f S\n", build_time, save_time, load_time);
+    printf("memory_size: %.3f MB\timage memory_size: %.3f MB\n", memory_size / 1024.0 / 1024.0, image.MemorySize() / 1024.0 / 1024.0);
+    printf("lookup_speed: %.3f MLPS\timage lookup_speed: %.3f MLPS\n", traces_num / (lookup_time / 1.0), traces_num / (image_lookup_time / 1.0));
+    printf("wrong results %d\n", wrong_num);
+    if (image.MemorySize() != memory_size)
+        ++wrong_num;
+    image.Free();
+    irss.Free(false);
+    if (wrong_num > 0)
+        exit(1);
+    return 0;
+}
+
+template<int DIMS>
+static int ImageLoadIRSS(CommandStruct &command, vector<Trace*> &traces) {
+    const char *file = command.image_file.c_str();
+    timeval timeval_start, timeval_end;
+    IRSSImage<DIMS> image;
+    gettimeofday(&timeval_start, NULL);
+    if (image.Load(file) > 0)
+        return 1;
+    gettimeofday(&timeval_end, NULL);
+    double load_time = GetRunTimeUs(timeval_start, timeval_end) / 1000000.0;
+
+    int traces_num = traces.size();
+    uint64_t image_lookup_time = ImageLookupTime<DIMS>(command, NULL, &image, traces);
+
+    printf("image_file: %s\timage_size: %.3f MB\n", file, image.ImageSize() / 1024.0 / 1024.0);
+    printf("load_time: %.6f S\n", load_time);
+    printf("image memory_size: %.3f MB\n", image.MemorySize() / 1024.0 / 1024.0);
+    printf("image lookup_speed: %.3f MLPS\n", traces_num / (image_lookup_time / 1.0));
+    image.Free();
+    return 0;
+}
+
+int ImageMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans) {
+    if (command.method_name != "IRSS") {
+        printf("No such method %s\n", command.method_name.c_str());
+        return 1;
+    }
+    if (command.image_file == "") {
+        printf("Wrong: image needs --image_file\n");
+        return 1;
+    }
+    SetIRSSParameters(command);
+    if (command.prefix_dims_num == 5)
+        return ImageIRSS<5>(command, rules, traces, ans);
+    return ImageIRSS<2>(command, rules, traces, ans);
+}
+
+int ImageLoadMainZcy(CommandStruct command, vector<Trace*> &traces) {
+    if (command.method_name != "IRSS") {
+        printf("No such method %s\n", command.method_name.c_str());
+        return 1;
+    }
+    if (command.prefix_dims_num == 5)
+        return ImageLoadIRSS<5>(command, traces);
+    return ImageLoadIRSS<2>(command, traces);
+}
@@ -7,10 +7,26 @@
 #include "../methods/multilayertuple/multilayertuple.h"
 #include "../methods/pextcuts/pextcuts.h"
 #include "../methods/pextcuts/multipextcuts.h"
+#include "../methods/irss/irss.h"
+#include "../methods/irss/irss-image.h"
+#include "../methods/flowcache/flowcache.h"
+
+#include <set>
+#include <pthread.h>
+#include <sys/resource.h>
 
 using namespace std;
 
-int ClassificationMainZcy(CommandStruct command, ProgramState *program_state, ProgramState *program_state_tree, vector<Rule*> &rules, vector<Rule*> &rule_tree, 
+int ClassificationMainZcy(CommandStruct command, ProgramState *program_state, vector<Rule*> &rules, 
                           vector<Trace*> &traces, vector<int> &ans);
+// search the MultilayerTuple region thresholds x1 y1 x2 y2 of IRSS on the rules and traces
+int TuneMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans);
+// lookup threads on a MultilayerTuple while one thread deletes and inserts a quarter of the rules,
+// every result is checked against the rules that may be present at that time
+int StressMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces);
+// build IRSS, write it to command.image_file and map it back, the image must answer every trace like IRSS
+int ImageMainZcy(CommandStruct command, vector<Rule*> &rules, vector<Trace*> &traces, vector<int> &ans);
+// map an existing command.image_file and look up the traces in it, without the rules or a build
+int ImageLoadMainZcy(CommandStruct command, vector<Trace*> &traces);
 
 #endif
\ No newline at end of file
@@ -48,14 +48,16 @@ void PrintProgramState(CommandStruct command, ProgramState *program_state, bool
     if (command.method_name == "DynamicTuple_Basic" || command.method_name == "DynamicTuple" ||
         command.method_name == "DynamicTuple_Dims" || command.method_name == "MultilayerTuple" ||
         command.method_name == "PSTSS" || command.method_name == "PartitionSort" ||
-        command.method_name == "TupleMerge")
+        command.method_name == "TupleMerge") {
         program_state->max_access_num = program_state->max_access_tuple_rule;
         program_state->tree_num = 0;
+    }
     
     if (command.method_name == "PextCuts_Basic" || command.method_name == "PextCuts" ||
-        command.method_name == "ByteCuts" || command.method_name == "CutSplit" )
+        command.method_name == "ByteCuts" || command.method_name == "CutSplit" ) {
         program_state->max_access_num =  program_state->max_access_node_rule;
         program_state->tree_num = 1;
+    }
     if (command.method_name == "MultilayerTuple" && command.prefix_dims_num ==5) {
         command.method_name = "MultilayerTuple(5)"; 
     }
@@ -149,6 +151,14 @@ void PrintProgramState(CommandStruct command, ProgramState *program_state, bool
 
 int ClassificationMain(CommandStruct command) {
 
+    //已有镜像文件时只映射镜像查找, 不读规则也不建
+    if (command.run_mode == "image" && command.image_file != "" && access(command.image_file.c_str(), F_OK) == 0) {
+        vector<Trace*> traces = ReadTraces(command.traces_file);
+        int wrong = ImageLoadMainZcy(command, traces);
+        FreeTraces(traces);
+        return wrong;
+    }
+
     //存储在哈希表里的规则
     vector<Rule*> rules = ReadRules(command.rules_file, command.rules_shuffle);
     //存储在树里的规则
@@ -157,46 +167,81 @@ int ClassificationMain(CommandStruct command) {
 
     if (command.prefix_dims_num == 5)
         rules = RulesPortPrefix(rules, true);
-    
-    vector<int> ans = GenerateAns(rules, traces, command);
-    
-    //元组结构
+    int tuple_rules_num = rules.size();
+    int tree_rules_num = rule_tree.size();
+    rules.insert(rules.end(), rule_tree.begin(), rule_tree.end());
+
+    vector<int> ans;
+    if (command.prefix_dims_num == 5) {
+        //按规则逐条展开, force_test 2 时去掉下标 i % 4 == 0 的规则的所有展开, 与测试删除的规则一致
+        vector<Rule*> ans_rules;
+        int rules_num = rules.size();
+        for (int i = 0; i < rules_num; ++i) {
+            if (command.force_test == 2 && i % 4 == 0)
+                continue;
+            vector<Rule*> rule(1, rules[i]);
+            vector<Rule*> prefix_rules = RulesPortPrefix(rule, false);
+            ans_rules.insert(ans_rules.end(), prefix_rules.begin(), prefix_rules.end());
+        }
+        CommandStruct ans_command = command;
+        if (ans_command.force_test == 2)
+            ans_command.force_test = 1;
+        ans = GenerateAns(ans_rules, traces, ans_command);
+        FreeRules(ans_rules);
+    } else {
+        ans = GenerateAns(rules, traces, command);
+    }
+
+    if (command.run_mode == "tune" || command.run_mode == "stress" || command.run_mode == "image") {
+        if (command.run_mode == "tune")
+            TuneMainZcy(command, rules, traces, ans);
+        else if (command.run_mode == "stress")
+            StressMainZcy(command, rules, traces);
+        else
+            ImageMainZcy(command, rules, traces, ans);
+        FreeRules(rules);
+        FreeTraces(traces);
+        return 0;
+    }
+
     ProgramState *program_state = new ProgramState();
     program_state->rules_num = rules.size();
     program_state->traces_num = traces.size();
-    //树结构
-    ProgramState *program_state_tree = new ProgramState();
-    program_state_tree->rules_num = rule_tree.size();
-    program_state_tree->traces_num = traces.size();
 
     if (command.method_name == "IRSS") {
-        ClassificationMainZcy(command, program_state, program_state_tree, rules, rule_tree, traces, ans);
+        ClassificationMainZcy(command, program_state, rules, traces, ans);
     } else {
         printf("No such method %s\n", command.method_name.c_str());
     }
-    //打印两个部分的情况
-    printf("元组部分: \n");
-    PrintProgramState(command, program_state, false);
-    printf("树部分: \n");
-    PrintProgramState(command, program_state_tree, false);
 
     //输出整体性能
-    ProgramState *pick_state = new ProgramState();
-    pick_state->rules_num = program_state->rules_num+program_state_tree->rules_num;
-    pick_state->rules_num = program_state->traces_num;
-    pick_state->data_memory_size = program_state->data_memory_size+program_state_tree->data_memory_size;
-    pick_state->index_memory_size = program_state->index_memory_size+program_state_tree->index_memory_size;
-
-    pick_state->build_time = program_state->build_time + program_state_tree->build_time;
-    pick_state->lookup_speed = program_state->lookup_speed * (program_state->rules_num*1.0/(program_state->rules_num+program_state_tree->rules_num)) + program_state_tree->lookup_speed * (program_state_tree->rules_num*1.0/(program_state->rules_num+program_state_tree->rules_num));
-    pick_state->update_speed = program_state->update_speed * (program_state->rules_num*1.0/(program_state->rules_num+program_state_tree->rules_num));
-
-    pick_state->tuples_num = program_state->tuples_num+program_state_tree->tuples_num;
-    pick_state->tree_num = program_state->tree_num+program_state_tree->tree_num;
     printf("整体: \n");
-    PrintProgramState(command, pick_state, true);
-    printf("元组数量:%d\t", pick_state->tuples_num);
-    printf("树数量: %d\n", pick_state->tree_num);
+    PrintProgramState(command, program_state, true);
+    printf("元组规则数:%d\t", tuple_rules_num);
+    printf("树规则数: %d\n", tree_rules_num);
+    printf("元组数量:%d\t", program_state->tuples_num);
+    printf("树数量: %d\n", program_state->tree_num);
+    printf("共享子树数: %d\t共享节省内存: %.3f MB\n", program_state->tree_shared_num,
+           1.0 * program_state->tree_shared_memory_size / 1024 / 1024);
+    printf("建树临时内存峰值(非RSS): %.3f MB\t树元组范围计算时间(各协议之和): %.3f S\n",
+           1.0 * program_state->tree_build_memory_size / 1024 / 1024, program_state->cal_time);
+    printf("建表后进程峰值RSS: %.3f MB\t建表期间峰值RSS增长: %.3f MB\n",
+           1.0 * program_state->build_peak_rss / 1024 / 1024, 1.0 * program_state->build_peak_rss_growth / 1024 / 1024);
+    if (command.pext_compare_greedy)
+        printf("切分束宽: %d\t前瞻: %d\t比贪心节省内存: %.3f MB\t比贪心减少最长查找路径: %d\n", command.pext_beam_width,
+               command.pext_lookahead, 1.0 * program_state->tree_search_saved_memory_size / 1024 / 1024, program_state->tree_search_saved_height);
+    printf("哈希: %s\t平均探测桶数: %.3f\t最大探测桶数: %d\t", HashTypeName(command.hash_type),
+           1.0 * program_state->hash_chain_sum / max(program_state->hash_node_num, 1), program_state->hash_chain_max);
+    printf("桶占用率: %.3f\t槽占用率: %.3f\n", 1.0 * program_state->bucket_use / max(program_state->bucket_sum, 1),
+           1.0 * program_state->hash_node_num / max(program_state->slot_sum, 1));
+    printf("指纹冲突数: %lu\t平均每包: %.4f\n", program_state->fingerprint_collisions,
+           1.0 * program_state->fingerprint_collisions / max(program_state->traces_num, 1));
+    if (command.tuple_pruning)
+        printf("剪枝跳过的元组探测数: %lu\t平均每包: %.2f\n", program_state->pruned_tuples,
+               1.0 * program_state->pruned_tuples / program_state->traces_num);
+    if (command.flow_cache_lines > 0)
+        printf("流缓存行数: %d\t命中率: %.3f\t有效查找速度: %.3f MLPS\n", command.flow_cache_lines,
+               1.0 * program_state->flow_cache_hits / max(program_state->flow_cache_lookups, (uint64_t)1), program_state->lookup_speed);
     
     FreeRules(rules);
     FreeTraces(traces);
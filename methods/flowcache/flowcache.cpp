@@ -0,0 +1,195 @@
+#include "flowcache.h"
+
+using namespace std;
+
+// slot of the thread in FlowCacheClassifier::caches, the same in every classifier
+static __thread int flow_cache_thread = -1;
+static int flow_cache_threads_num = 0;
+
+int FlowCache::Init(uint32_t lines_num) {
+    lines = (FlowCacheLine*)aligned_alloc(sizeof(FlowCacheLine), sizeof(FlowCacheLine) * lines_num);
+    memset(lines, 0, sizeof(FlowCacheLine) * lines_num);
+    mask = lines_num - 1;
+    victim = 0;
+    hits = 0;
+    lookups = 0;
+    return 0;
+}
+
+void FlowCache::Insert(FlowCacheLine *line, Trace *trace, uint32_t generation, int priority) {
+    if (line->generation != generation) {
+        line->generation = generation;
+        line->ways_num = 0;
+    }
+    uint32_t ports = trace->key[2] << 16 | trace->key[3];
+    for (int i = 0; i < line->ways_num; ++i)
+        if (line->ips[i] == trace->dst_src_ip && line->ports[i] == ports && line->protocol[i] == trace->key[4]) {
+            line->priority[i] = priority;
+            return;
+        }
+    int way = line->ways_num;
+    if (way < FLOWCACHEWAYS) {
+        ++line->ways_num;
+    } else {
+        way = victim;
+        victim = (victim + 1) % FLOWCACHEWAYS;
+    }
+    line->ips[way] = trace->dst_src_ip;
+    line->ports[way] = ports;
+    line->protocol[way] = trace->key[4];
+    line->priority[way] = priority;
+}
+
+uint64_t FlowCache::MemorySize() {
+    return sizeof(FlowCache) + sizeof(FlowCacheLine) * (mask + 1);
+}
+
+void FlowCache::Free() {
+    free(lines);
+    lines = NULL;
+}
+
+FlowCacheClassifier::FlowCacheClassifier(Classifier *_classifier, uint32_t _lines_num) {
+    classifier = _classifier;
+    lines_num = _lines_num;
+    generation = 1;
+    for (int i = 0; i < FLOWCACHETHREADS; ++i)
+        caches[i] = NULL;
+}
+
+// the slot is kept when the thread exits, at most FLOWCACHETHREADS lookup threads in a process
+FlowCache* FlowCacheClassifier::ThreadCache() {
+    if (flow_cache_thread < 0) {
+        flow_cache_thread = __atomic_fetch_add(&flow_cache_threads_num, 1, __ATOMIC_RELAXED);
+        if (flow_cache_thread >= FLOWCACHETHREADS) {
+            printf("Wrong: more than %d flow cache threads\n", FLOWCACHETHREADS);
+            exit(1);
+        }
+    }
+    FlowCache *cache = caches[flow_cache_thread];
+    if (!cache) {
+        cache = (FlowCache*)malloc(sizeof(FlowCache));
+        cache->Init(lines_num);
+        __atomic_store_n(&caches[flow_cache_thread], cache, __ATOMIC_RELEASE);
+    }
+    return cache;
+}
+
+int FlowCacheClassifier::Create(vector<Rule*> &rules, bool insert) {
+    int ret = classifier->Create(rules, insert);
+    __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+int FlowCacheClassifier::InsertRule(Rule *rule) {
+    int ret = classifier->InsertRule(rule);
+    __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+int FlowCacheClassifier::DeleteRule(Rule *rule) {
+    int ret = classifier->DeleteRule(rule);
+    __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// the cache holds Lookup(trace, 0)
+int FlowCacheClassifier::Lookup(Trace *trace, int priority) {
+    FlowCache *cache = ThreadCache();
+    uint32_t current_generation = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    FlowCacheLine *line = cache->Line(trace);
+    int cached_priority = cache->Find(line, trace, current_generation);
+    if (cached_priority < 0) {
+        cached_priority = classifier->Lookup(trace, 0);
+        cache->Insert(line, trace, current_generation, cached_priority);
+    }
+    return max(priority, cached_priority);
+}
+
+int FlowCacheClassifier::LookupBatch(Trace **traces, int n, int *out) {
+    FlowCache *cache = ThreadCache();
+    uint32_t current_generation = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    FlowCacheLine *lines[FLOWCACHEBATCH];
+    Trace *miss_traces[FLOWCACHEBATCH];
+    int miss_index[FLOWCACHEBATCH];
+    int miss_out[FLOWCACHEBATCH];
+    for (int start = 0; start < n; start += FLOWCACHEBATCH) {
+        int batch_num = min(n - start, FLOWCACHEBATCH);
+        for (int i = 0; i < batch_num; ++i) {
+            lines[i] = cache->Line(traces[start + i]);
+            _mm_prefetch((const char*)lines[i], _MM_HINT_T0);
+        }
+        // a miss is cached at once as pending (-2 - its miss index), the same flow later in the batch waits for it
+        int miss_num = 0;
+        for (int i = 0; i < batch_num; ++i) {
+            out[start + i] = cache->Find(lines[i], traces[start + i], current_generation);
+            if (out[start + i] == -1) {
+                miss_traces[miss_num] = traces[start + i];
+                miss_index[miss_num] = i;
+                cache->Insert(lines[i], traces[start + i], current_generation, -2 - miss_num);
+                ++miss_num;
+            }
+        }
+        if (miss_num == 0)
+            continue;
+        classifier->LookupBatch(miss_traces, miss_num, miss_out);
+        for (int i = 0; i < miss_num; ++i) {
+            int j = miss_index[i];
+            out[start + j] = miss_out[i];
+            cache->Insert(lines[j], traces[start + j], current_generation, miss_out[i]);
+        }
+        for (int i = 0; i < batch_num; ++i)
+            if (out[start + i] < -1)
+                out[start + i] = miss_out[-2 - out[start + i]];
+    }
+    return 0;
+}
+
+int FlowCacheClassifier::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) {
+    return classifier->LookupAccess(trace, priority, ans_rule, program_state);
+}
+
+int FlowCacheClassifier::Reconstruct() {
+    int ret = classifier->Reconstruct();
+    __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+uint64_t FlowCacheClassifier::MemorySize() {
+    uint64_t memory_size = sizeof(FlowCacheClassifier) + classifier->MemorySize();
+    for (int i = 0; i < FLOWCACHETHREADS; ++i)
+        if (caches[i])
+            memory_size += caches[i]->MemorySize();
+    return memory_size;
+}
+
+int FlowCacheClassifier::CalculateState(ProgramState *program_state) {
+    classifier->CalculateState(program_state);
+    for (int i = 0; i < FLOWCACHETHREADS; ++i)
+        if (caches[i]) {
+            program_state->flow_cache_hits += caches[i]->hits;
+            program_state->flow_cache_lookups += caches[i]->lookups;
+        }
+    return 0;
+}
+
+int FlowCacheClassifier::GetRules(vector<Rule*> &rules) {
+    return classifier->GetRules(rules);
+}
+
+int FlowCacheClassifier::Free(bool free_self) {
+    for (int i = 0; i < FLOWCACHETHREADS; ++i)
+        if (caches[i]) {
+            caches[i]->Free();
+            free(caches[i]);
+            caches[i] = NULL;
+        }
+    classifier->Free(false);
+    if (free_self)
+        free(this);
+    return 0;
+}
+
+int FlowCacheClassifier::Test(void *ptr) {
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef  FLOWCACHE_H
+#define  FLOWCACHE_H
+
+#include "../../elementary.h"
+
+#include <nmmintrin.h>
+
+#define FLOWCACHEWAYS 3  // flows per cache line
+#define FLOWCACHETHREADS 64  // lookup threads of one FlowCacheClassifier
+#define FLOWCACHEBATCH 64  // packets of LookupBatch probed before the misses go to the classifier
+
+using namespace std;
+
+// One cache line holds the priorities of FLOWCACHEWAYS flows of the same set.
+// The line is empty when its generation is not the generation of the classifier.
+struct FlowCacheLine {
+    uint64_t ips[FLOWCACHEWAYS];  // Trace::dst_src_ip
+    uint32_t ports[FLOWCACHEWAYS];  // src port << 16 | dst port
+    int priority[FLOWCACHEWAYS];
+    uint8_t protocol[FLOWCACHEWAYS];
+    uint8_t ways_num;
+    uint32_t generation;
+} __attribute__((aligned(64)));
+
+// the exact match cache of one thread, set associative, round robin in a line
+struct FlowCache {
+    FlowCacheLine *lines;
+    uint32_t mask;  // lines num - 1
+    uint32_t victim;  // way replaced when a full line misses
+    uint64_t hits;
+    uint64_t lookups;
+
+    int Init(uint32_t lines_num);  // lines_num : power of 2
+    FlowCacheLine* Line(Trace *trace) {
+        uint32_t hash = _mm_crc32_u64(0, trace->dst_src_ip);
+        hash = _mm_crc32_u32(hash, trace->key[2] << 16 | trace->key[3]);
+        hash = _mm_crc32_u32(hash, trace->key[4]);
+        return &lines[hash & mask];
+    }
+    // priority of the flow, -1 on miss, < -1 pending in LookupBatch
+    int Find(FlowCacheLine *line, Trace *trace, uint32_t generation) {
+        ++lookups;
+        if (line->generation != generation)
+            return -1;
+        uint32_t ports = trace->key[2] << 16 | trace->key[3];
+        for (int i = 0; i < line->ways_num; ++i)
+            if (line->ips[i] == trace->dst_src_ip && line->ports[i] == ports && line->protocol[i] == trace->key[4]) {
+                ++hits;
+                return line->priority[i];
+            }
+        return -1;
+    }
+    void Insert(FlowCacheLine *line, Trace *trace, uint32_t generation, int priority);  // replaces the flow if cached
+    uint64_t MemorySize();
+    void Free();
+};
+
+// Any Classifier with a FlowCache per lookup thread in front of Lookup and LookupBatch.
+// InsertRule and DeleteRule raise the generation after the update, every cached priority is dropped;
+// a lookup caches its result with the generation read before it, so a result that may miss an update is never used.
+// LookupAccess is not cached, it measures the classifier.
+class FlowCacheClassifier : public Classifier {
+public:
+    FlowCacheClassifier(Classifier *_classifier, uint32_t _lines_num);  // _lines_num : per thread, power of 2
+
+    int Create(vector<Rule*> &rules, bool insert);
+
+    int InsertRule(Rule *rule);
+    int DeleteRule(Rule *rule);
+    int Lookup(Trace *trace, int priority);
+    int LookupBatch(Trace **traces, int n, int *out);
+    int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state);
+
+    int Reconstruct();
+    uint64_t MemorySize();
+    int CalculateState(ProgramState *program_state);  // also flow_cache_hits and flow_cache_lookups
+    int GetRules(vector<Rule*> &rules);
+    int Free(bool free_self);  // frees the classifier with free_self false, its owner keeps it
+    int Test(void *ptr);
+
+    FlowCache* ThreadCache();
+
+    Classifier *classifier;
+    uint32_t lines_num;
+    uint32_t generation;
+    FlowCache *caches[FLOWCACHETHREADS];  // by the thread slot, created by the thread on its first lookup
+};
+
+#endif
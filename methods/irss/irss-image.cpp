@@ -0,0 +1,483 @@
+#include "irss-image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+void IRSSImageWriter::Init() {
+    data = NULL;
+    size = 0;
+    capacity = 0;
+    written.clear();
+}
+
+uint64_t IRSSImageWriter::Alloc(uint64_t _size) {
+    uint64_t offset = (size + IRSSIMAGEALIGN - 1) / IRSSIMAGEALIGN * IRSSIMAGEALIGN;
+    if (offset + _size > capacity) {
+        uint64_t origin_capacity = capacity;
+        capacity = max(offset + _size, capacity == 0 ? (uint64_t)4096 : capacity * 2);
+        data = (char*)realloc(data, capacity);
+        memset(data + origin_capacity, 0, capacity - origin_capacity);
+    }
+    size = offset + _size;
+    return offset;
+}
+
+void IRSSImageWriter::Free() {
+    free(data);
+    Init();
+}
+
+// only the fields Match reads, capacity = rules_num
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::WriteRuleArray(IRSSImageWriter &writer, MRuleArray *block) {
+    uint32_t rules_num = block->rules_num;
+    uint64_t offset = writer.Alloc((uint64_t)(mrule_size - sizeof(Rule*)) * rules_num);
+    char *data = writer.At<char>(offset);
+    for (int i = 0; i < MRULEFIELDS - 1; ++i) {
+        memcpy(data, block->Field(i), mrule_field_size[i] * rules_num);
+        data += mrule_field_size[i] * rules_num;
+    }
+    return offset;
+}
+
+// children are written before their parents, an Alloc may move writer.data
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::WriteHashNode(IRSSImageWriter &writer, MHashNode<DIMS> *hash_node) {
+    vector<IImageBlock> blocks;
+    MRuleBlocks &rule_blocks = hash_node->rule_blocks;
+    for (int i = 0; i < rule_blocks.blocks_num; ++i) {
+        MRuleArray *block = rule_blocks.Block(i);
+        if (block->rules_num == 0)
+            continue;
+        IImageBlock image_block;
+        image_block.data = WriteRuleArray(writer, block);
+        image_block.rules_num = block->rules_num;
+        image_block.capacity = block->capacity;
+        blocks.push_back(image_block);
+    }
+    uint64_t next_layer = 0;
+    if (hash_node->has_next_multilayertuple)
+        next_layer = WriteLayer(writer, hash_node->next_multilayertuple);
+    uint64_t blocks_offset = 0;
+    if (blocks.size() > 0) {
+        blocks_offset = writer.Alloc(sizeof(IImageBlock) * blocks.size());
+        memcpy(writer.At<IImageBlock>(blocks_offset), &blocks[0], sizeof(IImageBlock) * blocks.size());
+    }
+    uint64_t offset = writer.Alloc(sizeof(IImageHashNode<DIMS>));
+    IImageHashNode<DIMS> *image_node = writer.At<IImageHashNode<DIMS>>(offset);
+    image_node->key = hash_node->key;
+    image_node->next_layer = next_layer;
+    image_node->blocks_num = blocks.size();
+    image_node->max_blocks_num = rule_blocks.max_blocks_num;
+    image_node->blocks = blocks_offset;
+    return offset;
+}
+
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::WriteLayer(IRSSImageWriter &writer, MultilayerTuple<DIMS> *multilayertuple) {
+    int tuples_num = multilayertuple->tuples_num;
+    vector<IImageTuple> tuples(tuples_num);
+    for (int i = 0; i < tuples_num; ++i) {
+        MTuple<DIMS> *tuple = multilayertuple->tuples_arr[i];
+        MHashView<DIMS> *view = tuple->hash_table.View();
+        uint32_t buckets_num = view->mask + 1;
+        vector<uint64_t> hash_nodes(buckets_num * MHASHBUCKETSLOTS, 0);
+        for (uint32_t j = 0; j < buckets_num * MHASHBUCKETSLOTS; ++j)
+            if (view->buckets[j / MHASHBUCKETSLOTS].max_priority[j % MHASHBUCKETSLOTS] > 0 && view->hash_node_arr[j])
+                hash_nodes[j] = WriteHashNode(writer, view->hash_node_arr[j]);
+
+        IImageTuple &image_tuple = tuples[i];
+        memset(&image_tuple, 0, sizeof(IImageTuple));
+        for (int k = 0; k < DIMS; ++k)
+            image_tuple.prefix_len_zero[k] = tuple->prefix_len_zero[k];
+        image_tuple.max_priority = tuple->max_priority;
+        image_tuple.mask = view->mask;
+        image_tuple.buckets = writer.Alloc(sizeof(MHashBucket) * buckets_num);
+        memcpy(writer.At<MHashBucket>(image_tuple.buckets), view->buckets, sizeof(MHashBucket) * buckets_num);
+        image_tuple.hash_nodes = writer.Alloc(sizeof(uint64_t) * hash_nodes.size());
+        memcpy(writer.At<uint64_t>(image_tuple.hash_nodes), &hash_nodes[0], sizeof(uint64_t) * hash_nodes.size());
+    }
+    uint64_t tuples_offset = 0;
+    if (tuples_num > 0) {
+        tuples_offset = writer.Alloc(sizeof(IImageTuple) * tuples_num);
+        memcpy(writer.At<IImageTuple>(tuples_offset), &tuples[0], sizeof(IImageTuple) * tuples_num);
+    }
+    uint64_t offset = writer.Alloc(sizeof(IImageLayer));
+    IImageLayer *layer = writer.At<IImageLayer>(offset);
+    layer->tuples_num = tuples_num;
+    layer->max_priority = multilayertuple->max_priority;
+    layer->tuples = tuples_offset;
+    layer->max_tuples_num = multilayertuple->max_tuples_num;
+    layer->tuples_map_capacity = multilayertuple->tuples_map.mask + 1;
+    if (multilayertuple->tuple_pruning) {
+        TupleTrie *tries[2] = {&multilayertuple->src_ip_trie, &multilayertuple->dst_ip_trie};
+        for (int k = 0; k < 2; ++k) {
+            layer->trie_nodes_num[k] = tries[k]->root->CountNum();
+            layer->trie_tuple_rules_num[k] = tries[k]->root->TupleRulesNumSize();
+        }
+    }
+    return offset;
+}
+
+// duplicate nodes share the children of the node they copy, the shared arrays are written once
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::WritePextNodes(IRSSImageWriter &writer, PextNode *nodes, int nodes_num) {
+    if (writer.written.find(nodes) != writer.written.end())
+        return writer.written[nodes];
+    vector<IImagePextNode> image_nodes(nodes_num);
+    for (int i = 0; i < nodes_num; ++i) {
+        PextNode *node = &nodes[i];
+        IImagePextNode &image_node = image_nodes[i];
+        memset(&image_node, 0, sizeof(IImagePextNode));
+        image_node.type = node->type;
+        image_node.dim = node->dim;
+        image_node.layer = node->layer;
+        image_node.max_priority = node->max_priority;
+        // the first node written owns its children, which one was built depends on the build threads
+        if (node->type == PextLeaf)
+            image_node.duplicate = node->rules_arr_num == 0 || writer.written.find(node->rules_arr) != writer.written.end();
+        else
+            image_node.duplicate = writer.written.find(node->children) != writer.written.end();
+        if (node->type == PextCutIp) {
+            image_node.cut_ip_bits = node->cut_ip_bits;
+            image_node.children = WritePextNodes(writer, node->children, 1 << Popcnt(node->cut_ip_bits));
+        } else if (node->type == PextCutPort) {
+            image_node.cut_port_bits = node->cut_port_bits;
+            image_node.children = WritePextNodes(writer, node->children, 1 << Popcnt(node->cut_port_bits));
+        } else {
+            image_node.rules_arr_num = node->rules_arr_num;
+            if (writer.written.find(node->rules_arr) != writer.written.end()) {
+                image_node.children = writer.written[node->rules_arr];
+            } else if (node->rules_arr_num > 0) {
+                // field by field, the padding of rules_arr is not initialized
+                image_node.children = writer.Alloc(sizeof(PextRuleNode) * node->rules_arr_num);
+                PextRuleNode *rules_arr = writer.At<PextRuleNode>(image_node.children);
+                for (int j = 0; j < node->rules_arr_num; ++j) {
+                    PextRuleNode &rule = node->rules_arr[j];
+                    rules_arr[j].src_ip_begin = rule.src_ip_begin;
+                    rules_arr[j].src_ip_end = rule.src_ip_end;
+                    rules_arr[j].dst_ip_begin = rule.dst_ip_begin;
+                    rules_arr[j].dst_ip_end = rule.dst_ip_end;
+                    rules_arr[j].src_port_begin = rule.src_port_begin;
+                    rules_arr[j].src_port_end = rule.src_port_end;
+                    rules_arr[j].dst_port_begin = rule.dst_port_begin;
+                    rules_arr[j].dst_port_end = rule.dst_port_end;
+                    rules_arr[j].protocol_begin = rule.protocol_begin;
+                    rules_arr[j].protocol_end = rule.protocol_end;
+                    rules_arr[j].priority = rule.priority;
+                }
+                writer.written[node->rules_arr] = image_node.children;
+            }
+        }
+    }
+    uint64_t offset = writer.Alloc(sizeof(IImagePextNode) * max(nodes_num, 1));
+    if (nodes_num > 0)
+        memcpy(writer.At<IImagePextNode>(offset), &image_nodes[0], sizeof(IImagePextNode) * nodes_num);
+    writer.written[nodes] = offset;
+    return offset;
+}
+
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::WritePextCuts(IRSSImageWriter &writer, PextCuts *pextcuts) {
+    uint64_t trees = WritePextNodes(writer, pextcuts->trees, pextcuts->trees_num);
+    uint64_t offset = writer.Alloc(sizeof(IImagePextCuts));
+    IImagePextCuts *image_pextcuts = writer.At<IImagePextCuts>(offset);
+    image_pextcuts->trees_num = pextcuts->trees_num;
+    image_pextcuts->trees = trees;
+    return offset;
+}
+
+// irss is not updated while it is written, the image has no inserted rules outside the trees
+// and no hash node in the middle of a migration
+template<int DIMS>
+int IRSSImage<DIMS>::Save(IRSSClassifier<DIMS> &irss, const char *file) {
+    irss.Reconstruct();
+    IRSSImageWriter writer;
+    writer.Init();
+    uint64_t header_offset = writer.Alloc(sizeof(IRSSImageHeader));
+    uint64_t tuple_layer = WriteLayer(writer, &irss.multilayertuple);
+    uint64_t pextcuts[256];
+    MultiPextCuts &multipextcuts = irss.multipextcuts;
+    for (int i = 0; i < 256; ++i)
+        if (multipextcuts.OwnTrees(i))
+            pextcuts[i] = WritePextCuts(writer, multipextcuts.pextcuts[i]);
+        else
+            pextcuts[i] = pextcuts[0];
+
+    IRSSImageHeader *image_header = writer.At<IRSSImageHeader>(header_offset);
+    image_header->magic = IRSSIMAGEMAGIC;
+    image_header->image_size = writer.size;
+    image_header->dims = DIMS;
+    image_header->hash_type = irss.multilayertuple.hash_type;
+    image_header->tree_max_priority = irss.tree_max_priority;
+    image_header->tuple_layer = tuple_layer;
+    memcpy(image_header->pextcuts, pextcuts, sizeof(pextcuts));
+
+    FILE *fp = fopen(file, "wb");
+    if (fp == NULL) {
+        printf("Wrong: can not open %s\n", file);
+        writer.Free();
+        return 1;
+    }
+    bool wrong = fwrite(writer.data, 1, writer.size, fp) != writer.size;
+    wrong |= fclose(fp) != 0;
+    writer.Free();
+    if (wrong) {
+        printf("Wrong: can not write %s\n", file);
+        return 1;
+    }
+    return 0;
+}
+
+template<int DIMS>
+int IRSSImage<DIMS>::Load(const char *file) {
+    image = NULL;
+    header = NULL;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        printf("Wrong: can not open %s\n", file);
+        return 1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || file_stat.st_size < sizeof(IRSSImageHeader)) {
+        printf("Wrong: %s is not an IRSS image\n", file);
+        close(fd);
+        return 1;
+    }
+    void *addr = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        printf("Wrong: can not map %s\n", file);
+        return 1;
+    }
+    image = (char*)addr;
+    header = (IRSSImageHeader*)image;
+    if (header->magic != IRSSIMAGEMAGIC || header->image_size != file_stat.st_size || header->dims != DIMS) {
+        printf("Wrong: %s is not an IRSS image of %d dims\n", file, DIMS);
+        munmap(image, file_stat.st_size);
+        image = NULL;
+        header = NULL;
+        return 1;
+    }
+    if (header->hash_type < 0 || header->hash_type >= HASH_TYPES_NUM) {
+        printf("Wrong: %s has hash_type %d\n", file, header->hash_type);
+        Free();
+        return 1;
+    }
+    if (header->hash_type == HASH_TABULATION)
+        InitTabulationTable();
+    return 0;
+}
+
+// MultilayerTuple::Lookup on the image
+template<int DIMS>
+template<int HASH>
+int IRSSImage<DIMS>::LookupLayer(IImageLayer *layer, Trace *trace, int priority) {
+    IImageTuple *tuples = At<IImageTuple>(layer->tuples);
+    for (int i = 0; i < layer->tuples_num; ++i) {
+        IImageTuple *tuple = &tuples[i];
+        if (priority >= tuple->max_priority)
+            break;
+        uint32_t hash;
+        Key key = GetKey<DIMS, HASH>(trace->key, tuple->prefix_len_zero, hash);
+        MHashBucket *buckets = At<MHashBucket>(tuple->buckets);
+        uint64_t *hash_nodes = At<uint64_t>(tuple->hash_nodes);
+        uint16_t fingerprint = HashFingerprint(hash);
+        uint32_t index = hash & tuple->mask;
+        IImageHashNode<DIMS> *hash_node = NULL;
+        while (!hash_node) {
+            MHashBucket *bucket = &buckets[index];
+            uint32_t slots = bucket->MatchSlots(fingerprint, priority);
+            while (slots) {
+                IImageHashNode<DIMS> *slot_node = At<IImageHashNode<DIMS>>(hash_nodes[index * MHASHBUCKETSLOTS + __builtin_ctz(slots)]);
+                if (slot_node->key == key) {
+                    hash_node = slot_node;
+                    break;
+                }
+                slots &= slots - 1;
+            }
+            if (hash_node || priority >= bucket->overflow_max_priority)
+                break;
+            index = (index + 1) & tuple->mask;
+        }
+        if (!hash_node)
+            continue;
+
+        if (hash_node->next_layer)
+            priority = LookupLayer<HASH>(At<IImageLayer>(hash_node->next_layer), trace, priority);
+        IImageBlock *blocks = At<IImageBlock>(hash_node->blocks);
+        for (int j = 0; j < hash_node->blocks_num; ++j) {
+            MRuleArray block;
+            block.data = At<char>(blocks[j].data);
+            block.rules_num = blocks[j].rules_num;
+            block.capacity = blocks[j].rules_num;
+            if (priority >= block.Priority()[0])
+                break;
+            int scan_num = 0;
+            int rule_index = block.Match(trace, priority, scan_num);
+            if (rule_index >= 0) {
+                priority = block.Priority()[rule_index];
+                break;
+            }
+        }
+    }
+    return priority;
+}
+
+// MultiPextCuts::Lookup on the image
+template<int DIMS>
+int IRSSImage<DIMS>::LookupPextCuts(IImagePextCuts *pextcuts, Trace *trace, int priority) {
+    IImagePextNode *trees = At<IImagePextNode>(pextcuts->trees);
+    for (int i = 0; i < pextcuts->trees_num; ++i) {
+        IImagePextNode *pext_node = &trees[i];
+        if (priority >= pext_node->max_priority)
+            break;
+        while (true) {
+            if (pext_node->type == PextCutIp) {
+                pext_node = At<IImagePextNode>(pext_node->children) + _pext_u64(trace->dst_src_ip, pext_node->cut_ip_bits);
+            } else if (pext_node->type == PextCutPort) {
+                pext_node = At<IImagePextNode>(pext_node->children) + _pext_u32(trace->key[pext_node->dim], pext_node->cut_port_bits);
+            } else {
+                PextRuleNode *rules_arr = At<PextRuleNode>(pext_node->children);
+                for (int j = 0; j < pext_node->rules_arr_num; ++j) {
+                    if (priority >= rules_arr[j].priority)
+                        break;
+                    if (rules_arr[j].src_ip_begin   <= trace->key[0] && trace->key[0] <= rules_arr[j].src_ip_end &&
+                        rules_arr[j].dst_ip_begin   <= trace->key[1] && trace->key[1] <= rules_arr[j].dst_ip_end &&
+                        rules_arr[j].src_port_begin <= trace->key[2] && trace->key[2] <= rules_arr[j].src_port_end &&
+                        rules_arr[j].dst_port_begin <= trace->key[3] && trace->key[3] <= rules_arr[j].dst_port_end) {
+                        priority = rules_arr[j].priority;
+                        break;
+                    }
+                }
+                break;
+            }
+            if (priority >= pext_node->max_priority)
+                break;
+        }
+    }
+    return priority;
+}
+
+// IRSSClassifier::Lookup on the image
+template<int DIMS>
+int IRSSImage<DIMS>::Lookup(Trace *trace, int priority) {
+    switch (header->hash_type) {
+    case HASH_CRC32C:
+        return LookupHash<HASH_CRC32C>(trace, priority);
+    case HASH_XORSHIFT:
+        return LookupHash<HASH_XORSHIFT>(trace, priority);
+    case HASH_TABULATION:
+        return LookupHash<HASH_TABULATION>(trace, priority);
+    }
+    return LookupHash<HASH_MULT>(trace, priority);
+}
+
+template<int DIMS>
+template<int HASH>
+int IRSSImage<DIMS>::LookupHash(Trace *trace, int priority) {
+    IImageLayer *layer = At<IImageLayer>(header->tuple_layer);
+    IImagePextCuts *pextcuts = At<IImagePextCuts>(header->pextcuts[trace->key[4]]);
+    if (header->tree_max_priority > layer->max_priority) {
+        priority = LookupPextCuts(pextcuts, trace, priority);
+        priority = LookupLayer<HASH>(layer, trace, priority);
+    } else {
+        priority = LookupLayer<HASH>(layer, trace, priority);
+        priority = LookupPextCuts(pextcuts, trace, priority);
+    }
+    return priority;
+}
+
+// MultilayerTuple::MemorySize of a layer without the start tuple layer parts,
+// the blocks the layer has in the slab are added to slab_size
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::LayerMemorySize(IImageLayer *layer, uint64_t &slab_size) {
+    uint64_t memory_size = sizeof(MTuple<DIMS>*) * layer->max_tuples_num;
+    memory_size += MTupleMap<DIMS>::MemorySize(layer->tuples_map_capacity);
+    if (layer->trie_nodes_num[0] > 0)
+        for (int k = 0; k < 2; ++k)
+            memory_size += TupleTrie::NodesMemory(layer->trie_nodes_num[k], layer->trie_tuple_rules_num[k]);
+    slab_size += MSlab::BlockSize(MTupleList<DIMS>::Size(layer->tuples_num));
+    IImageTuple *tuples = At<IImageTuple>(layer->tuples);
+    for (int i = 0; i < layer->tuples_num; ++i) {
+        IImageTuple *tuple = &tuples[i];
+        slab_size += MSlab::BlockSize(sizeof(MTuple<DIMS>)) + MSlab::BlockSize(sizeof(MHashView<DIMS>));
+        memory_size += MHashTable<DIMS>::ArraysSize(tuple->mask + 1);
+        uint64_t *hash_nodes = At<uint64_t>(tuple->hash_nodes);
+        for (uint32_t j = 0; j < (tuple->mask + 1) * MHASHBUCKETSLOTS; ++j) {
+            if (!hash_nodes[j])
+                continue;
+            IImageHashNode<DIMS> *hash_node = At<IImageHashNode<DIMS>>(hash_nodes[j]);
+            slab_size += MSlab::BlockSize(sizeof(MHashNode<DIMS>));
+            if (hash_node->max_blocks_num > 1)
+                slab_size += MSlab::BlockSize(sizeof(MRuleArray) * (hash_node->max_blocks_num - 1));
+            IImageBlock *blocks = At<IImageBlock>(hash_node->blocks);
+            for (int k = 0; k < hash_node->blocks_num; ++k)
+                slab_size += MSlab::BlockSize(MRuleArray::BufferSize(blocks[k].capacity));
+            if (hash_node->next_layer) {
+                slab_size += MSlab::BlockSize(sizeof(MultilayerTuple<DIMS>));
+                memory_size += LayerMemorySize(At<IImageLayer>(hash_node->next_layer), slab_size);
+            }
+        }
+    }
+    return memory_size;
+}
+
+// PextNode::MemorySize, a shared array is counted by the node that was written first
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::PextNodeMemorySize(IImagePextNode *node) {
+    uint64_t memory_size = sizeof(PextNode);
+    if (node->duplicate)
+        return memory_size;
+    if (node->type == PextCutIp || node->type == PextCutPort) {
+        int children_num = 1 << (node->type == PextCutIp ? Popcnt(node->cut_ip_bits) : Popcnt(node->cut_port_bits));
+        IImagePextNode *children = At<IImagePextNode>(node->children);
+        for (int i = 0; i < children_num; ++i)
+            memory_size += PextNodeMemorySize(&children[i]);
+    } else {
+        memory_size += sizeof(PextRuleNode) * node->rules_arr_num;
+    }
+    return memory_size;
+}
+
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::MemorySize() {
+    uint64_t memory_size = sizeof(IRSSClassifier<DIMS>);
+    // MultilayerTuple::MemorySize of the start tuple layer without the object itself, no hash node migrates
+    uint64_t slab_size = 0;
+    memory_size += sizeof(MSlab) + sizeof(MMigration<DIMS>);
+    memory_size += LayerMemorySize(At<IImageLayer>(header->tuple_layer), slab_size);
+    memory_size += slab_size;
+    // MultiPextCuts::MemorySize without the object itself, the deltas are empty
+    for (int i = 0; i < 256; ++i) {
+        if (i > 0 && header->pextcuts[i] == header->pextcuts[0])
+            continue;
+        IImagePextCuts *pextcuts = At<IImagePextCuts>(header->pextcuts[i]);
+        IImagePextNode *trees = At<IImagePextNode>(pextcuts->trees);
+        memory_size += sizeof(PextCuts);
+        for (int j = 0; j < pextcuts->trees_num; ++j)
+            memory_size += PextNodeMemorySize(&trees[j]);
+    }
+    return memory_size;
+}
+
+template<int DIMS>
+uint64_t IRSSImage<DIMS>::ImageSize() {
+    return header->image_size;
+}
+
+template<int DIMS>
+int IRSSImage<DIMS>::Free() {
+    if (image)
+        munmap(image, header->image_size);
+    image = NULL;
+    header = NULL;
+    return 0;
+}
+
+template class IRSSImage<2>;
+template class IRSSImage<5>;
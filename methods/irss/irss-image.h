@@ -0,0 +1,134 @@
+#ifndef  IRSSIMAGE_H
+#define  IRSSIMAGE_H
+
+#include "../../elementary.h"
+#include "irss.h"
+
+#include <immintrin.h>
+
+#define IRSSIMAGEMAGIC 0x32474d4953535249ULL  // "IRSSIMG2"
+#define IRSSIMAGEALIGN 64
+
+using namespace std;
+
+// A built IRSSClassifier as one file without pointers, every reference is an offset from the image start.
+// IRSSImage::Load maps the file read-only and looks up in place, processes mapping the same file share its pages.
+// Rule pointers are not kept, an image only answers priorities.
+// The image also keeps the counts MemorySize needs for the classifier it was written from,
+// such as the capacities of the rule arrays, it does not keep the memory size itself.
+
+struct IRSSImageHeader {
+    uint64_t magic;
+    uint64_t image_size;
+    uint32_t dims;
+    int hash_type;  // the tuple keys were hashed with it
+    int tree_max_priority;
+    int reserved;
+    uint64_t tuple_layer;  // IImageLayer of the start tuple layer
+    uint64_t pextcuts[256];  // IImagePextCuts of each protocol
+};
+
+struct IImageLayer {
+    int tuples_num;
+    int max_priority;
+    uint64_t tuples;  // IImageTuple[tuples_num], sorted by max_priority
+    int max_tuples_num;
+    uint32_t tuples_map_capacity;
+    uint32_t trie_nodes_num[2];  // src/dst ip TupleTrie, 0 without tuple_pruning
+    uint32_t trie_tuple_rules_num[2];
+};
+
+struct IImageTuple {
+    uint32_t prefix_len_zero[5];
+    int max_priority;
+    uint32_t mask;
+    uint32_t reserved;
+    uint64_t buckets;  // MHashBucket[mask + 1]
+    uint64_t hash_nodes;  // uint64_t[(mask + 1) * MHASHBUCKETSLOTS], 0 : empty slot
+};
+
+// MRuleArray without the rule field, data is an offset and holds rules_num rules
+struct IImageBlock {
+    uint64_t data;
+    uint32_t rules_num;
+    uint32_t capacity;  // of the MRuleArray written
+};
+
+template<int DIMS>
+struct IImageHashNode {
+    typename MKeyTraits<DIMS>::Key key;
+    uint64_t next_layer;  // IImageLayer, 0 if none
+    uint32_t blocks_num;  // non-empty blocks
+    uint32_t max_blocks_num;  // of the MRuleBlocks written
+    uint64_t blocks;  // IImageBlock[blocks_num]
+};
+
+struct IImagePextCuts {
+    int trees_num;
+    int reserved;
+    uint64_t trees;  // IImagePextNode[trees_num]
+};
+
+// PextNode with children or rules_arr as an offset
+struct IImagePextNode {
+    char type;
+    char dim;
+    char layer;
+    bool duplicate;
+    int max_priority;
+    union {
+        uint64_t cut_ip_bits;
+        uint32_t cut_port_bits;
+        uint32_t rules_arr_num;
+    };
+    uint64_t children;  // IImagePextNode[] or PextRuleNode[]
+};
+
+// the image being written, grows with realloc so everything is addressed by offset
+struct IRSSImageWriter {
+    char *data;
+    uint64_t size;
+    uint64_t capacity;
+    map<void*, uint64_t> written;  // shared PextNode children
+
+    void Init();
+    uint64_t Alloc(uint64_t _size);  // zeroed, IRSSIMAGEALIGN aligned
+    template<typename T> T* At(uint64_t offset) {
+        return (T*)(data + offset);
+    }
+    void Free();
+};
+
+template<int DIMS>
+class IRSSImage {
+public:
+    typedef typename MKeyTraits<DIMS>::Key Key;
+
+    static int Save(IRSSClassifier<DIMS> &irss, const char *file);
+    int Load(const char *file);
+
+    int Lookup(Trace *trace, int priority);
+    uint64_t MemorySize();  // IRSSClassifier::MemorySize of the classifier the image was written from
+    uint64_t ImageSize();
+    int Free();
+
+    static uint64_t WriteLayer(IRSSImageWriter &writer, MultilayerTuple<DIMS> *multilayertuple);
+    static uint64_t WriteHashNode(IRSSImageWriter &writer, MHashNode<DIMS> *hash_node);
+    static uint64_t WriteRuleArray(IRSSImageWriter &writer, MRuleArray *block);
+    static uint64_t WritePextCuts(IRSSImageWriter &writer, PextCuts *pextcuts);
+    static uint64_t WritePextNodes(IRSSImageWriter &writer, PextNode *nodes, int nodes_num);
+
+    uint64_t LayerMemorySize(IImageLayer *layer, uint64_t &slab_size);
+    uint64_t PextNodeMemorySize(IImagePextNode *node);
+    template<int HASH> int LookupHash(Trace *trace, int priority);
+    template<int HASH> int LookupLayer(IImageLayer *layer, Trace *trace, int priority);
+    int LookupPextCuts(IImagePextCuts *pextcuts, Trace *trace, int priority);
+    template<typename T> T* At(uint64_t offset) {
+        return (T*)(image + offset);
+    }
+
+    char *image;
+    IRSSImageHeader *header;
+};
+
+#endif
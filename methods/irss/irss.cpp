@@ -0,0 +1,165 @@
+#include "irss.h"
+
+using namespace std;
+
+template<int DIMS>
+IRSSClassifier<DIMS>::IRSSClassifier() {
+    region[0] = -1;
+}
+
+template<int DIMS>
+void IRSSClassifier<DIMS>::SetRegion(int _x1, int _y1, int _x2, int _y2) {
+    region[0] = _x1;
+    region[1] = _y1;
+    region[2] = _x2;
+    region[3] = _y2;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::Create(vector<Rule*> &rules, bool insert) {
+    vector<Rule*> tuple_rules;
+    vector<Rule*> tree_rules;
+    int rules_num = rules.size();
+    tree_max_priority = 0;
+    for (int i = 0; i < rules_num; ++i) {
+        if (rules[i]->label == IRSS_TREE_LABEL) {
+            tree_rules.push_back(rules[i]);
+            tree_max_priority = max(tree_max_priority, rules[i]->priority);
+        } else {
+            tuple_rules.push_back(rules[i]);
+        }
+    }
+    access_state = new ProgramState();
+
+    multilayertuple.Init(1, true);
+    if (region[0] >= 0)
+        multilayertuple.SetRegion(region[0], region[1], region[2], region[3]);
+    multilayertuple.Create(tuple_rules, insert);
+    multipextcuts.Create(tree_rules, insert);
+    return 0;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::InsertRule(Rule *rule) {
+    if (rule->label == IRSS_TREE_LABEL) {
+        if (multipextcuts.InsertRule(rule) > 0)
+            return 1;
+        tree_max_priority = max(tree_max_priority, rule->priority);
+        return 0;
+    }
+    return multilayertuple.InsertRule(rule);
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::DeleteRule(Rule *rule) {
+    // tree_max_priority is kept as an upper bound, it only serves the lookup order
+    if (rule->label == IRSS_TREE_LABEL)
+        return multipextcuts.DeleteRule(rule);
+    return multilayertuple.DeleteRule(rule);
+}
+
+// The half with the higher max_priority is searched first, its result is the lower bound of the other half.
+template<int DIMS>
+int IRSSClassifier<DIMS>::Lookup(Trace *trace, int priority) {
+    if (tree_max_priority > multilayertuple.max_priority) {
+        priority = multipextcuts.Lookup(trace, priority);
+        priority = multilayertuple.Lookup(trace, priority);
+    } else {
+        priority = multilayertuple.Lookup(trace, priority);
+        priority = multipextcuts.Lookup(trace, priority);
+    }
+    return priority;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::LookupBatch(Trace **traces, int n, int *out) {
+    multilayertuple.LookupBatch(traces, n, out);
+    for (int i = 0; i < n; ++i)
+        out[i] = multipextcuts.Lookup(traces[i], out[i]);
+    return 0;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) {
+    program_state->AccessClear();
+    for (int k = 0; k < 2; ++k) {
+        bool tree_half = (k == 0) == (tree_max_priority > multilayertuple.max_priority);
+        if (tree_half)
+            priority = multipextcuts.LookupAccess(trace, priority, ans_rule, access_state);
+        else
+            priority = multilayertuple.LookupAccess(trace, priority, ans_rule, access_state);
+        program_state->access_tuples.num += access_state->access_tuples.num;
+        program_state->access_tables.num += access_state->access_tables.num;
+        program_state->access_nodes.num += access_state->access_nodes.num;
+        program_state->access_rules.num += access_state->access_rules.num;
+        program_state->pruned_tuples += access_state->pruned_tuples;
+        access_state->pruned_tuples = 0;
+        program_state->fingerprint_collisions += access_state->fingerprint_collisions;
+        access_state->fingerprint_collisions = 0;
+    }
+    program_state->AccessCal();
+    return priority;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::Reconstruct() {
+    multilayertuple.Reconstruct();
+    multipextcuts.Reconstruct();
+    return 0;
+}
+
+template<int DIMS>
+uint64_t IRSSClassifier<DIMS>::MemorySize() {
+    uint64_t memory_size = sizeof(IRSSClassifier<DIMS>);
+    memory_size += multilayertuple.MemorySize() - sizeof(MultilayerTuple<DIMS>);
+    memory_size += multipextcuts.MemorySize() - sizeof(MultiPextCuts);
+    return memory_size;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::CalculateState(ProgramState *program_state) {
+    multilayertuple.CalculateState(program_state);
+
+    ProgramState *tree_state = new ProgramState();
+    multipextcuts.CalculateState(tree_state);
+    program_state->tree_num = tree_state->tuples_num;
+    for (int i = 0; i < 30; ++i)
+        program_state->layers[i] = tree_state->layers[i];
+    program_state->tree_height_num = tree_state->tree_height_num;
+    program_state->tree_real_height_num = tree_state->tree_real_height_num;
+    program_state->tree_rules_num = tree_state->tree_rules_num;
+    program_state->tree_real_rules_num = tree_state->tree_real_rules_num;
+    program_state->tree_child_num = tree_state->tree_child_num;
+    program_state->tree_real_child_num = tree_state->tree_real_child_num;
+    program_state->tree_shared_num = tree_state->tree_shared_num;
+    program_state->tree_shared_memory_size = tree_state->tree_shared_memory_size;
+    program_state->tree_build_memory_size = tree_state->tree_build_memory_size;
+    program_state->cal_time = tree_state->cal_time;
+    delete tree_state;
+    return 0;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::GetRules(vector<Rule*> &rules) {
+    multilayertuple.GetRules(rules);
+    multipextcuts.GetRules(rules);
+    return 0;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::Free(bool free_self) {
+    multilayertuple.Free(false);
+    multipextcuts.Free(false);
+    delete access_state;
+    if (free_self)
+        free(this);
+    return 0;
+}
+
+template<int DIMS>
+int IRSSClassifier<DIMS>::Test(void *ptr) {
+    return 0;
+}
+
+template class IRSSClassifier<2>;
+template class IRSSClassifier<5>;
@@ -0,0 +1,44 @@
+#ifndef  IRSS_H
+#define  IRSS_H
+
+#include "../../elementary.h"
+#include "../multilayertuple/multilayertuple.h"
+#include "../pextcuts/multipextcuts.h"
+
+// rules with label IRSS_TREE_LABEL are stored in MultiPextCuts, the others in MultilayerTuple
+#define IRSS_TREE_LABEL 1
+
+using namespace std;
+
+// DIMS : prefix dims of the tuple half
+template<int DIMS>
+class IRSSClassifier : public Classifier {
+public:
+    IRSSClassifier();
+    void SetRegion(int _x1, int _y1, int _x2, int _y2);  // region thresholds of the tuple half, before Create
+
+    int Create(vector<Rule*> &rules, bool insert);
+
+    int InsertRule(Rule *rule);
+    int DeleteRule(Rule *rule);
+    int Lookup(Trace *trace, int priority);
+    int LookupBatch(Trace **traces, int n, int *out);
+    int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state);
+
+    int Reconstruct();
+    uint64_t MemorySize();
+    int CalculateState(ProgramState *program_state);
+    int GetRules(vector<Rule*> &rules);
+    int Free(bool free_self);
+    int Test(void *ptr);
+
+    MultilayerTuple<DIMS> multilayertuple;
+    MultiPextCuts multipextcuts;
+
+    int tree_max_priority;
+    int region[4];  // x1 y1 x2 y2, -1 : MultilayerTuple defaults
+
+    ProgramState *access_state;  // per-lookup access numbers of one half
+};
+
+#endif
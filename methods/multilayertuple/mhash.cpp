@@ -2,9 +2,36 @@
 
 using namespace std;
 
-uint32_t HashKeys(uint32_t *keys, uint32_t keys_num) {
-	uint32_t hash = keys[0];
-	for (int i = 1; i < keys_num; ++i)
-		hash = hash * 1000000007 + keys[i];
-	return hash;
-}
\ No newline at end of file
+int hash_type = HASH_MULT;
+uint32_t tabulation_table[5][4][256];
+
+int SetHashType(int _hash_type) {
+	if (_hash_type < 0 || _hash_type >= HASH_TYPES_NUM) {
+		printf("Wrong: hash_type %d\n", _hash_type);
+		return 1;
+	}
+	hash_type = _hash_type;
+	if (hash_type == HASH_TABULATION)
+		InitTabulationTable();
+	return 0;
+}
+
+// fixed seed, the tables are the same in every run and every call
+void InitTabulationTable() {
+	uint64_t seed = 0x2545F4914F6CDD1DULL;
+	for (int i = 0; i < 5; ++i)
+		for (int j = 0; j < 4; ++j)
+			for (int k = 0; k < 256; ++k) {
+				seed ^= seed << 13;
+				seed ^= seed >> 7;
+				seed ^= seed << 17;
+				tabulation_table[i][j][k] = seed >> 32;
+			}
+}
+
+const char* HashTypeName(int _hash_type) {
+	const char *names[HASH_TYPES_NUM] = {"mult", "crc32c", "xorshift", "tabulation"};
+	if (_hash_type < 0 || _hash_type >= HASH_TYPES_NUM)
+		return "unknown";
+	return names[_hash_type];
+}
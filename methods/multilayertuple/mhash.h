@@ -3,8 +3,108 @@
 
 #include "../../elementary.h"
 
+#include <nmmintrin.h>
+
+// hash_type
+#define HASH_MULT 0        // hash * 1000000007 + key
+#define HASH_CRC32C 1      // SSE4.2 crc32
+#define HASH_XORSHIFT 2    // 64-bit multiply-xorshift
+#define HASH_TABULATION 3  // 8-bit tabulation
+#define HASH_TYPES_NUM 4
+
 using namespace std;
 
-uint32_t HashKeys(uint32_t *keys, uint32_t keys_num);
+extern int hash_type;  // MultilayerTuple::hash_type of the start tuple layers
+extern uint32_t tabulation_table[5][4][256];
+
+int SetHashType(int _hash_type);
+void InitTabulationTable();
+const char* HashTypeName(int _hash_type);
+
+// HASH is a constant, only one branch is left in each instance
+template<int HASH>
+inline uint32_t HashKeys(uint32_t *keys, uint32_t keys_num) {
+	if (HASH == HASH_CRC32C) {
+		uint32_t hash = 0;
+		for (int i = 0; i < keys_num; ++i)
+			hash = _mm_crc32_u32(hash, keys[i]);
+		return hash;
+	} else if (HASH == HASH_XORSHIFT) {
+		uint64_t hash = 0;
+		for (int i = 0; i < keys_num; ++i)
+			hash = (hash ^ keys[i]) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+		hash *= 0xD6E8FEB86659FD93ULL;
+		hash ^= hash >> 32;
+		return hash;
+	} else if (HASH == HASH_TABULATION) {
+		uint32_t hash = 0;
+		for (int i = 0; i < keys_num; ++i)
+			for (int j = 0; j < 4; ++j)
+				hash ^= tabulation_table[i][j][keys[i] >> (j * 8) & 0xff];
+		return hash;
+	}
+	uint32_t hash = keys[0];
+	for (int i = 1; i < keys_num; ++i)
+		hash = hash * 1000000007 + keys[i];
+	return hash;
+}
+
+// for the updates, the lookups switch on the hash type once and use HashKeys<HASH>
+inline uint32_t HashKeys(uint32_t *keys, uint32_t keys_num, int _hash_type) {
+	switch (_hash_type) {
+	case HASH_CRC32C:
+		return HashKeys<HASH_CRC32C>(keys, keys_num);
+	case HASH_XORSHIFT:
+		return HashKeys<HASH_XORSHIFT>(keys, keys_num);
+	case HASH_TABULATION:
+		return HashKeys<HASH_TABULATION>(keys, keys_num);
+	}
+	return HashKeys<HASH_MULT>(keys, keys_num);
+}
+
+// Packed tuple key of DIMS fields, each field already shifted right by its prefix_len_zero.
+// 2 dims : src ip | dst ip in 64 bits
+// 5 dims : src ip | dst ip | src port | dst port | protocol (32 + 32 + 16 + 16 + 8 bits) in 128 bits
+template<int DIMS>
+struct MKeyTraits;
+
+template<>
+struct MKeyTraits<2> {
+	typedef uint64_t Key;
+	static Key Pack(uint32_t *keys) {
+		return (uint64_t)keys[0] << 32 | keys[1];
+	}
+};
+
+template<>
+struct MKeyTraits<5> {
+	typedef unsigned __int128 Key;
+	static Key Pack(uint32_t *keys) {
+		return (Key)keys[0] << 72 | (Key)keys[1] << 40 | (Key)keys[2] << 24 | (Key)keys[3] << 8 | keys[4];
+	}
+};
+
+template<int DIMS>
+inline void ShiftKeys(uint32_t *keys, uint32_t *fields, uint32_t *prefix_len_zero) {
+	for (int i = 0; i < DIMS; ++i)
+		keys[i] = (uint64_t)fields[i] >> prefix_len_zero[i];
+}
+
+template<int DIMS, int HASH>
+inline typename MKeyTraits<DIMS>::Key GetKey(uint32_t *fields, uint32_t *prefix_len_zero, uint32_t &hash) {
+	uint32_t keys[DIMS];
+	ShiftKeys<DIMS>(keys, fields, prefix_len_zero);
+	hash = HashKeys<HASH>(keys, DIMS);
+	return MKeyTraits<DIMS>::Pack(keys);
+}
+
+template<int DIMS>
+inline typename MKeyTraits<DIMS>::Key GetKey(uint32_t *fields, uint32_t *prefix_len_zero, uint32_t &hash, int _hash_type) {
+	uint32_t keys[DIMS];
+	ShiftKeys<DIMS>(keys, fields, prefix_len_zero);
+	hash = HashKeys(keys, DIMS, _hash_type);
+	return MKeyTraits<DIMS>::Pack(keys);
+}
 
-#endif
\ No newline at end of file
+#endif
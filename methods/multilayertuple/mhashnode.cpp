@@ -3,148 +3,561 @@
 using namespace std;
 
 extern int max_layers_num;
-extern int prefix_dims_num;
 extern uint32_t create_next_layer_rules_num;
-extern uint32_t delete_next_layer_rules_num;
+extern uint32_t migrate_rules_num;
 
-MHashNode::MHashNode(uint32_t *_keys, uint32_t _hash) {
-	for (int i = 0; i < prefix_dims_num; ++i)
-		keys[i] = _keys[i];
+// a new buffer with the rules except skip and an empty position at gap (-1 : none)
+int MRuleArray::Rebuild(uint32_t _capacity, int gap, int skip, MSlab *slab, uint64_t gen) {
+	char *new_data = (char*)slab->Alloc(BufferSize(_capacity)) + MRULEHEADER;
+	((uint64_t*)new_data)[-1] = gen;
+	uint32_t head = gap >= 0 ? gap : skip >= 0 ? skip : rules_num;
+	uint32_t tail = rules_num - head - (skip >= 0);
+	uint32_t offset = 0, new_offset = 0;
+	for (int i = 0; i < MRULEFIELDS; ++i) {
+		uint32_t size = mrule_field_size[i];
+		memcpy(new_data + new_offset, data + offset, size * head);
+		memcpy(new_data + new_offset + size * (head + (gap >= 0)), data + offset + size * (head + (skip >= 0)), size * tail);
+		offset += size * capacity;
+		new_offset += size * _capacity;
+	}
+	if (data)
+		slab->Release(data - MRULEHEADER, BufferSize(capacity));
+	data = new_data;
+	capacity = _capacity;
+	return 0;
+}
+
+int MRuleArray::Resize(uint32_t _capacity, MSlab *slab, uint64_t gen) {
+	return Rebuild(_capacity, -1, -1, slab, gen);
+}
+
+void MRuleArray::SetRule(int i, Rule *rule) {
+	Priority()[i]     = rule->priority;
+	SrcIpBegin()[i]   = rule->range[0][0];
+	SrcIpEnd()[i]     = rule->range[0][1];
+	DstIpBegin()[i]   = rule->range[1][0];
+	DstIpEnd()[i]     = rule->range[1][1];
+	SrcPortBegin()[i] = rule->range[2][0];
+	SrcPortEnd()[i]   = rule->range[2][1];
+	DstPortBegin()[i] = rule->range[3][0];
+	DstPortEnd()[i]   = rule->range[3][1];
+	ProtocolBegin()[i] = rule->range[4][0];
+	ProtocolEnd()[i]   = rule->range[4][1];
+	Rules()[i]        = rule;
+}
+
+int MRuleArray::InsertRule(Rule *rule, MSlab *slab, uint64_t gen) {
+	// first position with lower priority
+	int *priority = Priority();
+	int left = 0, right = rules_num;
+	while (left < right) {
+		int mid = (left + right) / 2;
+		if (priority[mid] > rule->priority)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	if (rules_num == capacity) {
+		Rebuild(capacity == 0 ? MRULEMINCAPACITY : capacity * 2, left, -1, slab, gen);
+	} else if (!Private(gen)) {
+		Rebuild(capacity, left, -1, slab, gen);
+	} else {
+		uint32_t offset = 0;
+		for (int i = 0; i < MRULEFIELDS; ++i) {
+			char *field = data + offset + mrule_field_size[i] * left;
+			memmove(field + mrule_field_size[i], field, mrule_field_size[i] * (rules_num - left));
+			offset += mrule_field_size[i] * capacity;
+		}
+	}
+	SetRule(left, rule);
+	++rules_num;
+	return 0;
+}
+
+int MRuleArray::DeleteRule(Rule *rule, MSlab *slab, uint64_t gen) {
+	// first position with priority <= rule->priority
+	int *priority = Priority();
+	int left = 0, right = rules_num;
+	while (left < right) {
+		int mid = (left + right) / 2;
+		if (priority[mid] > rule->priority)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	Rule **rules = Rules();
+	while (left < rules_num && priority[left] == rule->priority && !SameRule(rules[left], rule))
+		++left;
+	if (left == rules_num || priority[left] != rule->priority)
+		return 1;
+
+	if (rules_num == 1) {
+		Free(slab);
+		return 0;
+	}
+	if ((rules_num - 1) * 4 <= capacity && capacity > MRULEMINCAPACITY) {
+		Rebuild(capacity / 2, -1, left, slab, gen);
+	} else if (left == rules_num - 1) {
+		// the last rule is cut off without writing the buffer
+	} else if (!Private(gen)) {
+		Rebuild(capacity, -1, left, slab, gen);
+	} else {
+		uint32_t offset = 0;
+		for (int i = 0; i < MRULEFIELDS; ++i) {
+			char *field = data + offset + mrule_field_size[i] * left;
+			memmove(field, field + mrule_field_size[i], mrule_field_size[i] * (rules_num - 1 - left));
+			offset += mrule_field_size[i] * capacity;
+		}
+	}
+	--rules_num;
+	return 0;
+}
+
+// the left half keeps its buffer and only gets shorter
+int MRuleArray::Split(MRuleArray &right, MSlab *slab, uint64_t gen) {
+	uint32_t mid = rules_num / 2;
+	uint32_t right_capacity = MRULEMINCAPACITY;
+	while (right_capacity < rules_num - mid)
+		right_capacity *= 2;
+	right.Resize(right_capacity, slab, gen);
+	for (int i = 0; i < MRULEFIELDS; ++i)
+		memcpy(right.Field(i), Field(i) + mrule_field_size[i] * mid, mrule_field_size[i] * (rules_num - mid));
+	right.rules_num = rules_num - mid;
+	rules_num = mid;
+	return 0;
+}
+
+int MRuleArray::Append(MRuleArray &right, MSlab *slab, uint64_t gen) {
+	uint32_t new_capacity = max(capacity, (uint32_t)MRULEMINCAPACITY);
+	while (new_capacity < rules_num + right.rules_num)
+		new_capacity *= 2;
+	if (new_capacity != capacity || !Private(gen))
+		Resize(new_capacity, slab, gen);
+	for (int i = 0; i < MRULEFIELDS; ++i)
+		memcpy(Field(i) + mrule_field_size[i] * rules_num, right.Field(i), mrule_field_size[i] * right.rules_num);
+	rules_num += right.rules_num;
+	right.Free(slab);
+	return 0;
+}
+
+int MRuleArray::GetRules(vector<Rule*> &rules) {
+	Rule **rule_arr = Rules();
+	for (int i = 0; i < rules_num; ++i)
+		rules.push_back(rule_arr[i]);
+	return 0;
+}
+
+int MRuleArray::Free(MSlab *slab) {
+	if (data)
+		slab->Release(data - MRULEHEADER, BufferSize(capacity));
+	Init();
+	return 0;
+}
+
+// first block with min priority <= priority, the last block if none
+int MRuleBlocks::FindBlock(int priority) {
+	int left = 0, right = blocks_num - 1;
+	while (left < right) {
+		int mid = (left + right) / 2;
+		if (MinPriority(mid) > priority)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	return left;
+}
+
+// new empty block at i, i > 0
+void MRuleBlocks::InsertBlock(int i) {
+	if (blocks_num == max_blocks_num) {
+		MRuleArray *new_blocks = (MRuleArray*)slab->Alloc(sizeof(MRuleArray) * (max_blocks_num * 2 - 1));
+		memcpy(new_blocks, more_blocks, sizeof(MRuleArray) * (blocks_num - 1));
+		slab->Release(more_blocks, sizeof(MRuleArray) * (max_blocks_num - 1));
+		more_blocks = new_blocks;
+		max_blocks_num *= 2;
+	}
+	memmove(more_blocks + i, more_blocks + i - 1, sizeof(MRuleArray) * (blocks_num - i));
+	more_blocks[i - 1].Init();
+	++blocks_num;
+}
+
+// block i has been freed
+void MRuleBlocks::RemoveBlock(int i) {
+	if (i == 0)
+		first_block = more_blocks[0];
+	else
+		i -= 1;
+	memmove(more_blocks + i, more_blocks + i + 1, sizeof(MRuleArray) * (blocks_num - 2 - i));
+	--blocks_num;
+}
+
+int MRuleBlocks::InsertRule(Rule *rule) {
+	int i = first_block.rules_num == 0 ? 0 : FindBlock(rule->priority);
+	if (Block(i)->rules_num == MRULEBLOCKSIZE) {
+		InsertBlock(i + 1);
+		Block(i)->Split(*Block(i + 1), slab, gen);
+		if (MinPriority(i) > rule->priority)
+			++i;
+	}
+	return Block(i)->InsertRule(rule, slab, gen);
+}
+
+int MRuleBlocks::DeleteRule(Rule *rule) {
+	if (first_block.rules_num == 0)
+		return 1;
+	// rules with the same priority may span several blocks
+	for (int i = FindBlock(rule->priority); i < blocks_num && Block(i)->Priority()[0] >= rule->priority; ++i) {
+		if (Block(i)->DeleteRule(rule, slab, gen) > 0)
+			continue;
+		if (Block(i)->rules_num == 0) {
+			if (blocks_num > 1)
+				RemoveBlock(i);
+		} else if (i + 1 < blocks_num && Block(i)->rules_num + Block(i + 1)->rules_num <= MRULEBLOCKSIZE / 2) {
+			Block(i)->Append(*Block(i + 1), slab, gen);
+			RemoveBlock(i + 1);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// full blocks, appending one by one would leave them half full after each split
+int MRuleBlocks::BulkLoad(Rule **rules, int rules_num) {
+	for (int i = 0; i < rules_num; i += MRULEBLOCKSIZE) {
+		if (i > 0)
+			InsertBlock(blocks_num);
+		MRuleArray *block = Block(blocks_num - 1);
+		int block_rules_num = min(rules_num - i, MRULEBLOCKSIZE);
+		uint32_t capacity = MRULEMINCAPACITY;
+		while (capacity < block_rules_num)
+			capacity *= 2;
+		block->Resize(capacity, slab, gen);
+		for (int j = 0; j < block_rules_num; ++j)
+			block->SetRule(j, rules[i + j]);
+		block->rules_num = block_rules_num;
+	}
+	return 0;
+}
+
+int MRuleBlocks::GetRules(vector<Rule*> &rules) {
+	for (int i = 0; i < blocks_num; ++i)
+		Block(i)->GetRules(rules);
+	return 0;
+}
+
+int MRuleBlocks::Free() {
+	for (int i = 0; i < blocks_num; ++i)
+		Block(i)->Free(slab);
+	slab->Release(more_blocks, sizeof(MRuleArray) * (max_blocks_num - 1));
+	Init(slab);
+	return 0;
+}
+
+int MMerge::Find(Rule *rule) {
+	for (int i = 0; i < rules_num; ++i)
+		if (SameRule(rules[i], rule))
+			return i;
+	return -1;
+}
+
+// keeps [0, merged_num) the merged rules
+void MMerge::Remove(int i) {
+	if (i < merged_num) {
+		rules[i] = rules[--merged_num];
+		i = merged_num;
+	}
+	rules[i] = rules[--rules_num];
+}
+
+template<int DIMS>
+void MMigration<DIMS>::Init() {
+    rules_num = migrate_rules_num;
+    budget = 0;
+    split_scan_num = MSPLITSCANNUM;
+    nodes = NULL;
+    nodes_num = 0;
+    max_nodes_num = 0;
+}
+
+template<int DIMS>
+MMigrate<DIMS>* MMigration<DIMS>::Start(MHashNode<DIMS> *hash_node, MHashTable<DIMS> *hash_table) {
+    if (nodes_num == max_nodes_num) {
+        max_nodes_num = max(max_nodes_num * 2, 4U);
+        nodes = (MMigrate<DIMS>**)realloc(nodes, sizeof(MMigrate<DIMS>*) * max_nodes_num);
+    }
+    MMigrate<DIMS> *migrate = (MMigrate<DIMS>*)malloc(sizeof(MMigrate<DIMS>));
+    migrate->hash_node = hash_node;
+    migrate->hash_table = hash_table;
+    migrate->index = nodes_num;
+    migrate->merge.rules = NULL;
+    nodes[nodes_num++] = migrate;
+    return migrate;
+}
+
+template<int DIMS>
+void MMigration<DIMS>::Finish(MMigrate<DIMS> *migrate) {
+    nodes[migrate->index] = nodes[--nodes_num];
+    nodes[migrate->index]->index = migrate->index;
+    free(migrate->merge.rules);
+    free(migrate);
+    if (nodes_num == 0)
+        Free();
+}
+
+// at the end of an update, the budget it left goes to the other migrating hash nodes
+template<int DIMS>
+void MMigration<DIMS>::Drain() {
+    while (budget > 0 && nodes_num > 0) {
+        MMigrate<DIMS> *migrate = nodes[nodes_num - 1];
+        migrate->hash_table->MigrateHashNode(migrate->hash_node);
+    }
+}
+
+template<int DIMS>
+uint64_t MMigration<DIMS>::MemorySize() {
+    uint64_t memory_size = sizeof(MMigrate<DIMS>*) * max_nodes_num;
+    for (int i = 0; i < nodes_num; ++i) {
+        memory_size += sizeof(MMigrate<DIMS>);
+        if (nodes[i]->merge.rules)
+            memory_size += sizeof(Rule*) * nodes[i]->merge.rules_num;
+    }
+    return memory_size;
+}
+
+// every migration has ended, by Finish or by freeing its hash node
+template<int DIMS>
+void MMigration<DIMS>::Free() {
+    free(nodes);
+    nodes = NULL;
+    nodes_num = 0;
+    max_nodes_num = 0;
+}
+
+template<int DIMS>
+MHashNode<DIMS>::MHashNode(Key _key, uint32_t _hash, MSlab *slab) {
+    key = _key;
     hash = _hash;
     rules_num = 0;
     max_priority = 0;
-    rule_node = NULL;
-    next = NULL;
+    rule_blocks.Init(slab);
 
     has_next_multilayertuple = false;
+    migrate_state = MIGRATE_NONE;
+    split_rules_num = create_next_layer_rules_num;
+    merge_rules_num = 0;
     next_multilayertuple = NULL;
+    migrate = NULL;
 }
 
-bool MHashNode::SameKey(uint32_t *_keys) {
-	for (int i = 0; i < prefix_dims_num; ++i)
-		if (keys[i] != _keys[i])
-			return false;
-	return true;
+template<int DIMS>
+MHashNode<DIMS>* MHashNode<DIMS>::Copy() {
+    MSlab *slab = rule_blocks.slab;
+    MHashNode<DIMS> *hash_node = (MHashNode<DIMS>*)slab->Alloc(sizeof(MHashNode<DIMS>));
+    memcpy(hash_node, this, sizeof(MHashNode<DIMS>));
+    hash_node->rule_blocks.gen = slab->NewGen();
+    if (rule_blocks.more_blocks) {
+        uint32_t size = sizeof(MRuleArray) * (rule_blocks.max_blocks_num - 1);
+        hash_node->rule_blocks.more_blocks = (MRuleArray*)slab->Alloc(size);
+        memcpy(hash_node->rule_blocks.more_blocks, rule_blocks.more_blocks, size);
+    }
+    return hash_node;
 }
 
-int MHashNode::InsertRule(Rule *rule, uint32_t tuple_layer) {
+template<int DIMS>
+void MHashNode<DIMS>::FreeShell() {
+    MSlab *slab = rule_blocks.slab;
+    slab->Release(rule_blocks.more_blocks, sizeof(MRuleArray) * (rule_blocks.max_blocks_num - 1));
+    slab->Release(this, sizeof(MHashNode<DIMS>));
+}
 
-    if (has_next_multilayertuple) {
-        if (next_multilayertuple->InsertRule(rule) > 0) {
-            printf("next_multilayertuple->Insert fail\n");
-            exit(1);
+// average rules Match scans for points taken from the rules of rule_blocks
+template<int DIMS>
+int MHashNode<DIMS>::SampleScanNum() {
+    uint32_t local_rules_num = 0;
+    for (int i = 0; i < rule_blocks.blocks_num; ++i)
+        local_rules_num += rule_blocks.Block(i)->rules_num;
+    uint32_t step = max(1U, local_rules_num / MSCANSAMPLENUM);
+    int scan_num = 0, sample_num = 0;
+    uint32_t k = 0;
+    Trace trace;
+    for (int i = 0; i < rule_blocks.blocks_num; ++i) {
+        MRuleArray *block = rule_blocks.Block(i);
+        for (int j = 0; j < block->rules_num; ++j, ++k) {
+            if (k % step != 0)
+                continue;
+            Rule *rule = block->Rules()[j];
+            for (int d = 0; d < 5; ++d)
+                trace.key[d] = rule->range[d][0];
+            rule_blocks.Match(&trace, 0, scan_num);
+            ++sample_num;
         }
-        ++rules_num;
-        if (rule->priority > max_priority)
-            max_priority = rule->priority;
-        return 0;
     }
-    // insert rule_node list
-    MRuleNode *insert_rule_node = new MRuleNode(rule);
-    MRuleNode *pre_rule_node = NULL;
-    MRuleNode *next_rule_node = rule_node;
-    while (true) {
-        if (!next_rule_node || rule->priority > next_rule_node->rule->priority) {
-            if (!pre_rule_node) {
-                insert_rule_node->next = rule_node;
-                rule_node = insert_rule_node;
-            } else {
-                pre_rule_node->next = insert_rule_node;
-                insert_rule_node->next = next_rule_node;
+    return sample_num == 0 ? 0 : scan_num / sample_num;
+}
+
+// split when rules_num reaches split_rules_num and a lookup really scans many rules, sets merge_rules_num
+template<int DIMS>
+bool MHashNode<DIMS>::ShouldSplit(MHashTable<DIMS> *hash_table) {
+    if (has_next_multilayertuple || rules_num < split_rules_num || hash_table->tuple_layer >= max_layers_num)
+        return false;
+    int split_scan_num = hash_table->migration->split_scan_num;
+    int scan_num = SampleScanNum();
+    if (scan_num < split_scan_num) {
+        while (split_rules_num <= rules_num)
+            split_rules_num *= 2;
+        return false;
+    }
+    // taking the scan length as proportional to rules_num, merge back once it would be half of split_scan_num,
+    // at most rules_num / 2 so a node does not split and merge again on every few updates
+    merge_rules_num = (uint64_t)rules_num * split_scan_num / (2 * max(scan_num, 1));
+    return true;
+}
+
+// move rules while the update has budget left, lowest priority first when splitting.
+// Moves in deeper layers caused by these moves share the same budget.
+template<int DIMS>
+void MHashNode<DIMS>::Migrate(MMigration<DIMS> *migration) {
+    while (migration->budget > 0 && migrate_state != MIGRATE_NONE) {
+        --migration->budget;
+        if (migrate_state == MIGRATE_SPLIT) {
+            Rule *rule = rule_blocks.LastRule();
+            if (rule) {
+                rule_blocks.DeleteRule(rule);
+                next_multilayertuple->InsertRule(rule);
+            }
+            if (rule_blocks.first_block.rules_num == 0) {
+                rule_blocks.Free();
+                migration->Finish(migrate);
+                migrate = NULL;
+                migrate_state = MIGRATE_NONE;
+            }
+        } else {
+            MMerge &merge = migrate->merge;
+            if (merge.merged_num < merge.rules_num)
+                rule_blocks.InsertRule(merge.rules[merge.merged_num++]);
+            if (merge.merged_num == merge.rules_num) {
+                next_multilayertuple->Free(true);
+                next_multilayertuple = NULL;
+                has_next_multilayertuple = false;
+                migration->Finish(migrate);
+                migrate = NULL;
+                migrate_state = MIGRATE_NONE;
             }
-            ++rules_num;
-            // printf("insert hashnode \n");
-            break;
         }
-        pre_rule_node = next_rule_node;
-        next_rule_node = next_rule_node->next;
     }
+}
+
+// rules are copied and next_multilayertuple keeps them until all are in rule_blocks
+template<int DIMS>
+void MHashNode<DIMS>::StartMerge(MHashTable<DIMS> *hash_table) {
+    vector<Rule*> rules;
+    next_multilayertuple->GetRules(rules);
+    // a split in progress turns around
+    if (!migrate)
+        migrate = hash_table->migration->Start(this, hash_table);
+    MMerge &merge = migrate->merge;
+    merge.rules = (Rule**)malloc(sizeof(Rule*) * max((size_t)1, rules.size()));
+    for (int i = 0; i < rules.size(); ++i)
+        merge.rules[i] = rules[i];
+    merge.rules_num = rules.size();
+    merge.merged_num = 0;
+    migrate_state = MIGRATE_MERGE;
+}
+
+template<int DIMS>
+int MHashNode<DIMS>::InsertRule(Rule *rule, MHashTable<DIMS> *hash_table) {
+    if (has_next_multilayertuple && migrate_state != MIGRATE_MERGE) {
+        if (next_multilayertuple->InsertRule(rule) > 0) {
+            printf("next_multilayertuple->Insert fail\n");
+            exit(1);
+        }
+    } else {
+        rule_blocks.InsertRule(rule);
+    }
+    ++rules_num;
     if (rule->priority > max_priority)
     	max_priority = rule->priority;
 
-    if (rules_num >= create_next_layer_rules_num && !has_next_multilayertuple && tuple_layer < max_layers_num) {
+    if (ShouldSplit(hash_table)) {
         // printf("Create next_multilayertuple\n");
         vector<Rule*> rules;
-        GetRules(rules);
-        int get_rules_num = rules.size();
-        Free(false);
-
         has_next_multilayertuple = true;
-        next_multilayertuple = new MultilayerTuple();
-        next_multilayertuple->Init(tuple_layer + 1, false);
+        next_multilayertuple = new (rule_blocks.slab->Alloc(sizeof(MultilayerTuple<DIMS>))) MultilayerTuple<DIMS>();
+        next_multilayertuple->Init(hash_table->tuple_layer + 1, false, hash_table->multilayertuple);
+        next_multilayertuple->slab = rule_blocks.slab;
+        next_multilayertuple->migration = hash_table->migration;
         next_multilayertuple->Create(rules, false);
-        for (int i = 0; i < get_rules_num; ++i)
-            InsertRule(rules[i], tuple_layer);
+        migrate_state = MIGRATE_SPLIT;
+        migrate = hash_table->migration->Start(this, hash_table);
     }
-
+    Migrate(hash_table->migration);
 	return 0;
 }
 
-int MHashNode::DeleteRule(Rule *rule, uint32_t tuple_layer) {
-    bool delete_success = false;
-    if (has_next_multilayertuple) {
-        if (next_multilayertuple->DeleteRule(rule) > 0) {
-            printf("next_multilayertuple->Insert fail\n");
-            exit(1);
-        }
-        --rules_num;
-        max_priority = next_multilayertuple->max_priority;
-        delete_success = true;
+template<int DIMS>
+int MHashNode<DIMS>::BulkLoad(Rule **rules, int _rules_num, MHashTable<DIMS> *hash_table) {
+    rules_num = _rules_num;
+    max_priority = rules[0]->priority;
+    rule_blocks.BulkLoad(rules, rules_num);
+    if (ShouldSplit(hash_table)) {
+        vector<Rule*> next_rules(rules, rules + rules_num);
+        rule_blocks.Free();
+        has_next_multilayertuple = true;
+        next_multilayertuple = new (rule_blocks.slab->Alloc(sizeof(MultilayerTuple<DIMS>))) MultilayerTuple<DIMS>();
+        next_multilayertuple->Init(hash_table->tuple_layer + 1, false, hash_table->multilayertuple);
+        next_multilayertuple->slab = rule_blocks.slab;
+        next_multilayertuple->migration = hash_table->migration;
+        next_multilayertuple->Create(next_rules, false);
+        next_multilayertuple->BulkLoad(next_rules);
     }
+    return 0;
+}
 
-    if (!delete_success) {
-        // delete in rule_node list
-        MRuleNode *pre_rule_node = NULL;
-        MRuleNode *next_rule_node = rule_node;
-        while (next_rule_node) {
-            if (SameRule(next_rule_node->rule, rule)) {
-                --rules_num;
-                if (!pre_rule_node) {
-                    rule_node = next_rule_node->next;
-                    if (rules_num == 0)
-                        max_priority = 0;
-                    else
-                        max_priority = rule_node->priority;
-                } else {
-                    pre_rule_node->next = next_rule_node->next;
-                }
-                next_rule_node->Free(true);
-                delete_success = true;
-                break;
+template<int DIMS>
+int MHashNode<DIMS>::DeleteRule(Rule *rule, MHashTable<DIMS> *hash_table) {
+    if (migrate_state == MIGRATE_MERGE) {
+        bool in_blocks = rule_blocks.DeleteRule(rule) == 0;
+        int i = migrate->merge.Find(rule);
+        if (i < 0 && !in_blocks)
+            return 1;
+        if (i >= 0) {
+            if (next_multilayertuple->DeleteRule(rule) > 0) {
+                printf("next_multilayertuple->Delete fail\n");
+                exit(1);
             }
-            pre_rule_node = next_rule_node;
-            next_rule_node = next_rule_node->next;
+            migrate->merge.Remove(i);
+        }
+    } else if (rule_blocks.DeleteRule(rule) > 0) {
+        // during a split the rule may be on either side
+        if (!has_next_multilayertuple)
+            return 1;
+        if (next_multilayertuple->DeleteRule(rule) > 0) {
+            printf("next_multilayertuple->Delete fail\n");
+            exit(1);
         }
     }
-    
-    if (has_next_multilayertuple && rules_num <= delete_next_layer_rules_num) {
-        // printf("delete next_multilayertuple\n");
-        vector<Rule*> rules;
-        GetRules(rules);
-        int get_rules_num = rules.size();
-        Free(false);
+    --rules_num;
+    max_priority = rule_blocks.MaxPriority();
+    if (has_next_multilayertuple)
+        max_priority = max(max_priority, next_multilayertuple->max_priority);
 
-        for (int i = 0; i < get_rules_num; ++i)
-            InsertRule(rules[i], tuple_layer);
-        // printf("rules_num %d\n", rules_num);
+    if (has_next_multilayertuple && migrate_state != MIGRATE_MERGE && rules_num <= merge_rules_num) {
+        // printf("delete next_multilayertuple\n");
+        StartMerge(hash_table);
     }
-
-	return !delete_success;
+    Migrate(hash_table->migration);
+	return 0;
 }
 
-uint64_t MHashNode::MemorySize() {
-    uint64_t memory_size = sizeof(MHashNode);
-    MRuleNode *rule_node2 = rule_node;
-    while (rule_node2) {
-        memory_size += rule_node2->MemorySize();
-        rule_node2 = rule_node2->next;
-    }
+template<int DIMS>
+uint64_t MHashNode<DIMS>::MemorySize() {
     if (has_next_multilayertuple)
-        memory_size += next_multilayertuple->MemorySize();
-    return memory_size;
+        return next_multilayertuple->MemorySize();
+    return 0;
 }
 
-int MHashNode::CalculateState(ProgramState *program_state) {
+template<int DIMS>
+int MHashNode<DIMS>::CalculateState(ProgramState *program_state) {
     if (has_next_multilayertuple) {
         ++program_state->next_layer_num;
         next_multilayertuple->CalculateState(program_state);
@@ -152,27 +565,21 @@ int MHashNode::CalculateState(ProgramState *program_state) {
 	return 0;
 }
 
-int MHashNode::GetRules(vector<Rule*> &rules) {
-    MRuleNode *current_rule_node = rule_node, *next_rule_node = NULL;
-    while (current_rule_node) {
-        next_rule_node = current_rule_node->next;
-        rules.push_back(current_rule_node->rule);
-        current_rule_node = next_rule_node;
-    }
+template<int DIMS>
+int MHashNode<DIMS>::GetRules(vector<Rule*> &rules) {
+    rule_blocks.GetRules(rules);
 
-    if (has_next_multilayertuple)
+    // the merged rules are on both sides
+    if (migrate_state == MIGRATE_MERGE)
+        rules.insert(rules.end(), migrate->merge.rules + migrate->merge.merged_num, migrate->merge.rules + migrate->merge.rules_num);
+    else if (has_next_multilayertuple)
         next_multilayertuple->GetRules(rules);
 	return 0;
 }
 
-int MHashNode::Free(bool free_self) {
-    MRuleNode *current_rule_node = rule_node, *next_rule_node = NULL;
-    while (current_rule_node) {
-        next_rule_node = current_rule_node->next;
-        current_rule_node->Free(true);
-        current_rule_node = next_rule_node;
-    }
-    rule_node = NULL;
+template<int DIMS>
+int MHashNode<DIMS>::Free(bool free_self) {
+    rule_blocks.Free();
     rules_num = 0;
     max_priority = 0;
 
@@ -181,11 +588,22 @@ int MHashNode::Free(bool free_self) {
         next_multilayertuple->Free(true);
         next_multilayertuple = NULL;
     }
+    if (migrate) {
+        migrate->hash_table->migration->Finish(migrate);
+        migrate = NULL;
+    }
+    migrate_state = MIGRATE_NONE;
     if (free_self)
-        free(this);
+        rule_blocks.slab->Release(this, sizeof(MHashNode<DIMS>));
 	return 0;
 }
 
-int MHashNode::Test(void *ptr) {
+template<int DIMS>
+int MHashNode<DIMS>::Test(void *ptr) {
 	return 0;
-}
\ No newline at end of file
+}
+
+template struct MMigration<2>;
+template struct MMigration<5>;
+template struct MHashNode<2>;
+template struct MHashNode<5>;
@@ -2,69 +2,313 @@
 #define MHASHNODE_H
 
 #include "../../elementary.h"
+#include "mhash.h"
 #include "mhashnode.h"
+#include "mslab.h"
 #include "multilayertuple.h"
 
+#include <immintrin.h>
+
 using namespace std;
 
-struct MRuleNode;
-struct MHashNode;
-struct MHashTable;
-struct MTuple;
-class MultilayerTuple;
-
-struct MRuleNode {
-	Rule *rule;
-	uint32_t src_ip_begin, src_ip_end;
-	uint32_t dst_ip_begin, dst_ip_end;
-	uint16_t src_port_begin, src_port_end;
-	uint16_t dst_port_begin, dst_port_end;
-	uint8_t protocol_begin, protocol_end;
-	int priority;
-	MRuleNode *next;
-	MRuleNode(Rule *_rule) {
-		rule = _rule;
-		src_ip_begin   = rule->range[0][0];
-		src_ip_end     = rule->range[0][1];
-		dst_ip_begin   = rule->range[1][0];
-		dst_ip_end     = rule->range[1][1];
-		src_port_begin = rule->range[2][0];
-		src_port_end   = rule->range[2][1];
-		dst_port_begin = rule->range[3][0];
-		dst_port_end   = rule->range[3][1];
-		protocol_begin = rule->range[4][0];
-		protocol_end   = rule->range[4][1];
-		priority       = rule->priority;
-		next = NULL;
+struct MRuleArray;
+template<int DIMS> struct MHashNode;
+template<int DIMS> struct MHashTable;
+template<int DIMS> struct MTuple;
+template<int DIMS> class MultilayerTuple;
+template<int DIMS> struct MMigration;
+
+#define MRULEMINCAPACITY 4
+#define MRULEFIELDS 12
+#define MRULEBLOCKSIZE 128  // max rules of one MRuleArray block in MRuleBlocks
+#define MSCANSAMPLENUM 16  // rules sampled to measure the scan length of a hash node
+#define MSPLITSCANNUM 32  // a hash node splits only if Match scans more rules than this on average
+#define MRULEHEADER 8  // the gen of the buffer, in front of data
+
+// MHashNode::migrate_state
+#define MIGRATE_NONE 0
+#define MIGRATE_SPLIT 1  // moving rule_blocks to next_multilayertuple
+#define MIGRATE_MERGE 2  // copying next_multilayertuple back to rule_blocks
+
+// element size of each field of MRuleArray, in buffer order
+const int mrule_field_size[MRULEFIELDS] = {4, 4, 4, 4, 4, 2, 2, 2, 2, 1, 1, 8};
+// bytes of one rule in MRuleArray
+const int mrule_size = 38;
+
+// Rules of one hash node sorted by priority (high to low), stored as a structure of arrays in one buffer:
+// priority | src_ip_begin | src_ip_end | dst_ip_begin | dst_ip_end | src_port_begin | src_port_end |
+// dst_port_begin | dst_port_end | protocol_begin | protocol_end | rule
+// Each field takes capacity elements, Match compares 8 (AVX2) or 16 (AVX-512) rules per instruction.
+// With concurrent lookups a buffer they may read is never written, a change copies it unless its gen
+// is the gen of the hash node copy being updated.
+struct MRuleArray {
+	char *data;
+	uint32_t rules_num;
+	uint32_t capacity;
+
+	int* Priority() { return (int*)data; }
+	uint32_t* SrcIpBegin() { return (uint32_t*)(data + capacity * 4); }
+	uint32_t* SrcIpEnd() { return (uint32_t*)(data + capacity * 8); }
+	uint32_t* DstIpBegin() { return (uint32_t*)(data + capacity * 12); }
+	uint32_t* DstIpEnd() { return (uint32_t*)(data + capacity * 16); }
+	uint16_t* SrcPortBegin() { return (uint16_t*)(data + capacity * 20); }
+	uint16_t* SrcPortEnd() { return (uint16_t*)(data + capacity * 22); }
+	uint16_t* DstPortBegin() { return (uint16_t*)(data + capacity * 24); }
+	uint16_t* DstPortEnd() { return (uint16_t*)(data + capacity * 26); }
+	uint8_t* ProtocolBegin() { return (uint8_t*)(data + capacity * 28); }
+	uint8_t* ProtocolEnd() { return (uint8_t*)(data + capacity * 29); }
+	Rule** Rules() { return (Rule**)(data + capacity * 30); }
+	char* Field(int i) {
+		uint32_t offset = 0;
+		for (int j = 0; j < i; ++j)
+			offset += mrule_field_size[j];
+		return data + offset * capacity;
+	}
+
+	void Init() {
+		data = NULL;
+		rules_num = 0;
+		capacity = 0;
+	}
+	// slab block of the buffer
+	static uint32_t BufferSize(uint32_t capacity) {
+		return MRULEHEADER + mrule_size * capacity;
+	}
+	bool Private(uint64_t gen) {
+		return data && (gen == 0 || ((uint64_t*)data)[-1] == gen);
+	}
+
+	// data comes from the slab of the hash node, gen : MRuleBlocks::gen
+	int Rebuild(uint32_t _capacity, int gap, int skip, MSlab *slab, uint64_t gen);
+	int Resize(uint32_t _capacity, MSlab *slab, uint64_t gen);
+	void SetRule(int i, Rule *rule);
+	int InsertRule(Rule *rule, MSlab *slab, uint64_t gen);
+	int DeleteRule(Rule *rule, MSlab *slab, uint64_t gen);
+	int Split(MRuleArray &right, MSlab *slab, uint64_t gen);  // move the lower priority half to the empty right
+	int Append(MRuleArray &right, MSlab *slab, uint64_t gen);  // move all rules of right to the end
+	int GetRules(vector<Rule*> &rules);
+	int Free(MSlab *slab);
+
+	// index of the first rule with priority > priority matching trace, -1 if none
+	// scan_num : rules compared
+	int Match(Trace *trace, int priority, int &scan_num) {
+		int *rule_priority = Priority();
+		int n = rules_num;
+		int i = 0;
+#ifdef __AVX512F__
+		for (; i + 16 <= n; i += 16) {
+			if (priority >= rule_priority[i])
+				return -1;
+			scan_num += 16;
+			__mmask16 match = _mm512_cmpgt_epi32_mask(_mm512_loadu_si512(rule_priority + i), _mm512_set1_epi32(priority));
+			__m512i key = _mm512_set1_epi32(trace->key[0]);
+			match &= _mm512_cmple_epu32_mask(_mm512_loadu_si512(SrcIpBegin() + i), key);
+			match &= _mm512_cmpge_epu32_mask(_mm512_loadu_si512(SrcIpEnd() + i), key);
+			key = _mm512_set1_epi32(trace->key[1]);
+			match &= _mm512_cmple_epu32_mask(_mm512_loadu_si512(DstIpBegin() + i), key);
+			match &= _mm512_cmpge_epu32_mask(_mm512_loadu_si512(DstIpEnd() + i), key);
+			key = _mm512_set1_epi32(trace->key[2]);
+			match &= _mm512_cmple_epu32_mask(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i*)(SrcPortBegin() + i))), key);
+			match &= _mm512_cmpge_epu32_mask(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i*)(SrcPortEnd() + i))), key);
+			key = _mm512_set1_epi32(trace->key[3]);
+			match &= _mm512_cmple_epu32_mask(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i*)(DstPortBegin() + i))), key);
+			match &= _mm512_cmpge_epu32_mask(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i*)(DstPortEnd() + i))), key);
+			key = _mm512_set1_epi32(trace->key[4]);
+			match &= _mm512_cmple_epu32_mask(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(ProtocolBegin() + i))), key);
+			match &= _mm512_cmpge_epu32_mask(_mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(ProtocolEnd() + i))), key);
+			if (match)
+				return i + __builtin_ctz(match);
+		}
+#endif
+		for (; i + 8 <= n; i += 8) {
+			if (priority >= rule_priority[i])
+				return -1;
+			scan_num += 8;
+			__m256i match = _mm256_cmpgt_epi32(_mm256_loadu_si256((__m256i*)(rule_priority + i)), _mm256_set1_epi32(priority));
+			__m256i key = _mm256_set1_epi32(trace->key[0]);
+			match = _mm256_and_si256(match, InRange8(_mm256_loadu_si256((__m256i*)(SrcIpBegin() + i)),
+				_mm256_loadu_si256((__m256i*)(SrcIpEnd() + i)), key));
+			key = _mm256_set1_epi32(trace->key[1]);
+			match = _mm256_and_si256(match, InRange8(_mm256_loadu_si256((__m256i*)(DstIpBegin() + i)),
+				_mm256_loadu_si256((__m256i*)(DstIpEnd() + i)), key));
+			key = _mm256_set1_epi32(trace->key[2]);
+			match = _mm256_and_si256(match, InRange8(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(SrcPortBegin() + i))),
+				_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(SrcPortEnd() + i))), key));
+			key = _mm256_set1_epi32(trace->key[3]);
+			match = _mm256_and_si256(match, InRange8(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(DstPortBegin() + i))),
+				_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(DstPortEnd() + i))), key));
+			key = _mm256_set1_epi32(trace->key[4]);
+			match = _mm256_and_si256(match, InRange8(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(ProtocolBegin() + i))),
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(ProtocolEnd() + i))), key));
+			uint32_t match_mask = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+			if (match_mask)
+				return i + __builtin_ctz(match_mask);
+		}
+		for (; i < n; ++i) {
+			if (priority >= rule_priority[i])
+				return -1;
+			++scan_num;
+			if (SrcIpBegin()[i] <= trace->key[0] && trace->key[0] <= SrcIpEnd()[i] &&
+				DstIpBegin()[i] <= trace->key[1] && trace->key[1] <= DstIpEnd()[i] &&
+				SrcPortBegin()[i] <= trace->key[2] && trace->key[2] <= SrcPortEnd()[i] &&
+				DstPortBegin()[i] <= trace->key[3] && trace->key[3] <= DstPortEnd()[i] &&
+				ProtocolBegin()[i] <= trace->key[4] && trace->key[4] <= ProtocolEnd()[i])
+				return i;
+		}
+		return -1;
+	}
+
+	// begin <= key <= end, unsigned
+	static __m256i InRange8(__m256i begin, __m256i end, __m256i key) {
+		return _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(begin, key), key),
+			_mm256_cmpeq_epi32(_mm256_min_epu32(end, key), key));
+	}
+};
+
+// Rules of one hash node as blocks of at most MRULEBLOCKSIZE rules, priority decreases from block to block.
+// Insert and delete binary search the blocks and memmove inside one block only,
+// Match scans the blocks in order. The first block is kept inline, most hash nodes have only one.
+struct MRuleBlocks {
+	MRuleArray first_block;
+	MRuleArray *more_blocks;  // block 1 .. blocks_num - 1
+	uint32_t blocks_num;
+	uint32_t max_blocks_num;
+	MSlab *slab;
+	uint64_t gen;  // buffers with this gen belong to this copy only
+
+	MRuleArray* Block(int i) { return i == 0 ? &first_block : &more_blocks[i - 1]; }
+	int MinPriority(int i) {
+		MRuleArray *block = Block(i);
+		return block->Priority()[block->rules_num - 1];
+	}
+	int MaxPriority() {
+		return first_block.rules_num == 0 ? 0 : first_block.Priority()[0];
 	}
-    uint64_t MemorySize() {
-		return sizeof(MRuleNode);
+	// the lowest priority rule, NULL if empty
+	Rule* LastRule() {
+		MRuleArray *block = Block(blocks_num - 1);
+		return block->rules_num == 0 ? NULL : block->Rules()[block->rules_num - 1];
 	}
-	
-	int Free(bool free_self) {
-		if (free_self)
-			free(this);
-		return 0;
+
+	void Init(MSlab *_slab) {
+		first_block.Init();
+		more_blocks = NULL;
+		blocks_num = 1;
+		max_blocks_num = 1;
+		slab = _slab;
+		gen = slab->NewGen();
 	}
+
+	int FindBlock(int priority);
+	void InsertBlock(int i);
+	void RemoveBlock(int i);
+	int InsertRule(Rule *rule);
+	int DeleteRule(Rule *rule);
+	int BulkLoad(Rule **rules, int rules_num);  // empty blocks, rules sorted by priority (high to low)
+	int GetRules(vector<Rule*> &rules);
+	int Free();
+
+	// max(priority, the highest matching rule priority)
+	int Match(Trace *trace, int priority, int &scan_num) {
+		int rule_index = first_block.Match(trace, priority, scan_num);
+		if (rule_index >= 0)
+			return first_block.Priority()[rule_index];
+		for (int i = 1; i < blocks_num; ++i) {
+			MRuleArray *block = &more_blocks[i - 1];
+			if (priority >= block->Priority()[0])
+				break;
+			rule_index = block->Match(trace, priority, scan_num);
+			if (rule_index >= 0)
+				return block->Priority()[rule_index];
+		}
+		return priority;
+	}
+};
+
+// rules of next_multilayertuple when the merge started, [0, merged_num) are in rule_blocks too
+struct MMerge {
+    Rule **rules;
+    uint32_t rules_num;
+    uint32_t merged_num;
+
+    int Find(Rule *rule);
+    void Remove(int i);
+};
+
+// a migrating hash node, shared by the hash node and its Copy
+template<int DIMS>
+struct MMigrate {
+    MHashNode<DIMS> *hash_node;  // the one in the slot, ReplaceHashNode sets its Copy
+    MHashTable<DIMS> *hash_table;
+    uint32_t index;  // in MMigration::nodes
+    MMerge merge;  // MIGRATE_MERGE only
 };
 
+// Migration state of a start tuple layer, shared by all its next layers.
+// Every update moves at most rules_num rules: first for the hash nodes it changes, then Drain gives
+// the rest to the other migrating hash nodes, the last started first. So a migration ends after at most
+// (its rules / rules_num) updates of any rules. Without updates a hash node may stay half migrated,
+// lookups match both sides and get the same results, only slower.
+template<int DIMS>
+struct MMigration {
+    uint32_t rules_num;  // rules moved to or from next layers per update, all layers together
+    uint32_t budget;  // moves left in the current update
+    int split_scan_num;
+    MMigrate<DIMS> **nodes;
+    uint32_t nodes_num;
+    uint32_t max_nodes_num;
+
+    void Init();
+    MMigrate<DIMS>* Start(MHashNode<DIMS> *hash_node, MHashTable<DIMS> *hash_table);
+    void Finish(MMigrate<DIMS> *migrate);
+    void Drain();
+    uint64_t MemorySize();
+    void Free();
+};
+
+// With concurrent lookups a hash node in a hash table is never changed,
+// an update changes a Copy and puts it in the slot of the hash node.
+template<int DIMS>
 struct MHashNode {
-    MRuleNode *rule_node;
-    MHashNode *next;
+    typedef typename MKeyTraits<DIMS>::Key Key;
 
-    uint32_t keys[5];
+    MRuleBlocks rule_blocks;
+
+    Key key;
     uint32_t hash;
     uint32_t rules_num;
     int max_priority;
 
+    // While migrate_state != MIGRATE_NONE the rules are split between rule_blocks and next_multilayertuple,
+    // updates move them as MMigration describes and lookups match both.
+    // A merge copies and drops next_multilayertuple at the end, a lookup on the old hash node still finds every rule.
     bool has_next_multilayertuple;
-    class MultilayerTuple *next_multilayertuple;
+    uint8_t migrate_state;
+    uint32_t split_rules_num;  // rules_num to split at, doubled when the measured scan length is short
+    uint32_t merge_rules_num;  // rules_num to merge back at, set from the scan length measured at the split
+    MultilayerTuple<DIMS> *next_multilayertuple;
+    MMigrate<DIMS> *migrate;  // NULL when migrate_state == MIGRATE_NONE
 
-    MHashNode(uint32_t *_keys, uint32_t _hash);
-    bool SameKey(uint32_t *_keys);
-    int InsertRule(Rule *rule, uint32_t tuple_layer);
-    int DeleteRule(Rule *rule, uint32_t tuple_layer);
-    uint64_t MemorySize();
+    MHashNode(Key _key, uint32_t _hash, MSlab *slab);
+    MHashNode<DIMS>* Copy();  // shares the rule buffers and next_multilayertuple
+    void FreeShell();  // this has been replaced by its Copy, which owns the rules now
+    bool SameKey(Key _key) {
+        return key == _key;
+    }
+    int InsertRule(Rule *rule, MHashTable<DIMS> *hash_table);
+    int DeleteRule(Rule *rule, MHashTable<DIMS> *hash_table);
+    int BulkLoad(Rule **rules, int _rules_num, MHashTable<DIMS> *hash_table);  // rules sorted by priority (high to low)
+    bool ShouldSplit(MHashTable<DIMS> *hash_table);
+    int SampleScanNum();
+    void Migrate(MMigration<DIMS> *migration);
+    void StartMerge(MHashTable<DIMS> *hash_table);
+    // max(priority, the highest matching rule priority in both representations)
+    int Match(Trace *trace, int priority, int &scan_num) {
+        if (has_next_multilayertuple)
+            priority = next_multilayertuple->Lookup(trace, priority);
+        return rule_blocks.Match(trace, priority, scan_num);
+    }
+    uint64_t MemorySize();  // the hash node itself and its rules are counted by the slab
     int CalculateState(ProgramState *program_state);
     int GetRules(vector<Rule*> &rules);
     int Free(bool free_self);
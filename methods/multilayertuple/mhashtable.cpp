@@ -2,192 +2,328 @@
 
 using namespace std;
 
-extern int prefix_dims_num;
-
-int MHashTable::Init(int size, uint32_t _tuple_layer) {
+template<int DIMS>
+int MHashTable<DIMS>::Init(int size, uint32_t _tuple_layer, MSlab *_slab, MMigration<DIMS> *_migration, MultilayerTuple<DIMS> *_multilayertuple) {
 	tuple_layer = _tuple_layer;
+    slab = _slab;
+    migration = _migration;
+    multilayertuple = _multilayertuple;
+    max_priority = 0;
+    view = NULL;
+    InitBuckets(size);
+    PublishView();
+    return 0;
+}
 
+template<int DIMS>
+int MHashTable<DIMS>::InitBuckets(int size) {
     hash_node_num = 0;
     max_hash_node_num = size * MHASHTABLEMAX;
 	min_hash_node_num = size * MHASHTABLEMIN;
-	mask = size - 1;
-    hash_node_arr = (MHashNode**)malloc(sizeof(MHashNode*) * (mask + 1));
+	mask = size / MHASHBUCKETSLOTS - 1;
+    buckets = (MHashBucket*)aligned_alloc(sizeof(MHashBucket), sizeof(MHashBucket) * (mask + 1));
+    memset(buckets, 0, sizeof(MHashBucket) * (mask + 1));
+    hash_node_arr = (MHashNode<DIMS>**)malloc(sizeof(MHashNode<DIMS>*) * size);
     for (int i = 0; i < size; ++i)
         hash_node_arr[i] = NULL;
-    max_priority = 0;
+    bucket_max = (int*)malloc(sizeof(int) * 2 * (mask + 1));
+    memset(bucket_max, 0, sizeof(int) * 2 * (mask + 1));
 	return 0;
 }
 
-int MHashTable::InsertHashNode(MHashNode *hash_node) {
+template<int DIMS>
+void MHashTable<DIMS>::PublishView() {
+    MHashView<DIMS> *origin_view = view;
+    MHashView<DIMS> *new_view = (MHashView<DIMS>*)slab->Alloc(sizeof(MHashView<DIMS>));
+    new_view->mask = mask;
+    new_view->buckets = buckets;
+    new_view->hash_node_arr = hash_node_arr;
+    __atomic_store_n(&view, new_view, __ATOMIC_RELEASE);
+    slab->Release(origin_view, sizeof(MHashView<DIMS>));
+}
+
+template<int DIMS>
+void MHashTable<DIMS>::UpdateBucketMax(uint32_t index) {
+    int priority = 0;
+    for (int j = 0; j < MHASHBUCKETSLOTS; ++j)
+        priority = max(priority, buckets[index].max_priority[j]);
+    uint32_t i = mask + 1 + index;
+    bucket_max[i] = priority;
+    for (i >>= 1; i > 0; i >>= 1) {
+        priority = max(bucket_max[i * 2], bucket_max[i * 2 + 1]);
+        if (bucket_max[i] == priority)
+            break;
+        bucket_max[i] = priority;
+    }
+}
+
+// the slot is filled before its max_priority makes lookups read it
+template<int DIMS>
+int MHashTable<DIMS>::InsertHashNode(MHashNode<DIMS> *hash_node) {
     if (hash_node_num == max_hash_node_num)
-        HashTableResize((mask + 1) << 1);
+        HashTableResize((mask + 1) * MHASHBUCKETSLOTS * 2);
     ++hash_node_num;
     uint32_t index = hash_node->hash & mask;
-    MHashNode *pre = hash_node_arr[index];
-
-    if (!pre || hash_node->max_priority > pre->max_priority) {
-        hash_node_arr[index] = hash_node;
-		hash_node->next = pre;
-        return 0;
-    }
-	MHashNode *next = pre->next;
     while (true) {
-		if (!next || hash_node->max_priority > next->max_priority) {
-			pre->next = hash_node;
-			hash_node->next = next;
-			return 0;
-		}
-		pre = next;
-		next = pre->next;
-	}
+        MHashBucket *bucket = &buckets[index];
+        uint32_t empty_slots = bucket->EmptySlots();
+        if (empty_slots) {
+            int slot = __builtin_ctz(empty_slots);
+            if (hash_node->migrate)
+                hash_node->migrate->hash_node = hash_node;
+            __atomic_store_n(&hash_node_arr[index * MHASHBUCKETSLOTS + slot], hash_node, __ATOMIC_RELEASE);
+            bucket->fingerprints[slot] = HashFingerprint(hash_node->hash);
+            __atomic_store_n(&bucket->max_priority[slot], hash_node->max_priority, __ATOMIC_RELEASE);
+            UpdateBucketMax(index);
+            return 0;
+        }
+        ++bucket->overflow_num;
+        bucket->overflow_max_priority = max(bucket->overflow_max_priority, hash_node->max_priority);
+        index = (index + 1) & mask;
+    }
 	return 1;
 }
 
-MHashNode* MHashTable::PickHashNode(uint32_t *keys, uint32_t hash) {
+template<int DIMS>
+int MHashTable<DIMS>::FindSlot(Key key, uint32_t hash) {
     uint32_t index = hash & mask;
-    MHashNode *hash_node = hash_node_arr[index];
-    MHashNode *pre_hash_node = NULL;
-    while (hash_node) {
-        if (hash_node->SameKey(keys)) {
-            if (pre_hash_node == NULL)
-				hash_node_arr[index] = hash_node->next;
-			else
-				pre_hash_node->next = hash_node->next;
-			--hash_node_num;
-			hash_node->next = NULL;
-			return hash_node;
+    uint16_t fingerprint = HashFingerprint(hash);
+    while (true) {
+        MHashBucket *bucket = &buckets[index];
+        uint32_t slots = bucket->MatchSlots(fingerprint, 0);
+        while (slots) {
+            int slot = index * MHASHBUCKETSLOTS + __builtin_ctz(slots);
+            if (hash_node_arr[slot]->SameKey(key))
+                return slot;
+            slots &= slots - 1;
         }
-        pre_hash_node = hash_node;
-        hash_node = hash_node->next;
+        if (bucket->overflow_num == 0)
+            return -1;
+        index = (index + 1) & mask;
     }
-    return NULL;
+    return -1;
 }
 
-int MHashTable::HashTableResize(uint32_t size) {
-	// printf("HashTableResize\n");
-    uint32_t origin_size = mask + 1;
-    MHashNode **origin_hash_node_arr = hash_node_arr;
+// hash_node is the updated hash node in slot or its Copy
+template<int DIMS>
+void MHashTable<DIMS>::ReplaceHashNode(uint32_t slot, MHashNode<DIMS> *hash_node) {
+    uint32_t index = slot / MHASHBUCKETSLOTS;
+    MHashNode<DIMS> *origin_hash_node = hash_node_arr[slot];
+    // the buckets probed before this one must let lookups pass on to the higher max_priority
+    if (hash_node->max_priority > buckets[index].max_priority[slot % MHASHBUCKETSLOTS])
+        for (uint32_t i = hash_node->hash & mask; i != index; i = (i + 1) & mask)
+            buckets[i].overflow_max_priority = max(buckets[i].overflow_max_priority, hash_node->max_priority);
+    if (hash_node->migrate)
+        hash_node->migrate->hash_node = hash_node;
+    __atomic_store_n(&hash_node_arr[slot], hash_node, __ATOMIC_RELEASE);
+    __atomic_store_n(&buckets[index].max_priority[slot % MHASHBUCKETSLOTS], hash_node->max_priority, __ATOMIC_RELEASE);
+    UpdateBucketMax(index);
+    if (origin_hash_node != hash_node)
+        origin_hash_node->FreeShell();
+}
 
-    hash_node_num = 0;
-    max_hash_node_num = size * MHASHTABLEMAX;
-	min_hash_node_num = size * MHASHTABLEMIN;
-	mask = size - 1;
-    hash_node_arr = (MHashNode**)malloc(sizeof(MHashNode*) * (mask + 1));
-    for (int i = 0; i < size; ++i)
-        hash_node_arr[i] = NULL;
+// MMigration::Drain, the hash node migrates as in an update of its rules
+template<int DIMS>
+void MHashTable<DIMS>::MigrateHashNode(MHashNode<DIMS> *hash_node) {
+    int slot = FindSlot(hash_node->key, hash_node->hash);
+    if (slot < 0) {
+        printf("Wrong: MigrateHashNode no such hash_node\n");
+        exit(1);
+    }
+    if (slab->deferred)
+        hash_node = hash_node->Copy();
+    hash_node->Migrate(migration);
+    ReplaceHashNode(slot, hash_node);
+}
 
-    MHashNode *hash_node, *next;
-    for (int i = 0; i < origin_size; ++i) {
-        hash_node = origin_hash_node_arr[i];
-        while (hash_node) {
-            next = hash_node->next;
-            hash_node->next = NULL;
-            InsertHashNode(hash_node);
-            hash_node = next;
-        }
+// lookups that read the slot before may still get NULL or the removed hash node
+template<int DIMS>
+void MHashTable<DIMS>::RemoveHashNode(uint32_t slot) {
+    uint32_t index = slot / MHASHBUCKETSLOTS;
+    MHashNode<DIMS> *hash_node = hash_node_arr[slot];
+    __atomic_store_n(&buckets[index].max_priority[slot % MHASHBUCKETSLOTS], 0, __ATOMIC_RELEASE);
+    buckets[index].fingerprints[slot % MHASHBUCKETSLOTS] = 0;
+    __atomic_store_n(&hash_node_arr[slot], (MHashNode<DIMS>*)NULL, __ATOMIC_RELEASE);
+    UpdateBucketMax(index);
+    --hash_node_num;
+    // the buckets probed before this one no longer overflow for hash_node
+    for (uint32_t i = hash_node->hash & mask; i != index; i = (i + 1) & mask) {
+        if (--buckets[i].overflow_num == 0)
+            buckets[i].overflow_max_priority = 0;
     }
-    free(origin_hash_node_arr);
+}
+
+// lookups keep the old view until the new arrays are filled
+template<int DIMS>
+int MHashTable<DIMS>::HashTableResize(uint32_t size) {
+	// printf("HashTableResize\n");
+    uint32_t origin_size = (mask + 1) * MHASHBUCKETSLOTS;
+    MHashBucket *origin_buckets = buckets;
+    MHashNode<DIMS> **origin_hash_node_arr = hash_node_arr;
+    free(bucket_max);
+
+    InitBuckets(size);
+    for (int i = 0; i < origin_size; ++i)
+        if (origin_hash_node_arr[i])
+            InsertHashNode(origin_hash_node_arr[i]);
+    PublishView();
+    slab->ReleaseMalloc(origin_buckets);
+    slab->ReleaseMalloc(origin_hash_node_arr);
     return 0;
 }
 
-int MHashTable::InsertRule(Rule *rule, uint32_t *keys, uint32_t hash) {
-	MHashNode *hash_node = PickHashNode(keys, hash);
-    if (!hash_node)
-        hash_node = new MHashNode(keys, hash);
-    // printf("hash_node %016lx\n", (uint64_t)hash_node);
-    hash_node->InsertRule(rule, tuple_layer);
-    InsertHashNode(hash_node);
-    if (rule->priority > max_priority)
-        max_priority = rule->priority;
+template<int DIMS>
+int MHashTable<DIMS>::InsertRule(Rule *rule, Key key, uint32_t hash) {
+    int slot = FindSlot(key, hash);
+    if (slot < 0) {
+        MHashNode<DIMS> *hash_node = new (slab->Alloc(sizeof(MHashNode<DIMS>))) MHashNode<DIMS>(key, hash, slab);
+        hash_node->InsertRule(rule, this);
+        InsertHashNode(hash_node);
+    } else {
+        MHashNode<DIMS> *hash_node = slab->deferred ? hash_node_arr[slot]->Copy() : hash_node_arr[slot];
+        hash_node->InsertRule(rule, this);
+        ReplaceHashNode(slot, hash_node);
+    }
+    max_priority = bucket_max[1];
 	return 0;
 }
 
-int MHashTable::DeleteRule(Rule *rule, uint32_t *keys, uint32_t hash) {
-    MHashNode *hash_node = PickHashNode(keys, hash);
-    if (!hash_node) {
+template<int DIMS>
+int MHashTable<DIMS>::DeleteRule(Rule *rule, Key key, uint32_t hash) {
+    int slot = FindSlot(key, hash);
+    if (slot < 0) {
         printf("Wrong: No such hash_node\n");
         return 1;
     }
-    if (hash_node->DeleteRule(rule, tuple_layer) > 0) {
+    MHashNode<DIMS> *origin_hash_node = hash_node_arr[slot];
+    MHashNode<DIMS> *hash_node = slab->deferred ? origin_hash_node->Copy() : origin_hash_node;
+    if (hash_node->DeleteRule(rule, this) > 0) {
+        if (hash_node != origin_hash_node)
+            hash_node->FreeShell();
         printf("Wrong: HashNode DeleteRule\n");
         return 1;
     }
     if (hash_node->rules_num == 0){
+        RemoveHashNode(slot);
+        if (hash_node != origin_hash_node)
+            origin_hash_node->FreeShell();
         hash_node->Free(true);
-        if (hash_node_num < min_hash_node_num && mask + 1 > 32)
-            HashTableResize((mask + 1)/ 2);
+        if (hash_node_num < min_hash_node_num && mask + 1 > 32 / MHASHBUCKETSLOTS)
+            HashTableResize((mask + 1) * MHASHBUCKETSLOTS / 2);
     }
     else{
-        InsertHashNode(hash_node);
-    }
-    if (rule->priority == max_priority) {
-        max_priority = 0;
-        for (int i = 0; i <= mask; ++i)
-            if (hash_node_arr[i])
-                max_priority = max(max_priority, hash_node_arr[i]->max_priority);
+        ReplaceHashNode(slot, hash_node);
     }
+    max_priority = bucket_max[1];
     return 0;
 }
 
-uint64_t MHashTable::MemorySize() {
-    uint64_t memory_size = sizeof(MHashTable);
-    memory_size += sizeof(MHashNode*) * (mask + 1);
-    MHashNode *hash_node = NULL;
-    for (int i = 0; i <= mask; ++i) {
-        hash_node = hash_node_arr[i];
-        while (hash_node) {
-            memory_size += hash_node->MemorySize();
-            hash_node = hash_node->next;
-        }
+template<int DIMS>
+int MHashTable<DIMS>::BulkLoad(Rule **rules, Key *keys, uint32_t *hashes, int rules_num) {
+    // group the rules by key, ties broken by index keep the priority order inside a group
+    vector<pair<Key, int> > order(rules_num);
+    for (int i = 0; i < rules_num; ++i)
+        order[i] = make_pair(keys[i], i);
+    sort(order.begin(), order.end());
+    uint32_t nodes_num = 0;
+    for (int i = 0; i < rules_num; ++i)
+        if (i == 0 || order[i].first != order[i - 1].first)
+            ++nodes_num;
+
+    // the size InsertRule would have doubled to
+    uint32_t size = (mask + 1) * MHASHBUCKETSLOTS;
+    while (nodes_num > (uint32_t)(size * MHASHTABLEMAX))
+        size *= 2;
+    if (size != (mask + 1) * MHASHBUCKETSLOTS) {
+        slab->ReleaseMalloc(buckets);
+        slab->ReleaseMalloc(hash_node_arr);
+        free(bucket_max);
+        InitBuckets(size);
+        PublishView();
+    }
+
+    vector<Rule*> group_rules(rules_num);
+    vector<pair<int, int> > groups;  // (first rule, group begin)
+    for (int i = 0; i < rules_num; ++i) {
+        group_rules[i] = rules[order[i].second];
+        if (i == 0 || order[i].first != order[i - 1].first)
+            groups.push_back(make_pair(order[i].second, i));
     }
+    // create the hash nodes in rules order as InsertRule would, updates in rules order then walk memory forward
+    sort(groups.begin(), groups.end());
+    for (int k = 0; k < groups.size(); ++k) {
+        int i = groups[k].second;
+        int j = i + 1;
+        while (j < rules_num && order[j].first == order[i].first)
+            ++j;
+        MHashNode<DIMS> *hash_node = new (slab->Alloc(sizeof(MHashNode<DIMS>))) MHashNode<DIMS>(order[i].first, hashes[order[i].second], slab);
+        hash_node->BulkLoad(&group_rules[i], j - i, this);
+        InsertHashNode(hash_node);
+    }
+    max_priority = bucket_max[1];
+    return 0;
+}
+
+template<int DIMS>
+uint64_t MHashTable<DIMS>::MemorySize() {
+    uint64_t memory_size = sizeof(MHashTable<DIMS>) + ArraysSize(mask + 1);
+    int size = (mask + 1) * MHASHBUCKETSLOTS;
+    for (int i = 0; i < size; ++i)
+        if (hash_node_arr[i])
+            memory_size += hash_node_arr[i]->MemorySize();
     return memory_size;
 }
 
-int MHashTable::CalculateState(ProgramState *program_state) {
+template<int DIMS>
+int MHashTable<DIMS>::CalculateState(ProgramState *program_state) {
     program_state->hash_node_num += hash_node_num;
     program_state->bucket_sum += mask + 1;
-    MHashNode *hash_node = NULL;
+    program_state->slot_sum += (mask + 1) * MHASHBUCKETSLOTS;
     for (int i = 0; i <= mask; ++i) {
-        hash_node = hash_node_arr[i];
-        if (hash_node != NULL)
+        if (buckets[i].EmptySlots() != (1U << MHASHBUCKETSLOTS) - 1)
             ++program_state->bucket_use;
-        while (hash_node) {
+        for (int j = 0; j < MHASHBUCKETSLOTS; ++j) {
+            MHashNode<DIMS> *hash_node = hash_node_arr[i * MHASHBUCKETSLOTS + j];
+            if (!hash_node)
+                continue;
+            // buckets probed to reach hash_node from its home bucket
+            int chain_len = ((i - (hash_node->hash & mask)) & mask) + 1;
+            program_state->hash_chain_sum += chain_len;
+            program_state->hash_chain_max = max(program_state->hash_chain_max, chain_len);
             hash_node->CalculateState(program_state);
-            hash_node = hash_node->next;
         }
     }
 	return 0;
 }
 
-int MHashTable::GetRules(vector<Rule*> &rules) {
-    MHashNode *hash_node = NULL, *next_hash_node = NULL;
-    for (int i = 0; i <= mask; ++i) {
-        hash_node = hash_node_arr[i];
-        while (hash_node) {
-            next_hash_node = hash_node->next;
-            hash_node->GetRules(rules);
-            hash_node = next_hash_node;
-        }
-    }
+template<int DIMS>
+int MHashTable<DIMS>::GetRules(vector<Rule*> &rules) {
+    int size = (mask + 1) * MHASHBUCKETSLOTS;
+    for (int i = 0; i < size; ++i)
+        if (hash_node_arr[i])
+            hash_node_arr[i]->GetRules(rules);
 	return 0;
 }
 
-int MHashTable::Free(bool free_self) {
-    MHashNode *hash_node = NULL, *next_hash_node = NULL;
-    for (int i = 0; i <= mask; ++i) {
-        hash_node = hash_node_arr[i];
-        while (hash_node) {
-            next_hash_node = hash_node->next;
-            hash_node->Free(true);
-            hash_node = next_hash_node;
-        }
-    }
-    free(hash_node_arr);
+template<int DIMS>
+int MHashTable<DIMS>::Free(bool free_self) {
+    int size = (mask + 1) * MHASHBUCKETSLOTS;
+    for (int i = 0; i < size; ++i)
+        if (hash_node_arr[i])
+            hash_node_arr[i]->Free(true);
+    slab->ReleaseMalloc(buckets);
+    slab->ReleaseMalloc(hash_node_arr);
+    free(bucket_max);
+    slab->Release(view, sizeof(MHashView<DIMS>));
     if (free_self)
         free(this);
 	return 0;
 }
 
-int MHashTable::Test(void *ptr) {
+template<int DIMS>
+int MHashTable<DIMS>::Test(void *ptr) {
 	return 0;
-}
\ No newline at end of file
+}
+
+template struct MHashTable<2>;
+template struct MHashTable<5>;
@@ -4,31 +4,105 @@
 #include "../../elementary.h"
 #include "mhashnode.h"
 
+#include <immintrin.h>
+
 #define MHASHTABLEMAX 0.85
 #define MHASHTABLEMIN 0.2
+#define MHASHBUCKETSLOTS 8
 
 using namespace std;
 
 
-struct MHashNode;
+template<int DIMS> struct MHashNode;
+template<int DIMS> struct MMigration;
+template<int DIMS> class MultilayerTuple;
+
+inline uint16_t HashFingerprint(uint32_t hash) {
+    return hash >> 16;
+}
+
+// One cache line holds the max_priority and the key fingerprint of 8 hash nodes.
+// A slot with max_priority 0 is empty, hash nodes always hold rules with priority > 0.
+struct MHashBucket {
+    int max_priority[MHASHBUCKETSLOTS];
+    uint16_t fingerprints[MHASHBUCKETSLOTS];
+    int overflow_max_priority;  // max_priority of the hash nodes probed past this bucket
+    uint32_t overflow_num;
+    uint64_t reserved;
+
+    // slots with the same fingerprint and max_priority > priority
+    uint32_t MatchSlots(uint16_t fingerprint, int priority) {
+        __m256i priorities = _mm256_load_si256((__m256i*)max_priority);
+        __m256i priority_cmp = _mm256_cmpgt_epi32(priorities, _mm256_set1_epi32(priority));
+        uint32_t priority_mask = _mm256_movemask_ps(_mm256_castsi256_ps(priority_cmp));
+        __m128i keys = _mm_load_si128((__m128i*)fingerprints);
+        __m128i keys_cmp = _mm_cmpeq_epi16(keys, _mm_set1_epi16(fingerprint));
+        uint32_t fingerprint_mask = _pext_u32(_mm_movemask_epi8(keys_cmp), 0x5555);
+        return priority_mask & fingerprint_mask;
+    }
+
+    uint32_t EmptySlots() {
+        __m256i priorities = _mm256_load_si256((__m256i*)max_priority);
+        __m256i empty_cmp = _mm256_cmpeq_epi32(priorities, _mm256_setzero_si256());
+        return _mm256_movemask_ps(_mm256_castsi256_ps(empty_cmp));
+    }
+} __attribute__((aligned(64)));
+
+// what lookups read of a hash table, replaced as a whole when the table is resized
+template<int DIMS>
+struct MHashView {
+    uint32_t mask;
+    MHashBucket *buckets;
+    MHashNode<DIMS> **hash_node_arr;
+};
 
+// Open addressing with linear probing over buckets, no chains.
+// A hash node stays in its slot while it is updated, a resize fills new arrays and publishes them in a new view.
+template<int DIMS>
 struct MHashTable {
+    typedef typename MKeyTraits<DIMS>::Key Key;
+
     uint32_t tuple_layer;
+    MSlab *slab;  // of the hash nodes
+    MMigration<DIMS> *migration;  // of the start tuple layer
+    MultilayerTuple<DIMS> *multilayertuple;  // of the tuple, the parent of the next layers of the hash nodes
 
     uint32_t hash_node_num;
     uint32_t max_hash_node_num;
     uint32_t min_hash_node_num;
-    uint32_t mask;  //sizeof MHashNode - 1
-    MHashNode **hash_node_arr;
+    uint32_t mask;  // buckets num - 1
+    MHashBucket *buckets;
+    MHashNode<DIMS> **hash_node_arr;  // MHASHBUCKETSLOTS per bucket
     int max_priority;
 
-    int Init(int size, uint32_t _tuple_layer);
-    int InsertHashNode(MHashNode *hash_node);
-    MHashNode* PickHashNode(uint32_t *keys, uint32_t hash);
+    // max tree over the buckets, bucket_max[1] is max_priority, bucket i is the leaf mask + 1 + i.
+    // Keeps max_priority in O(log buckets) on delete without touching the hash nodes.
+    int *bucket_max;
+    MHashView<DIMS> *view;
+
+    MHashView<DIMS>* View() {
+        return __atomic_load_n(&view, __ATOMIC_ACQUIRE);
+    }
+
+    // buckets, hash_node_arr and bucket_max of buckets_num buckets
+    static uint64_t ArraysSize(uint32_t buckets_num) {
+        return (sizeof(MHashBucket) + sizeof(MHashNode<DIMS>*) * MHASHBUCKETSLOTS + sizeof(int) * 2) * (uint64_t)buckets_num;
+    }
+
+    int Init(int size, uint32_t _tuple_layer, MSlab *_slab, MMigration<DIMS> *_migration, MultilayerTuple<DIMS> *_multilayertuple);  // size : slots num
+    int InitBuckets(int size);
+    void PublishView();
+    void UpdateBucketMax(uint32_t index);
+    int InsertHashNode(MHashNode<DIMS> *hash_node);
+    int FindSlot(Key key, uint32_t hash);  // -1 if none
+    void ReplaceHashNode(uint32_t slot, MHashNode<DIMS> *hash_node);
+    void RemoveHashNode(uint32_t slot);
+    void MigrateHashNode(MHashNode<DIMS> *hash_node);  // hash_node is in the table
     int HashTableResize(uint32_t size);
 
-    int InsertRule(Rule *rule, uint32_t *keys, uint32_t hash);
-    int DeleteRule(Rule *rule, uint32_t *keys, uint32_t hash);
+    int InsertRule(Rule *rule, Key key, uint32_t hash);
+    int DeleteRule(Rule *rule, Key key, uint32_t hash);
+    int BulkLoad(Rule **rules, Key *keys, uint32_t *hashes, int rules_num);  // empty table, rules sorted by priority
     uint64_t MemorySize();
     int CalculateState(ProgramState *program_state);
     int GetRules(vector<Rule*> &rules);
@@ -36,20 +110,26 @@ struct MHashTable {
     int Test(void *ptr);
 };
 
+template<int DIMS>
 struct MTuple {
+    typedef typename MKeyTraits<DIMS>::Key Key;
+
     uint32_t tuple_layer;
-    uint32_t prefix_len[5];
-    uint32_t prefix_len_zero[5];
+    uint32_t tuple_id;  // bit in the TupleTrie bitmaps
+    int index;  // position in MultilayerTuple::tuples_arr
+    uint32_t prefix_len[DIMS];
+    uint32_t prefix_len_zero[DIMS];
 
     int max_priority;
     int rules_num;
 
-    MHashTable hash_table;
+    MHashTable<DIMS> hash_table;
 
-    MTuple(uint32_t _tuple_layer, uint32_t *_prefix_len);
+    MTuple(uint32_t _tuple_layer, uint32_t *_prefix_len, MSlab *slab, MMigration<DIMS> *migration, MultilayerTuple<DIMS> *multilayertuple);
     int InsertRule(Rule *rule);
     int DeleteRule(Rule *rule);
-    uint64_t MemorySize();
+    int BulkLoad(vector<Rule*> &rules);  // empty tuple, rules sorted by priority (high to low)
+    uint64_t MemorySize();  // without the MTuple itself, it is counted by the slab
     int CalculateState(ProgramState *program_state);
     int GetRules(vector<Rule*> &rules);
     int Free(bool free_self);
@@ -0,0 +1,170 @@
+#include "mslab.h"
+
+using namespace std;
+
+// reader slot of the thread in reader_epochs, the same in every slab
+static __thread int mslab_reader = -1;
+static int mslab_readers_num = 0;
+
+int MSlab::Init() {
+    chunks = NULL;
+    chunks_num = 0;
+    max_chunks_num = 0;
+    chunk_cur = NULL;
+    chunk_end = NULL;
+    for (int i = 0; i < MSLABCLASSES; ++i)
+        free_lists[i] = NULL;
+    used_size = 0;
+    chunks_size = 0;
+    freeing = false;
+    deferred = false;
+    epoch = 0;
+    retired = NULL;
+    retired_num = 0;
+    max_retired_num = 0;
+    gen = 0;
+    reader_epochs = NULL;
+    return 0;
+}
+
+// lookups may run during the updates from now on
+void MSlab::Defer() {
+    deferred = true;
+    reader_epochs = (MReaderEpoch*)aligned_alloc(sizeof(MReaderEpoch), sizeof(MReaderEpoch) * MSLABREADERS);
+    for (int i = 0; i < MSLABREADERS; ++i)
+        reader_epochs[i].epoch = MSLABIDLE;
+}
+
+// chunks grow from MSLABMINCHUNKSIZE so that small classifiers stay small
+void MSlab::NewChunk() {
+    if (chunks_num == max_chunks_num) {
+        max_chunks_num = max_chunks_num == 0 ? 16 : max_chunks_num * 2;
+        chunks = (char**)realloc(chunks, sizeof(char*) * max_chunks_num);
+    }
+    uint32_t chunk_size = MSLABMINCHUNKSIZE;
+    for (int i = 0; i < chunks_num && chunk_size < MSLABMAXCHUNKSIZE; ++i)
+        chunk_size *= 4;
+    chunk_cur = (char*)malloc(chunk_size);
+    chunk_end = chunk_cur + chunk_size;
+    chunks[chunks_num++] = chunk_cur;
+    chunks_size += chunk_size;
+}
+
+void* MSlab::Alloc(uint32_t size) {
+    used_size += BlockSize(size);
+    if (size > MSLABMAXSIZE)
+        return malloc(size);
+    int size_class = SizeClass(size);
+    uint32_t class_size = ClassSize(size_class);
+    void *ptr = free_lists[size_class];
+    if (ptr) {
+        free_lists[size_class] = *(void**)ptr;
+        return ptr;
+    }
+    if (chunk_end - chunk_cur < class_size)
+        NewChunk();
+    ptr = chunk_cur;
+    chunk_cur += class_size;
+    return ptr;
+}
+
+// size : the size given to Alloc
+void MSlab::Release(void *ptr, uint32_t size) {
+    if (!ptr)
+        return;
+    if (freeing) {
+        if (size > MSLABMAXSIZE)
+            free(ptr);
+        return;
+    }
+    if (deferred)
+        Retire(ptr, size);
+    else
+        Give(ptr, size);
+}
+
+// a block from malloc or aligned_alloc
+void MSlab::ReleaseMalloc(void *ptr) {
+    if (!ptr)
+        return;
+    if (freeing || !deferred) {
+        free(ptr);
+        return;
+    }
+    Retire(ptr, 0);
+}
+
+void MSlab::Retire(void *ptr, uint32_t size) {
+    if (retired_num == max_retired_num) {
+        max_retired_num = max_retired_num == 0 ? 64 : max_retired_num * 2;
+        retired = (MRetired*)realloc(retired, sizeof(MRetired) * max_retired_num);
+    }
+    retired[retired_num].ptr = ptr;
+    retired[retired_num].size = size;
+    retired[retired_num].epoch = epoch;
+    ++retired_num;
+}
+
+void MSlab::Give(void *ptr, uint32_t size) {
+    if (size == 0) {
+        free(ptr);
+        return;
+    }
+    used_size -= BlockSize(size);
+    if (size > MSLABMAXSIZE) {
+        free(ptr);
+        return;
+    }
+    int size_class = SizeClass(size);
+    *(void**)ptr = free_lists[size_class];
+    free_lists[size_class] = ptr;
+}
+
+// A reader in epoch e may hold the blocks retired in epoch e or later.
+// The new epoch is published before the readers are read, a reader that enters after that
+// sees the unlinked blocks gone.
+void MSlab::Reclaim() {
+    if (retired_num == 0)
+        return;
+    __atomic_store_n(&epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t min_epoch = epoch;
+    int readers_num = min(__atomic_load_n(&mslab_readers_num, __ATOMIC_SEQ_CST), MSLABREADERS);
+    for (int i = 0; i < readers_num; ++i)
+        min_epoch = min(min_epoch, __atomic_load_n(&reader_epochs[i].epoch, __ATOMIC_SEQ_CST));
+    uint32_t i = 0;
+    for (; i < retired_num && retired[i].epoch < min_epoch; ++i)
+        Give(retired[i].ptr, retired[i].size);
+    memmove(retired, retired + i, sizeof(MRetired) * (retired_num - i));
+    retired_num -= i;
+}
+
+// the slot is kept when the thread exits, at most MSLABREADERS lookup threads in a process
+void MSlab::ReadEnter() {
+    if (mslab_reader < 0) {
+        mslab_reader = __atomic_fetch_add(&mslab_readers_num, 1, __ATOMIC_SEQ_CST);
+        if (mslab_reader >= MSLABREADERS) {
+            printf("Wrong: more than %d lookup threads\n", MSLABREADERS);
+            exit(1);
+        }
+    }
+    __atomic_store_n(&reader_epochs[mslab_reader].epoch, __atomic_load_n(&epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void MSlab::ReadExit() {
+    __atomic_store_n(&reader_epochs[mslab_reader].epoch, MSLABIDLE, __ATOMIC_RELEASE);
+}
+
+int MSlab::Free() {
+    for (uint32_t i = 0; i < retired_num; ++i)
+        if (retired[i].size == 0 || retired[i].size > MSLABMAXSIZE)
+            free(retired[i].ptr);
+    free(retired);
+    free(reader_epochs);
+    for (int i = 0; i < chunks_num; ++i)
+        free(chunks[i]);
+    free(chunks);
+    Init();
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef MSLAB_H
+#define MSLAB_H
+
+#include "../../elementary.h"
+
+#include <new>
+
+#define MSLABMINCHUNKSIZE (16 * 1024)
+#define MSLABMAXCHUNKSIZE (256 * 1024)
+#define MSLABMAXSIZE 16384  // larger blocks are malloc-ed one by one
+#define MSLABCLASSES 36
+#define MSLABREADERS 64  // lookup threads of all classifiers together
+#define MSLABIDLE (~0ULL)  // epoch of a reader outside Lookup
+
+using namespace std;
+
+// a block unlinked by the writer, released when no reader can still hold it
+struct MRetired {
+    void *ptr;
+    uint32_t size;  // the size given to Alloc, 0 : malloc-ed
+    uint64_t epoch;
+};
+
+struct MReaderEpoch {
+    uint64_t epoch;
+} __attribute__((aligned(64)));
+
+// Slab allocator of one MultilayerTuple and all its next layers, holds the MTuple, MHashNode,
+// next layer MultilayerTuple objects and the MRuleArray buffers.
+// Blocks are carved in order from chunks, a released block goes to the free list of its size class.
+// Size classes : 16 bytes apart up to 128 bytes, then 4 classes per power of 2.
+struct MSlab {
+    char **chunks;
+    uint32_t chunks_num;
+    uint32_t max_chunks_num;
+    char *chunk_cur;  // unused part of the last chunk
+    char *chunk_end;
+    void *free_lists[MSLABCLASSES];
+    uint64_t used_size;  // bytes of the live blocks, rounded up to their size class
+    uint64_t chunks_size;
+    bool freeing;  // the owner frees everything, Release only frees the malloc-ed blocks
+
+    // Epoch based reclamation for lookups during updates, one writer.
+    // When deferred, Release and ReleaseMalloc only retire the block, Reclaim at the end of every update
+    // gives back the blocks retired before the oldest epoch a reader is in.
+    bool deferred;
+    uint64_t epoch;
+    MRetired *retired;
+    uint32_t retired_num;
+    uint32_t max_retired_num;
+    uint64_t gen;  // NewGen, tells the blocks of the current update from the published ones
+    MReaderEpoch *reader_epochs;  // MSLABREADERS, when deferred
+
+    static int SizeClass(uint32_t size) {
+        if (size <= 128)
+            return size == 0 ? 0 : (size - 1) / 16;
+        int p = 31 - __builtin_clz(size - 1);
+        return 8 + (p - 7) * 4 + ((size - 1 - (1U << p)) >> (p - 2));
+    }
+    static uint32_t ClassSize(int size_class) {
+        if (size_class < 8)
+            return (size_class + 1) * 16;
+        int p = 7 + (size_class - 8) / 4;
+        return (1U << p) + ((size_class - 8) % 4 + 1) * (1U << (p - 2));
+    }
+    // bytes used_size counts for a block of size
+    static uint32_t BlockSize(uint32_t size) {
+        return size > MSLABMAXSIZE ? size : ClassSize(SizeClass(size));
+    }
+
+    int Init();
+    void NewChunk();
+    void* Alloc(uint32_t size);
+    void Release(void *ptr, uint32_t size);
+    void ReleaseMalloc(void *ptr);
+    void Defer();
+    void Retire(void *ptr, uint32_t size);
+    void Give(void *ptr, uint32_t size);
+    void Reclaim();
+    void ReadEnter();
+    void ReadExit();
+    // 0 when not deferred : no lookup runs during an update, every block may be written in place
+    uint64_t NewGen() {
+        return deferred ? ++gen : 0;
+    }
+    uint64_t MemorySize() {
+        return used_size;
+    }
+    int Free();
+};
+
+#endif
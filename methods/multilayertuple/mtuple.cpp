@@ -3,32 +3,34 @@
 using namespace std;
 
 extern int max_prefix_len[5];
-extern int prefix_dims_num;
 
-MTuple::MTuple(uint32_t _tuple_layer, uint32_t *_prefix_len) {
+template<int DIMS>
+MTuple<DIMS>::MTuple(uint32_t _tuple_layer, uint32_t *_prefix_len, MSlab *slab, MMigration<DIMS> *migration, MultilayerTuple<DIMS> *multilayertuple) {
 	tuple_layer = _tuple_layer;
-	for (int i = 0; i < prefix_dims_num; ++i) {
+	for (int i = 0; i < DIMS; ++i) {
 		prefix_len[i] = _prefix_len[i];
 		prefix_len_zero[i] = max_prefix_len[i] - prefix_len[i];
 	}
-	hash_table.Init(32, tuple_layer);
+	hash_table.Init(32, tuple_layer, slab, migration, multilayertuple);
 	max_priority = 0;
 	rules_num = 0;
 
-	// printf("new MTuple: dims %d , ", prefix_dims_num);
-	// for (int i = 0; i < prefix_dims_num; ++i)
+	// printf("new MTuple: dims %d , ", DIMS);
+	// for (int i = 0; i < DIMS; ++i)
 	// 	printf("%d ", prefix_len[i]);
 	// printf("\n");
 }
 
-int MTuple::InsertRule(Rule *rule) {
-	uint32_t keys[5];
-	for (int i = 0; i < prefix_dims_num; ++i)
-		keys[i] = (uint64_t)rule->range[i][0] >> prefix_len_zero[i];
-	uint32_t hash = HashKeys(keys, prefix_dims_num);
+template<int DIMS>
+int MTuple<DIMS>::InsertRule(Rule *rule) {
+	uint32_t fields[DIMS];
+	for (int i = 0; i < DIMS; ++i)
+		fields[i] = rule->range[i][0];
+	uint32_t hash;
+	Key key = GetKey<DIMS>(fields, prefix_len_zero, hash, hash_table.multilayertuple->hash_type);
 	// printf("hash %08x\n", hash);
 
-	if (hash_table.InsertRule(rule, keys, hash) > 0)
+	if (hash_table.InsertRule(rule, key, hash) > 0)
         return 1;
     ++rules_num;
     max_priority = hash_table.max_priority;
@@ -36,42 +38,68 @@ int MTuple::InsertRule(Rule *rule) {
 	return 0;
 }
 
-int MTuple::DeleteRule(Rule *rule) {
-	uint32_t keys[5];
-	for (int i = 0; i < prefix_dims_num; ++i)
-		keys[i] = (uint64_t)rule->range[i][0] >> prefix_len_zero[i];
-	uint32_t hash = HashKeys(keys, prefix_dims_num);
+template<int DIMS>
+int MTuple<DIMS>::DeleteRule(Rule *rule) {
+	uint32_t fields[DIMS];
+	for (int i = 0; i < DIMS; ++i)
+		fields[i] = rule->range[i][0];
+	uint32_t hash;
+	Key key = GetKey<DIMS>(fields, prefix_len_zero, hash, hash_table.multilayertuple->hash_type);
 
-	if (hash_table.DeleteRule(rule, keys, hash) > 0)
+	if (hash_table.DeleteRule(rule, key, hash) > 0)
         return 1;
     --rules_num;
     max_priority = hash_table.max_priority;
 	return 0;
 }
 
-uint64_t MTuple::MemorySize() {
-    uint64_t memory_size = sizeof(MTuple);
-    memory_size += hash_table.MemorySize() - sizeof(MHashTable);
-    return memory_size;
+template<int DIMS>
+int MTuple<DIMS>::BulkLoad(vector<Rule*> &rules) {
+	int n = rules.size();
+	vector<Key> keys(n);
+	vector<uint32_t> hashes(n);
+	uint32_t fields[DIMS];
+	for (int i = 0; i < n; ++i) {
+		for (int j = 0; j < DIMS; ++j)
+			fields[j] = rules[i]->range[j][0];
+		keys[i] = GetKey<DIMS>(fields, prefix_len_zero, hashes[i], hash_table.multilayertuple->hash_type);
+	}
+	if (hash_table.BulkLoad(&rules[0], &keys[0], &hashes[0], n) > 0)
+		return 1;
+	rules_num = n;
+	max_priority = hash_table.max_priority;
+	return 0;
+}
+
+template<int DIMS>
+uint64_t MTuple<DIMS>::MemorySize() {
+    return hash_table.MemorySize() - sizeof(MHashTable<DIMS>);
 }
 
-int MTuple::CalculateState(ProgramState *program_state) {
+template<int DIMS>
+int MTuple<DIMS>::CalculateState(ProgramState *program_state) {
 	hash_table.CalculateState(program_state);
 	return 0;
 }
 
-int MTuple::GetRules(vector<Rule*> &rules) {
+template<int DIMS>
+int MTuple<DIMS>::GetRules(vector<Rule*> &rules) {
     hash_table.GetRules(rules);
 	return 0;
 }
 
-int MTuple::Free(bool free_self) {
+template<int DIMS>
+int MTuple<DIMS>::Free(bool free_self) {
     hash_table.Free(false);
     if (free_self)
-        free(this);
+        hash_table.slab->Release(this, sizeof(MTuple<DIMS>));
 	return 0;
 }
 
-int MTuple::Test(void *ptr) {
+template<int DIMS>
+int MTuple<DIMS>::Test(void *ptr) {
 	return 0;
-}
\ No newline at end of file
+}
+
+template struct MTuple<2>;
+template struct MTuple<5>;
@@ -4,64 +4,165 @@
 using namespace std;
 
 // To implement MultilayerTuple in other scene, please revise these parameters.
-int prefix_dims_num;  // to be 2 or 5
 int max_prefix_len[5] = {32, 32, 16, 16, 8};
 int prefix_bits[5] = {6, 6, 5, 5, 4};
 int max_layers_num = 6;  // the max_prelix_len 32 = 2^5 + 1
 uint32_t create_next_layer_rules_num = 20000;
-uint32_t delete_next_layer_rules_num = create_next_layer_rules_num / 2;
+uint32_t migrate_rules_num = 64;  // MMigration::rules_num of the start tuple layers
 int x1 = 31;
 int y1 = 15;
 int x2 = 33;
 int y2 = 33;
+bool tuple_pruning = false;
+bool concurrent_lookup = false;
 DimsRanges dims_ranges;
 DimsRanges dims_ranges_null;
 int reduce_prefix_type = MULTILATERTUPLE_TYPE; // 1 MultilayerTuple, 2 DynamicTuple, 3 step
 
-int MultilayerTuple::Init(uint32_t _tuple_layer, bool _start_tuple_layer) {
+void SetDefaultRegion(int _x1, int _y1, int _x2, int _y2) {
+    if (_x1 >= 0)
+        x1 = _x1;
+    if (_y1 >= 0)
+        y1 = _y1;
+    if (_x2 >= 0)
+        x2 = _x2;
+    if (_y2 >= 0)
+        y2 = _y2;
+}
+
+template<int DIMS>
+int MultilayerTuple<DIMS>::Init(uint32_t _tuple_layer, bool _start_tuple_layer, MultilayerTuple<DIMS> *parent) {
     tuple_layer = _tuple_layer;
     start_tuple_layer = _start_tuple_layer;
+    slab = NULL;
+    migration = NULL;
+    if (parent) {
+        x1 = parent->x1;
+        y1 = parent->y1;
+        x2 = parent->x2;
+        y2 = parent->y2;
+        hash_type = parent->hash_type;
+    } else {
+        x1 = ::x1;
+        y1 = ::y1;
+        x2 = ::x2;
+        y2 = ::y2;
+        hash_type = ::hash_type;
+    }
+    concurrent_lookup = ::concurrent_lookup;
+    // the tries are updated in place
+    tuple_pruning = ::tuple_pruning && !concurrent_lookup;
 	return 0;
 }
 
-int MultilayerTuple::Create(vector<Rule*> &rules, bool insert,) {
+// the next layers created later take the region of this layer
+template<int DIMS>
+void MultilayerTuple<DIMS>::SetRegion(int _x1, int _y1, int _x2, int _y2) {
+    x1 = _x1;
+    y1 = _y1;
+    x2 = _x2;
+    y2 = _y2;
+}
+
+template<int DIMS>
+int MultilayerTuple<DIMS>::Create(vector<Rule*> &rules, bool insert) {
 
     if (reduce_prefix_type == DYNAMICTUPLEDIMS_TYPE) {
-        dims_ranges = DynamicDimsRanges(rules, prefix_dims_num, cal_time, dims_ranges_null);
+        dims_ranges = DynamicDimsRanges(rules, DIMS, cal_time, dims_ranges_null);
     }
-    pthread_mutex_init(&lookup_mutex, NULL);
-    pthread_mutex_init(&update_mutex, NULL);
 
-    if (tuple_layer == 0 || prefix_dims_num == 0) {
+    if (tuple_layer == 0) {
     	printf("Wrong : MultilayerTuple tuple_layer %d prefix_dims_num %d\n", 
-                tuple_layer, prefix_dims_num);
+                tuple_layer, DIMS);
     	exit(1);
     }
 
+    if (start_tuple_layer) {
+        slab = (MSlab*)malloc(sizeof(MSlab));
+        slab->Init();
+        if (concurrent_lookup)
+            slab->Defer();
+        migration = (MMigration<DIMS>*)malloc(sizeof(MMigration<DIMS>));
+        migration->Init();
+    }
     tuples_num = 0;
     max_tuples_num = 16;
-    tuples_arr = (MTuple**)malloc(sizeof(MTuple*) * max_tuples_num);
+    tuples_arr = (MTuple<DIMS>**)malloc(sizeof(MTuple<DIMS>*) * max_tuples_num);
     for (int i = 0; i < max_tuples_num; ++i)
         tuples_arr[i] = NULL;
-    tuples_map.clear();
+    tuples_map.Init(16);
+    tuple_list = NULL;
+    PublishTuples();
+    used_tuple_ids = 0;
+    if (tuple_pruning) {
+        src_ip_trie.Init();
+        dst_ip_trie.Init();
+    }
 
     rules_num = 0;
     max_priority = 0;
 
-    // printf("Create end. tuple_layer %d prefix_dims_num %d\n", tuple_layer, prefix_dims_num);
+    // printf("Create end. tuple_layer %d prefix_dims_num %d\n", tuple_layer, DIMS);
 
-    if (insert) {
-        int rules_num = rules.size();
-        for (int i = 0; i < rules_num; ++i)
-            InsertRule(rules[i]);
-    }
+    if (insert)
+        BulkLoad(rules);
 
 	return 0;
 }
 
-void MultilayerTuple::InsertTuple(MTuple *tuple) {
+// Same result as InsertRule one by one: group the rules into tuples, sort by priority once,
+// then every hash table is sized once and every hash node is built from its final rules.
+template<int DIMS>
+int MultilayerTuple<DIMS>::BulkLoad(vector<Rule*> &rules) {
+    int n = rules.size();
+    // tuples are created in rules order so tuple_id matches the incremental path
+    vector<MTuple<DIMS>*> rule_tuples(n);
+    uint32_t prefix_len[5];
+    for (int i = 0; i < n; ++i) {
+        uint32_t prefix_pair = GetReducedPrefix(prefix_len, rules[i]);
+        MTuple<DIMS> *tuple = tuples_map.Find(prefix_pair);
+        if (!tuple) {
+            tuple = new (slab->Alloc(sizeof(MTuple<DIMS>))) MTuple<DIMS>(tuple_layer, prefix_len, slab, migration, this);
+            tuple->tuple_id = ~used_tuple_ids ? __builtin_ctzll(~used_tuple_ids) : MAXPRUNETUPLES;
+            if (tuple->tuple_id < MAXPRUNETUPLES)
+                used_tuple_ids |= 1ULL << tuple->tuple_id;
+            InsertTuple(tuple);
+            tuples_map.Insert(prefix_pair, tuple);
+        }
+        rule_tuples[i] = tuple;
+        if (tuple_pruning) {
+            src_ip_trie.InsertRule(rules[i]->range[0][0], rules[i]->prefix_len[0], tuple->tuple_id);
+            dst_ip_trie.InsertRule(rules[i]->range[1][0], rules[i]->prefix_len[1], tuple->tuple_id);
+        }
+    }
+
+    // (-priority, index) sorts by priority from high to low, rules order inside the same priority
+    vector<pair<int, int> > order(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = make_pair(-rules[i]->priority, i);
+    sort(order.begin(), order.end());
+    vector<vector<Rule*> > tuple_rules(tuples_num);
+    for (int i = 0; i < n; ++i)
+        tuple_rules[rule_tuples[order[i].second]->index].push_back(rules[order[i].second]);
+    for (int i = 0; i < tuples_num; ++i) {
+        if (tuple_rules[i].empty())
+            continue;
+        if (tuples_arr[i]->BulkLoad(tuple_rules[i]) > 0)
+            return 1;
+        max_priority = max(max_priority, tuples_arr[i]->max_priority);
+    }
+    rules_num += n;
+    SortTuples();
+    PublishTuples();
+    if (start_tuple_layer)
+        slab->Reclaim();
+    return 0;
+}
+
+template<int DIMS>
+void MultilayerTuple<DIMS>::InsertTuple(MTuple<DIMS> *tuple) {
     if (tuples_num == max_tuples_num) {
-		MTuple **new_tuples_arr = (MTuple**)malloc(sizeof(MTuple*) * max_tuples_num * 2);
+		MTuple<DIMS> **new_tuples_arr = (MTuple<DIMS>**)malloc(sizeof(MTuple<DIMS>*) * max_tuples_num * 2);
 		for (int i = 0; i < max_tuples_num; ++i)
 			new_tuples_arr[i] = tuples_arr[i];
         for (int i = max_tuples_num; i < max_tuples_num * 2; ++i)
@@ -70,20 +171,60 @@ void MultilayerTuple::InsertTuple(MTuple *tuple) {
         free(tuples_arr);
         tuples_arr = new_tuples_arr;
     }
+    tuple->index = tuples_num;
 	tuples_arr[tuples_num++] = tuple;
 }
 
-bool CmpMTuple(MTuple *tuple1, MTuple *tuple2) {
+template<int DIMS>
+bool CmpMTuple(MTuple<DIMS> *tuple1, MTuple<DIMS> *tuple2) {
 	return tuple1->max_priority > tuple2->max_priority;
 }
 
-void MultilayerTuple::SortTuples() {
-    sort(tuples_arr, tuples_arr + tuples_num, CmpMTuple);
+template<int DIMS>
+void MultilayerTuple<DIMS>::SortTuples() {
+    sort(tuples_arr, tuples_arr + tuples_num, CmpMTuple<DIMS>);
+    for (int i = 0; i < tuples_num; ++i)
+        tuples_arr[i]->index = i;
+}
+
+// tuple->max_priority has changed, move it to its place in tuples_arr
+template<int DIMS>
+void MultilayerTuple<DIMS>::MoveTuple(MTuple<DIMS> *tuple) {
+    int i = tuple->index;
+    while (i > 0 && tuples_arr[i - 1]->max_priority < tuple->max_priority) {
+        tuples_arr[i] = tuples_arr[i - 1];
+        tuples_arr[i]->index = i;
+        --i;
+    }
+    while (i + 1 < tuples_num && tuples_arr[i + 1]->max_priority > tuple->max_priority) {
+        tuples_arr[i] = tuples_arr[i + 1];
+        tuples_arr[i]->index = i;
+        ++i;
+    }
+    tuples_arr[i] = tuple;
+    tuple->index = i;
 }
 
-uint32_t MultilayerTuple::GetReducedPrefix(uint32_t *prefix_len, Rule *rule) {
+template<int DIMS>
+void MultilayerTuple<DIMS>::PublishTuples() {
+    MTupleList<DIMS> *origin_list = tuple_list;
+    MTupleList<DIMS> *list = (MTupleList<DIMS>*)slab->Alloc(MTupleList<DIMS>::Size(tuples_num));
+    list->tuples_num = tuples_num;
+    list->reserved = 0;
+    MTupleEntry<DIMS> *entries = list->Entries();
+    for (int i = 0; i < tuples_num; ++i) {
+        entries[i].tuple = tuples_arr[i];
+        entries[i].max_priority = tuples_arr[i]->max_priority;
+    }
+    __atomic_store_n(&tuple_list, list, __ATOMIC_RELEASE);
+    if (origin_list)
+        slab->Release(origin_list, MTupleList<DIMS>::Size(origin_list->tuples_num));
+}
+
+template<int DIMS>
+uint32_t MultilayerTuple<DIMS>::GetReducedPrefix(uint32_t *prefix_len, Rule *rule) {
     uint32_t prefix_pair = 0;
-        for (int i = 0; i < prefix_dims_num; ++i) {
+        for (int i = 0; i < DIMS; ++i) {
             int step = max(1, max_prefix_len[i] >> tuple_layer);
             prefix_len[i] = rule->prefix_len[i] - rule->prefix_len[i] % step;
             prefix_pair = prefix_pair << 6 | prefix_len[i];
@@ -124,56 +265,81 @@ uint32_t MultilayerTuple::GetReducedPrefix(uint32_t *prefix_len, Rule *rule) {
         prefix_pair = t3 << 6 | t4;
         prefix_len[0] = t3;
         prefix_len[1] = t4;}
+        // the port and protocol dims keep their own reduced prefix_len
+        for (int i = 2; i < DIMS; ++i)
+            prefix_pair = prefix_pair << 6 | prefix_len[i];
 
     return prefix_pair;
 }
 
-int MultilayerTuple::InsertRule(Rule *rule) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::InsertRule(Rule *rule) {
+    if (start_tuple_layer)
+        migration->budget = migration->rules_num;
 	uint32_t prefix_len[5];
 	uint32_t prefix_pair = GetReducedPrefix(prefix_len, rule);
-	map<uint32_t, MTuple*>::iterator iter = tuples_map.find(prefix_pair);
-    MTuple *tuple = NULL;
-    if (iter != tuples_map.end()) {
-        tuple = iter->second;
-    } else {
-        tuple = new MTuple(tuple_layer, prefix_len);
+    MTuple<DIMS> *tuple = tuples_map.Find(prefix_pair);
+    bool new_tuple = !tuple;
+    if (!tuple) {
+        tuple = new (slab->Alloc(sizeof(MTuple<DIMS>))) MTuple<DIMS>(tuple_layer, prefix_len, slab, migration, this);
+        tuple->tuple_id = ~used_tuple_ids ? __builtin_ctzll(~used_tuple_ids) : MAXPRUNETUPLES;
+        if (tuple->tuple_id < MAXPRUNETUPLES)
+            used_tuple_ids |= 1ULL << tuple->tuple_id;
         InsertTuple(tuple);
-        tuples_map[prefix_pair] = tuple;
+        tuples_map.Insert(prefix_pair, tuple);
     }
     if (tuple->InsertRule(rule) > 0)
         return 1;
+    if (tuple_pruning) {
+        src_ip_trie.InsertRule(rule->range[0][0], rule->prefix_len[0], tuple->tuple_id);
+        dst_ip_trie.InsertRule(rule->range[1][0], rule->prefix_len[1], tuple->tuple_id);
+    }
     
     ++rules_num;
     if (rule->priority == tuple->max_priority)
-        SortTuples();
+        MoveTuple(tuple);
+    if (new_tuple || rule->priority == tuple->max_priority)
+        PublishTuples();
     max_priority = max(max_priority, rule->priority);
+    if (start_tuple_layer) {
+        migration->Drain();
+        slab->Reclaim();
+    }
     return 0;
 }
 
-int MultilayerTuple::DeleteRule(Rule *rule) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::DeleteRule(Rule *rule) {
+    if (start_tuple_layer)
+        migration->budget = migration->rules_num;
     uint32_t prefix_len[5];
     uint32_t prefix_pair = GetReducedPrefix(prefix_len, rule);
-    map<uint32_t, MTuple*>::iterator iter = tuples_map.find(prefix_pair);
-    MTuple *tuple = NULL;
-    if (iter != tuples_map.end()) {
-        tuple = iter->second;
-    } else {
+    MTuple<DIMS> *tuple = tuples_map.Find(prefix_pair);
+    if (!tuple) {
         printf("Wrong: DeleteRule has no tuple\n");
         return 1;
     }
 
     if (tuple->DeleteRule(rule) > 0)
         return 1;
+    if (tuple_pruning) {
+        src_ip_trie.DeleteRule(rule->range[0][0], rule->prefix_len[0], tuple->tuple_id);
+        dst_ip_trie.DeleteRule(rule->range[1][0], rule->prefix_len[1], tuple->tuple_id);
+    }
 
     if (tuple->rules_num == 0) {
         //printf("delete tuple\n");
         tuple->max_priority = 0;
-        SortTuples();
+        MoveTuple(tuple);
         tuples_arr[--tuples_num] = NULL;
-        tuples_map.erase(prefix_pair);
+        tuples_map.Erase(prefix_pair);
+        if (tuple->tuple_id < MAXPRUNETUPLES)
+            used_tuple_ids &= ~(1ULL << tuple->tuple_id);
+        PublishTuples();
         tuple->Free(true);
     } else if (rule->priority >= tuple->max_priority) {
-        SortTuples();
+        MoveTuple(tuple);
+        PublishTuples();
     }
 
     --rules_num;
@@ -181,98 +347,234 @@ int MultilayerTuple::DeleteRule(Rule *rule) {
         max_priority = 0;
     else
         max_priority = tuples_arr[0]->max_priority;
+    if (start_tuple_layer) {
+        migration->Drain();
+        slab->Reclaim();
+    }
 
 	return 0;
 }
 
-int MultilayerTuple::Lookup(Trace *trace, int priority) {
-    uint32_t keys[5];
-    for (int i = 0; i < tuples_num; ++i) {
-        MTuple *tuple = tuples_arr[i];
-        if (priority >= tuple->max_priority)
-            break;
-        for (int i = 0; i < prefix_dims_num; ++i)
-            keys[i] = (uint64_t)trace->key[i] >> tuple->prefix_len_zero[i];
-        uint32_t hash = HashKeys(keys, prefix_dims_num);
+// the hash node with keys whose max_priority > priority, NULL if none
+template<int DIMS>
+static inline MHashNode<DIMS>* FindHashNode(MHashView<DIMS> *view, typename MKeyTraits<DIMS>::Key key, uint32_t hash, int priority) {
+    uint16_t fingerprint = HashFingerprint(hash);
+    uint32_t index = hash & view->mask;
+    while (true) {
+        MHashBucket *bucket = &view->buckets[index];
+        uint32_t slots = bucket->MatchSlots(fingerprint, priority);
+        while (slots) {
+            // NULL if the writer has just emptied the slot
+            MHashNode<DIMS> *hash_node = __atomic_load_n(&view->hash_node_arr[index * MHASHBUCKETSLOTS + __builtin_ctz(slots)], __ATOMIC_ACQUIRE);
+            if (hash_node && hash_node->SameKey(key))
+                return hash_node;
+            slots &= slots - 1;
+        }
+        if (priority >= bucket->overflow_max_priority)
+            return NULL;
+        index = (index + 1) & view->mask;
+    }
+    return NULL;
+}
 
-        MHashNode *hash_node = tuple->hash_table.hash_node_arr[hash & tuple->hash_table.mask];
-        while (hash_node) {
-            if (priority >= hash_node->max_priority)
-                break;
-            if (hash_node->SameKey(keys)) {
-                if (hash_node->has_next_multilayertuple) {
-                    priority = hash_node->next_multilayertuple->Lookup(trace, priority);
-                } else {
-                    MRuleNode *rule_node = hash_node->rule_node;
-                    while (rule_node) {
-                        if (priority >= rule_node->priority)
-                            break;
-                        if (rule_node->src_ip_begin <= trace->key[0] && trace->key[0] <= rule_node->src_ip_end &&
-                            rule_node->dst_ip_begin <= trace->key[1] && trace->key[1] <= rule_node->dst_ip_end &&
-                            rule_node->src_port_begin <= trace->key[2] && trace->key[2] <= rule_node->src_port_end &&
-                            rule_node->dst_port_begin <= trace->key[3] && trace->key[3] <= rule_node->dst_port_end &&
-                            rule_node->protocol_begin <= trace->key[4] && trace->key[4] <= rule_node->protocol_end) {
-                            priority = rule_node->priority;
-                            break;
-                        }
-                        rule_node = rule_node->next;  
-                    };
-                }
-                break;
-            }
-            hash_node = hash_node->next;
+template<int DIMS>
+int MultilayerTuple<DIMS>::Lookup(Trace *trace, int priority) {
+    switch (hash_type) {
+    case HASH_CRC32C:
+        return LookupHash<HASH_CRC32C>(trace, priority);
+    case HASH_XORSHIFT:
+        return LookupHash<HASH_XORSHIFT>(trace, priority);
+    case HASH_TABULATION:
+        return LookupHash<HASH_TABULATION>(trace, priority);
+    }
+    return LookupHash<HASH_MULT>(trace, priority);
+}
+
+template<int DIMS>
+template<int HASH>
+int MultilayerTuple<DIMS>::LookupHash(Trace *trace, int priority) {
+    bool reader = start_tuple_layer && concurrent_lookup;
+    if (reader)
+        slab->ReadEnter();
+    uint64_t tuples_mask = ~0ULL;
+    if (tuple_pruning)
+        tuples_mask = src_ip_trie.Lookup(trace->key[0]) & dst_ip_trie.Lookup(trace->key[1]);
+    MTupleList<DIMS> *list = __atomic_load_n(&tuple_list, __ATOMIC_ACQUIRE);
+    MTupleEntry<DIMS> *entries = list->Entries();
+    for (int i = 0; i < list->tuples_num; ++i) {
+        if (priority >= entries[i].max_priority)
+            break;
+        MTuple<DIMS> *tuple = entries[i].tuple;
+        if (tuple->tuple_id < MAXPRUNETUPLES && !(tuples_mask >> tuple->tuple_id & 1))
+            continue;
+        uint32_t hash;
+        Key key = GetKey<DIMS, HASH>(trace->key, tuple->prefix_len_zero, hash);
+
+        MHashNode<DIMS> *hash_node = FindHashNode(tuple->hash_table.View(), key, hash, priority);
+        if (hash_node) {
+            int scan_num = 0;
+            priority = hash_node->Match(trace, priority, scan_num);
         }
     }
+    if (reader)
+        slab->ReadExit();
     // printf("lookup layer %d priority %d\n", tuple_layer, priority);
 	return priority;
 }
 
-int MultilayerTuple::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) { 
+template<int DIMS>
+int MultilayerTuple<DIMS>::LookupBatch(Trace **traces, int n, int *out) {
+    bool reader = start_tuple_layer && concurrent_lookup;
+    if (reader)
+        slab->ReadEnter();
+    for (int start = 0; start < n; start += MTUPLEBATCHSIZE)
+        LookupGroup(traces + start, min(n - start, MTUPLEBATCHSIZE), out + start);
+    if (reader)
+        slab->ReadExit();
+    return 0;
+}
+
+// Group prefetching: every tuple is probed for all packets of the group in stages,
+// each stage prefetches what the next stage reads for the other packets.
+template<int DIMS>
+int MultilayerTuple<DIMS>::LookupGroup(Trace **traces, int n, int *out) {
+    switch (hash_type) {
+    case HASH_CRC32C:
+        return LookupGroupHash<HASH_CRC32C>(traces, n, out);
+    case HASH_XORSHIFT:
+        return LookupGroupHash<HASH_XORSHIFT>(traces, n, out);
+    case HASH_TABULATION:
+        return LookupGroupHash<HASH_TABULATION>(traces, n, out);
+    }
+    return LookupGroupHash<HASH_MULT>(traces, n, out);
+}
+
+template<int DIMS>
+template<int HASH>
+int MultilayerTuple<DIMS>::LookupGroupHash(Trace **traces, int n, int *out) {
+    Key keys[MTUPLEBATCHSIZE];
+    uint32_t hash[MTUPLEBATCHSIZE];
+    MHashNode<DIMS> *hash_nodes[MTUPLEBATCHSIZE];
+    int active[MTUPLEBATCHSIZE];
+    uint64_t tuples_mask[MTUPLEBATCHSIZE];
+    for (int j = 0; j < n; ++j) {
+        out[j] = 0;
+        tuples_mask[j] = ~0ULL;
+        if (tuple_pruning)
+            tuples_mask[j] = src_ip_trie.Lookup(traces[j]->key[0]) & dst_ip_trie.Lookup(traces[j]->key[1]);
+    }
+
+    MTupleList<DIMS> *list = __atomic_load_n(&tuple_list, __ATOMIC_ACQUIRE);
+    MTupleEntry<DIMS> *entries = list->Entries();
+    for (int i = 0; i < list->tuples_num; ++i) {
+        MTuple<DIMS> *tuple = entries[i].tuple;
+        int tuple_max_priority = entries[i].max_priority;
+        MHashView<DIMS> *view = tuple->hash_table.View();
+        // stage 1 : hash, prefetch the bucket and its hash node pointers
+        int active_num = 0;
+        bool tuple_useful = false;
+        for (int j = 0; j < n; ++j) {
+            if (out[j] >= tuple_max_priority)
+                continue;
+            tuple_useful = true;
+            if (tuple->tuple_id < MAXPRUNETUPLES && !(tuples_mask[j] >> tuple->tuple_id & 1))
+                continue;
+            active[active_num++] = j;
+            keys[j] = GetKey<DIMS, HASH>(traces[j]->key, tuple->prefix_len_zero, hash[j]);
+            uint32_t index = hash[j] & view->mask;
+            _mm_prefetch((const char*)&view->buckets[index], _MM_HINT_T0);
+            _mm_prefetch((const char*)&view->hash_node_arr[index * MHASHBUCKETSLOTS], _MM_HINT_T0);
+        }
+        // tuples are sorted by max_priority, the later tuples can not help either
+        if (!tuple_useful)
+            break;
+        // stage 2 : fingerprint match in the bucket, prefetch the candidate hash node
+        for (int k = 0; k < active_num; ++k) {
+            int j = active[k];
+            uint32_t index = hash[j] & view->mask;
+            uint32_t slots = view->buckets[index].MatchSlots(HashFingerprint(hash[j]), out[j]);
+            if (slots)
+                _mm_prefetch((const char*)view->hash_node_arr[index * MHASHBUCKETSLOTS + __builtin_ctz(slots)], _MM_HINT_T0);
+        }
+        // stage 3 : compare keys, prefetch the rules of the hash node
+        for (int k = 0; k < active_num; ++k) {
+            int j = active[k];
+            MHashNode<DIMS> *hash_node = FindHashNode(view, keys[j], hash[j], out[j]);
+            hash_nodes[j] = hash_node;
+            if (hash_node && !hash_node->has_next_multilayertuple) {
+                _mm_prefetch((const char*)hash_node->rule_blocks.first_block.Priority(), _MM_HINT_T0);
+                _mm_prefetch((const char*)hash_node->rule_blocks.first_block.SrcIpBegin(), _MM_HINT_T0);
+                _mm_prefetch((const char*)hash_node->rule_blocks.first_block.SrcIpEnd(), _MM_HINT_T0);
+                _mm_prefetch((const char*)hash_node->rule_blocks.first_block.DstIpBegin(), _MM_HINT_T0);
+                _mm_prefetch((const char*)hash_node->rule_blocks.first_block.DstIpEnd(), _MM_HINT_T0);
+            }
+        }
+        // stage 4 : match rules
+        for (int k = 0; k < active_num; ++k) {
+            int j = active[k];
+            MHashNode<DIMS> *hash_node = hash_nodes[j];
+            if (!hash_node)
+                continue;
+            int scan_num = 0;
+            out[j] = hash_node->Match(traces[j], out[j], scan_num);
+        }
+    }
+    return 0;
+}
+
+template<int DIMS>
+int MultilayerTuple<DIMS>::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) { 
     if (start_tuple_layer) {
         program_state->access_tuples.ClearNum();
         program_state->access_tables.ClearNum();
         program_state->access_nodes.ClearNum();
         program_state->access_rules.ClearNum();
     }
-    uint32_t keys[5];
-    for (int i = 0; i < tuples_num; ++i) {
-        MTuple *tuple = tuples_arr[i];
-        if (priority >= tuple->max_priority)
+    uint64_t tuples_mask = ~0ULL;
+    if (tuple_pruning)
+        tuples_mask = src_ip_trie.Lookup(trace->key[0]) & dst_ip_trie.Lookup(trace->key[1]);
+    MTupleList<DIMS> *list = __atomic_load_n(&tuple_list, __ATOMIC_ACQUIRE);
+    MTupleEntry<DIMS> *entries = list->Entries();
+    for (int i = 0; i < list->tuples_num; ++i) {
+        MTuple<DIMS> *tuple = entries[i].tuple;
+        if (priority >= entries[i].max_priority)
             break;
+        if (tuple->tuple_id < MAXPRUNETUPLES && !(tuples_mask >> tuple->tuple_id & 1)) {
+            ++program_state->pruned_tuples;
+            continue;
+        }
         program_state->access_tuples.AddNum();
         program_state->access_tables.AddNum();
-        for (int i = 0; i < prefix_dims_num; ++i)
-            keys[i] = (uint64_t)trace->key[i] >> tuple->prefix_len_zero[i];
-        uint32_t hash = HashKeys(keys, prefix_dims_num);
-
-        MHashNode *hash_node = tuple->hash_table.hash_node_arr[hash & tuple->hash_table.mask];
-        while (hash_node) {
-            if (priority >= hash_node->max_priority)
-                break;
-            program_state->access_nodes.AddNum();
-            if (hash_node->SameKey(keys)) {
-                if (hash_node->has_next_multilayertuple) {
-                    priority = hash_node->next_multilayertuple->LookupAccess(trace, priority, ans_rule, program_state);
-                } else {
-                    MRuleNode *rule_node = hash_node->rule_node;
-                    while (rule_node) {
-                        if (priority >= rule_node->priority)
-                            break;
-                        program_state->access_rules.AddNum();
-                        if (rule_node->src_ip_begin <= trace->key[0] && trace->key[0] <= rule_node->src_ip_end &&
-                            rule_node->dst_ip_begin <= trace->key[1] && trace->key[1] <= rule_node->dst_ip_end &&
-                            rule_node->src_port_begin <= trace->key[2] && trace->key[2] <= rule_node->src_port_end &&
-                            rule_node->dst_port_begin <= trace->key[3] && trace->key[3] <= rule_node->dst_port_end &&
-                            rule_node->protocol_begin <= trace->key[4] && trace->key[4] <= rule_node->protocol_end) {
-                            priority = rule_node->priority;
-                            break;
-                        }
-                        rule_node = rule_node->next;  
-                    };
+        uint32_t hash;
+        Key key = GetKey<DIMS>(trace->key, tuple->prefix_len_zero, hash, hash_type);
+
+        MHashView<DIMS> *view = tuple->hash_table.View();
+        uint16_t fingerprint = HashFingerprint(hash);
+        uint32_t index = hash & view->mask;
+        MHashNode<DIMS> *hash_node = NULL;
+        while (true) {
+            MHashBucket *bucket = &view->buckets[index];
+            uint32_t slots = bucket->MatchSlots(fingerprint, priority);
+            while (slots) {
+                MHashNode<DIMS> *slot_node = view->hash_node_arr[index * MHASHBUCKETSLOTS + __builtin_ctz(slots)];
+                program_state->access_nodes.AddNum();
+                if (slot_node->SameKey(key)) {
+                    hash_node = slot_node;
+                    break;
                 }
-                break;
+                ++program_state->fingerprint_collisions;
+                slots &= slots - 1;
             }
-            hash_node = hash_node->next;
+            if (hash_node || priority >= bucket->overflow_max_priority)
+                break;
+            index = (index + 1) & view->mask;
+        }
+        if (hash_node) {
+            if (hash_node->has_next_multilayertuple)
+                priority = hash_node->next_multilayertuple->LookupAccess(trace, priority, ans_rule, program_state);
+            int scan_num = 0;
+            priority = hash_node->rule_blocks.Match(trace, priority, scan_num);
+            program_state->access_rules.num += scan_num;
         }
     }
     // printf("lookup layer %d priority %d\n", tuple_layer, priority);
@@ -282,14 +584,30 @@ int MultilayerTuple::LookupAccess(Trace *trace, int priority, Rule *ans_rule, Pr
     return priority;
 }
 
-int MultilayerTuple::Reconstruct() {
+// finishes the migrations in progress
+template<int DIMS>
+int MultilayerTuple<DIMS>::Reconstruct() {
+    if (!start_tuple_layer)
+        return 0;
+    migration->budget = UINT32_MAX;
+    migration->Drain();
+    migration->budget = 0;
+    slab->Reclaim();
 	return 0;
 }
 
-uint64_t MultilayerTuple::MemorySize() {
-    uint64_t memory_size = sizeof(MultilayerTuple);
-    memory_size += sizeof(MTuple*) * max_tuples_num;
-    memory_size += 64 * tuples_num; // map
+template<int DIMS>
+uint64_t MultilayerTuple<DIMS>::MemorySize() {
+    // the next layers themselves are in the slab
+    uint64_t memory_size = 0;
+    if (start_tuple_layer)
+        memory_size += sizeof(MultilayerTuple<DIMS>) + sizeof(MSlab) + sizeof(MMigration<DIMS>) + migration->MemorySize() + slab->MemorySize();
+    memory_size += sizeof(MTuple<DIMS>*) * max_tuples_num;
+    memory_size += tuples_map.MemorySize();
+    if (tuple_pruning) {
+        memory_size += src_ip_trie.Memory() - sizeof(TupleTrie);
+        memory_size += dst_ip_trie.Memory() - sizeof(TupleTrie);
+    }
     for (int i = 0; i < tuples_num; ++i) {
         memory_size += tuples_arr[i]->MemorySize();
         //printf("%d\n", tuples_arr[i]->MemorySize());
@@ -300,7 +618,8 @@ uint64_t MultilayerTuple::MemorySize() {
 	return 0;
 }
 
-int MultilayerTuple::CalculateState(ProgramState *program_state) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::CalculateState(ProgramState *program_state) {
     if (start_tuple_layer)
         program_state->tuples_num = tuples_num;
     program_state->tuples_sum += tuples_num;
@@ -311,22 +630,47 @@ int MultilayerTuple::CalculateState(ProgramState *program_state) {
 	return 0;
 }
 
-int MultilayerTuple::GetRules(vector<Rule*> &rules) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::GetRules(vector<Rule*> &rules) {
     for (int i = 0; i < tuples_num; ++i)
         tuples_arr[i]->GetRules(rules);
 	return 0;
 }
 
-int MultilayerTuple::Free(bool free_self) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::Free(bool free_self) {
+    // the slab is freed at once, the objects in it are not released one by one
+    if (start_tuple_layer)
+        slab->freeing = true;
     for (int i = 0; i < tuples_num; ++i)
         tuples_arr[i]->Free(true);
     free(tuples_arr);
-    tuples_map.clear();
-    if (free_self)
-        free(this);
+    slab->Release(tuple_list, MTupleList<DIMS>::Size(tuple_list->tuples_num));
+    tuple_list = NULL;
+    tuples_map.Free();
+    if (tuple_pruning) {
+        src_ip_trie.Free();
+        dst_ip_trie.Free();
+    }
+    if (start_tuple_layer) {
+        slab->Free();
+        free(slab);
+        slab = NULL;
+        migration->Free();
+        free(migration);
+        migration = NULL;
+        if (free_self)
+            free(this);
+    } else if (free_self) {
+        slab->Release(this, sizeof(MultilayerTuple<DIMS>));
+    }
 	return 0;
 }
 
-int MultilayerTuple::Test(void *ptr) {
+template<int DIMS>
+int MultilayerTuple<DIMS>::Test(void *ptr) {
 	return 0;
-}
\ No newline at end of file
+}
+
+template class MultilayerTuple<2>;
+template class MultilayerTuple<5>;
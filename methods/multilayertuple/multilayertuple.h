@@ -3,23 +3,141 @@
 
 #include "../../elementary.h"
 #include "mtuple.h"
+#include "tupletrie.h"
 
 
 #define MULTILATERTUPLE_TYPE 1
 #define DYNAMICTUPLEDIMS_TYPE 2
 
+#define MTUPLEBATCHSIZE 16  // packets per group in LookupBatch
+
 using namespace std;
 
-struct MTuple;
+template<int DIMS> struct MTuple;
+template<int DIMS> struct MMigration;
+
+// prefix_pair -> tuple, open addressing with linear probing and backward shift deletion
+template<int DIMS>
+struct MTupleMap {
+    uint32_t *keys;
+    MTuple<DIMS> **tuples;  // NULL : empty slot
+    uint32_t mask;
+    uint32_t size;
+
+    uint32_t Index(uint32_t key) {
+        uint32_t hash = key * 0x9E3779B1U;
+        return (hash ^ hash >> 16) & mask;
+    }
+
+    void Init(uint32_t capacity) {
+        mask = capacity - 1;
+        size = 0;
+        keys = (uint32_t*)malloc(sizeof(uint32_t) * capacity);
+        tuples = (MTuple<DIMS>**)malloc(sizeof(MTuple<DIMS>*) * capacity);
+        for (int i = 0; i < capacity; ++i)
+            tuples[i] = NULL;
+    }
+
+    MTuple<DIMS>* Find(uint32_t key) {
+        for (uint32_t i = Index(key); tuples[i]; i = (i + 1) & mask)
+            if (keys[i] == key)
+                return tuples[i];
+        return NULL;
+    }
+
+    void Insert(uint32_t key, MTuple<DIMS> *tuple) {
+        if ((size + 1) * 2 > mask + 1) {
+            uint32_t *origin_keys = keys;
+            MTuple<DIMS> **origin_tuples = tuples;
+            uint32_t origin_capacity = mask + 1;
+            Init(origin_capacity * 2);
+            for (int i = 0; i < origin_capacity; ++i)
+                if (origin_tuples[i])
+                    Insert(origin_keys[i], origin_tuples[i]);
+            free(origin_keys);
+            free(origin_tuples);
+        }
+        uint32_t i = Index(key);
+        while (tuples[i])
+            i = (i + 1) & mask;
+        keys[i] = key;
+        tuples[i] = tuple;
+        ++size;
+    }
+
+    void Erase(uint32_t key) {
+        uint32_t i = Index(key);
+        while (tuples[i] && keys[i] != key)
+            i = (i + 1) & mask;
+        if (!tuples[i])
+            return;
+        tuples[i] = NULL;
+        --size;
+        // move back the following entries whose home slot is not in (i, j]
+        for (uint32_t j = (i + 1) & mask; tuples[j]; j = (j + 1) & mask) {
+            uint32_t home = Index(keys[j]);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                keys[i] = keys[j];
+                tuples[i] = tuples[j];
+                tuples[j] = NULL;
+                i = j;
+            }
+        }
+    }
+
+    static uint64_t MemorySize(uint32_t capacity) {
+        return (sizeof(uint32_t) + sizeof(MTuple<DIMS>*)) * (uint64_t)capacity;
+    }
+    uint64_t MemorySize() {
+        return MemorySize(mask + 1);
+    }
+
+    void Free() {
+        free(keys);
+        free(tuples);
+        keys = NULL;
+        tuples = NULL;
+        size = 0;
+    }
+};
+
 
+// tuples_arr as lookups see it, replaced as a whole when the order or a max_priority changes
+template<int DIMS>
+struct MTupleEntry {
+    MTuple<DIMS> *tuple;
+    int max_priority;
+};
+
+template<int DIMS>
+struct MTupleList {
+    int tuples_num;
+    int reserved;
+
+    MTupleEntry<DIMS>* Entries() {
+        return (MTupleEntry<DIMS>*)(this + 1);
+    }
+    static uint32_t Size(int tuples_num) {
+        return sizeof(MTupleList<DIMS>) + sizeof(MTupleEntry<DIMS>) * tuples_num;
+    }
+};
+
+// region thresholds every MultilayerTuple starts with, -1 keeps the current one
+void SetDefaultRegion(int _x1, int _y1, int _x2, int _y2);
+
+// DIMS : prefix dims of the tuples, 2 (src/dst ip) or 5
+template<int DIMS>
 class MultilayerTuple : public Classifier {
 public:
+    typedef typename MKeyTraits<DIMS>::Key Key;
     
     int Create(vector<Rule*> &rules, bool insert);
+    int BulkLoad(vector<Rule*> &rules);
 
     int InsertRule(Rule *rule);
     int DeleteRule(Rule *rule);
     int Lookup(Trace *trace, int priority);
+    int LookupBatch(Trace **traces, int n, int *out);
     int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state);
 
     int Reconstruct();
@@ -29,25 +147,47 @@ public:
     int Free(bool free_self);
     int Test(void *ptr);
 
-    int Init(uint32_t _tuple_layer, bool _start_tuple_layer);
-    void InsertTuple(MTuple *tuple);
+    int Init(uint32_t _tuple_layer, bool _start_tuple_layer, MultilayerTuple<DIMS> *parent = NULL);  // parent : the layer of the hash node
+    void SetRegion(int _x1, int _y1, int _x2, int _y2);  // after Init, before Create
+    void InsertTuple(MTuple<DIMS> *tuple);
     void SortTuples();
+    void MoveTuple(MTuple<DIMS> *tuple);
+    void PublishTuples();
     uint32_t GetReducedPrefix(uint32_t *prefix_len, Rule *rule);
+    int LookupGroup(Trace **traces, int n, int *out);
+    template<int HASH> int LookupHash(Trace *trace, int priority);
+    template<int HASH> int LookupGroupHash(Trace **traces, int n, int *out);
 
     bool start_tuple_layer;
     uint32_t tuple_layer;
+    MSlab *slab;  // created by the start tuple layer, shared by its next layers
+    MMigration<DIMS> *migration;  // as slab
 
-    MTuple **tuples_arr;
-    map<uint32_t, MTuple*> tuples_map;
+    MTuple<DIMS> **tuples_arr;
+    MTupleList<DIMS> *tuple_list;
+    MTupleMap<DIMS> tuples_map;
     int tuples_num;
     int max_tuples_num;
     int rules_num;
     int max_priority;
+    // src/dst ip prefix_len thresholds of the 7 regions in GetReducedPrefix, the globals by default, of the parent in the next layers
     int x1;
     int y1;
     int x2;
     int y2;
 
+    int hash_type;  // of the tuple keys, the global by default, of the parent in the next layers
+
+    // Lookup and LookupBatch may run in other threads during InsertRule and DeleteRule,
+    // the writer frees what it unlinks only after the lookups in the slab epochs leave
+    bool concurrent_lookup;
+
+    // tuple pruning by src/dst ip prefix tries, not with concurrent_lookup
+    bool tuple_pruning;
+    TupleTrie src_ip_trie;
+    TupleTrie dst_ip_trie;
+    uint64_t used_tuple_ids;
+
     double cal_time;
 };
 
@@ -0,0 +1,124 @@
+#include "tupletrie.h"
+
+using namespace std;
+
+TupleTrieNode* TupleTrieNode::Create() {
+    TupleTrieNode* trie_node = (TupleTrieNode*)malloc(sizeof(TupleTrieNode));
+    trie_node->child[0] = NULL;
+    trie_node->child[1] = NULL;
+    trie_node->tuples = 0;
+    trie_node->tuple_rules_num = NULL;
+    trie_node->tuple_rules_num_size = 0;
+    return trie_node;
+}
+
+int TupleTrieNode::CountNum() {
+    int num = 1;
+    for (int i = 0; i < 2; ++i)
+        if (child[i])
+            num += child[i]->CountNum();
+    return num;
+}
+
+uint32_t TupleTrieNode::TupleRulesNumSize() {
+    uint32_t size = tuple_rules_num_size;
+    for (int i = 0; i < 2; ++i)
+        if (child[i])
+            size += child[i]->TupleRulesNumSize();
+    return size;
+}
+
+void TupleTrieNode::FreeAll() {
+    for (int i = 0; i < 2; ++i)
+        if (child[i])
+            child[i]->FreeAll();
+    free(tuple_rules_num);
+    free(this);
+}
+
+int TupleTrie::Init() {
+    root = TupleTrieNode::Create();
+    return 0;
+}
+
+int TupleTrie::InsertRule(uint32_t ip, uint8_t prefix_len, uint32_t tuple_id) {
+    if (tuple_id >= MAXPRUNETUPLES)
+        return 0;
+    TupleTrieNode *node = root;
+    for (int i = 0; i < prefix_len; ++i) {
+        int bit = (ip >> (31 - i)) & 1;
+        if (node->child[bit] == NULL)
+            node->child[bit] = TupleTrieNode::Create();
+        node = node->child[bit];
+    }
+    for (int i = 0; i < node->tuple_rules_num_size; ++i)
+        if (node->tuple_rules_num[i].tuple_id == tuple_id) {
+            ++node->tuple_rules_num[i].rules_num;
+            return 0;
+        }
+    int size = node->tuple_rules_num_size + 1;
+    node->tuple_rules_num = (TupleRulesNum*)realloc(node->tuple_rules_num, sizeof(TupleRulesNum) * size);
+    node->tuple_rules_num[size - 1].tuple_id = tuple_id;
+    node->tuple_rules_num[size - 1].rules_num = 1;
+    node->tuple_rules_num_size = size;
+    node->tuples |= 1ULL << tuple_id;
+    return 0;
+}
+
+int TupleTrie::DeleteRule(uint32_t ip, uint8_t prefix_len, uint32_t tuple_id) {
+    if (tuple_id >= MAXPRUNETUPLES)
+        return 0;
+    TupleTrieNode *pre_nodes[33];
+    TupleTrieNode *node = root;
+    pre_nodes[0] = node;
+    for (int i = 0; i < prefix_len; ++i) {
+        node = node->child[(ip >> (31 - i)) & 1];
+        if (node == NULL) {
+            printf("Wrong: TupleTrie DeleteRule no such prefix\n");
+            return 1;
+        }
+        pre_nodes[i + 1] = node;
+    }
+    int index = 0;
+    while (index < node->tuple_rules_num_size && node->tuple_rules_num[index].tuple_id != tuple_id)
+        ++index;
+    if (index == node->tuple_rules_num_size) {
+        printf("Wrong: TupleTrie DeleteRule no such tuple\n");
+        return 1;
+    }
+    if (--node->tuple_rules_num[index].rules_num > 0)
+        return 0;
+    node->tuple_rules_num[index] = node->tuple_rules_num[--node->tuple_rules_num_size];
+    node->tuples &= ~(1ULL << tuple_id);
+    if (node->tuple_rules_num_size == 0) {
+        free(node->tuple_rules_num);
+        node->tuple_rules_num = NULL;
+    }
+    // remove the empty nodes on the path
+    for (int i = prefix_len; i > 0; --i) {
+        node = pre_nodes[i];
+        if (node->tuple_rules_num_size > 0 || node->child[0] || node->child[1])
+            break;
+        pre_nodes[i - 1]->child[(ip >> (32 - i)) & 1] = NULL;
+        free(node);
+    }
+    return 0;
+}
+
+uint64_t TupleTrie::Memory() {
+    uint64_t size = sizeof(TupleTrie);
+    if (root)
+        size += NodesMemory(root->CountNum(), root->TupleRulesNumSize());
+    return size;
+}
+
+int TupleTrie::Free() {
+    if (root)
+        root->FreeAll();
+    root = NULL;
+    return 0;
+}
+
+int TupleTrie::Test(void *ptr) {
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef  TUPLETRIE_H
+#define  TUPLETRIE_H
+
+#include "../../elementary.h"
+
+// tuples with id >= MAXPRUNETUPLES are never pruned
+#define MAXPRUNETUPLES 64
+
+using namespace std;
+
+struct TupleRulesNum {
+    uint32_t tuple_id;
+    uint32_t rules_num;
+};
+
+struct TupleTrieNode {
+    TupleTrieNode *child[2];
+    uint64_t tuples;  // bitmap of the tuples having rules with this prefix
+    TupleRulesNum *tuple_rules_num;
+    int tuple_rules_num_size;
+
+    static TupleTrieNode* Create();
+    int CountNum();
+    uint32_t TupleRulesNumSize();  // of this node and below
+    void FreeAll();
+};
+
+// Binary trie over one ip field of a MultilayerTuple, every prefix node records the tuples of its rules.
+// OR-ing the bitmaps along the path of an ip gives the tuples that may match it.
+class TupleTrie {
+public:
+    int Init();
+
+    int InsertRule(uint32_t ip, uint8_t prefix_len, uint32_t tuple_id);
+    int DeleteRule(uint32_t ip, uint8_t prefix_len, uint32_t tuple_id);
+
+    uint64_t Lookup(uint32_t ip) {
+        TupleTrieNode *node = root;
+        uint64_t tuples = node->tuples;
+        for (int i = 0; i < 32; ++i) {
+            node = node->child[(ip >> (31 - i)) & 1];
+            if (!node)
+                break;
+            tuples |= node->tuples;
+        }
+        return tuples;
+    }
+
+    uint64_t Memory();
+    // nodes and their tuple_rules_num arrays
+    static uint64_t NodesMemory(uint32_t nodes_num, uint32_t tuple_rules_num_size) {
+        return sizeof(TupleTrieNode) * (uint64_t)nodes_num + sizeof(TupleRulesNum) * (uint64_t)tuple_rules_num_size;
+    }
+    int Free();
+    int Test(void *ptr);
+
+    TupleTrieNode* root;
+};
+
+
+#endif
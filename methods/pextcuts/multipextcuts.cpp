@@ -5,6 +5,11 @@
 using namespace std;
 
 int MultiPextCuts::Create(vector<Rule*> &rules, bool insert) {
+    Build(rules, true);
+    return 0;
+}
+
+int MultiPextCuts::Build(vector<Rule*> &rules, bool search) {
     int rules_num = rules.size();
     memset(protocol_num, 0, sizeof(protocol_num));
     for (int i = 0; i < rules_num; ++i)
@@ -15,31 +20,132 @@ int MultiPextCuts::Create(vector<Rule*> &rules, bool insert) {
         } else {
             pextcuts[i] = pextcuts[0];
         }
+    // the protocols, their trees and large subtrees are tasks of one parallel region
+    PextBuilder builder;
+    builder.Init(rules);
+    if (!search) {
+        builder.beam_width = 1;
+        builder.lookahead = 0;
+    }
+    #pragma omp parallel
+    #pragma omp single
+    {
     for (int i = 0; i < 256; ++i)
         if (i == 0 || protocol_num[i] > 0) {
+            #pragma omp task firstprivate(i) shared(rules, builder)
+            {
             vector<Rule*> protocol_rules;
             protocol_rules.clear();
             for (int j = 0; j < rules_num; ++j)
                 if (rules[j]->range[4][0] <= i && i <= rules[j]->range[4][1])
                     protocol_rules.push_back(rules[j]);
             // printf("%d %ld\n", i, protocol_rules.size());
-            protocol_rules = UniqueRulesIgnoreProtocol(protocol_rules);
-            // printf("%d %ld\n", i, protocol_rules.size());
-            pextcuts[i]->Create(protocol_rules, true);
+            pextcuts[i]->Build(protocol_rules, &builder, true);
+            }
         }
+    }
+    // the trees of different protocols share subtrees too
+    builder.ShareSubtrees();
+    build_memory_size = builder.MemorySize();
+    builder.Free();
     return 0;
 }
 
+// the rule is inserted into the PextCuts of every protocol it covers
 int MultiPextCuts::InsertRule(Rule *rule) {
-	return 0;
+    vector<PextCuts*> targets;
+    RuleTargets(rule, true, targets);
+    bool merge = false;
+    for (int i = 0; i < targets.size(); ++i) {
+        targets[i]->AddRule(rule);
+        merge = merge || targets[i]->delta.size() >= PEXTDELTARULES;
+    }
+    if (merge)
+        Reconstruct();
+    return 0;
 }
 
 int MultiPextCuts::DeleteRule(Rule *rule) {
-	return 0;
+    vector<PextCuts*> targets;
+    RuleTargets(rule, false, targets);
+    int wrong = 1;
+    bool merge = false;
+    for (int i = 0; i < targets.size(); ++i) {
+        if (targets[i]->RemoveRule(rule) == 0)
+            wrong = 0;
+        merge = merge || targets[i]->delta.size() >= PEXTDELTARULES;
+    }
+    if (merge)
+        Reconstruct();
+    return wrong;
+}
+
+// The protocols without PextCuts of their own use pextcuts[0], which has the rules covering protocol 0.
+// A rule not covering protocol 0 inserted into such a protocol needs PextCuts of the protocol.
+// The leaves do not check the protocol, so a rule inserted into pextcuts[0] first needs PextCuts
+// of every protocol after it that uses pextcuts[0].
+void MultiPextCuts::RuleTargets(Rule *rule, bool insert, vector<PextCuts*> &targets) {
+    int begin = rule->range[4][0];
+    int end = rule->range[4][1];
+    if (begin == 0 && insert)
+        for (int i = end + 1; i < 256; ++i)
+            if (!OwnTrees(i))
+                SplitProtocol(i);
+    if (begin == 0)
+        targets.push_back(pextcuts[0]);
+    for (int i = max(begin, 1); i <= end; ++i) {
+        if (!OwnTrees(i)) {
+            if (begin == 0 || !insert)
+                continue;
+            SplitProtocol(i);
+        }
+        targets.push_back(pextcuts[i]);
+    }
+}
+
+// the new PextCuts shares the trees of pextcuts[0] until they are merged
+void MultiPextCuts::SplitProtocol(int protocol) {
+    PextCuts *base = pextcuts[0];
+    PextCuts *split = new PextCuts();
+    split->Init();
+    split->trees_num = base->trees_num;
+    split->trees = (PextNode*)malloc(sizeof(PextNode) * max(base->trees_num, 1));
+    for (int i = 0; i < base->trees_num; ++i) {
+        split->trees[i] = base->trees[i];
+        split->trees[i].duplicate = true;
+    }
+    split->tree_ranges = base->tree_ranges;
+    for (map<uint64_t, vector<Rule*>>::iterator it = base->rules_map.begin(); it != base->rules_map.end(); ++it)
+        for (int i = 0; i < it->second.size(); ++i)
+            if (it->second[i]->range[4][0] <= protocol && protocol <= it->second[i]->range[4][1])
+                split->rules_map[it->first].push_back(it->second[i]);
+    for (int i = 0; i < base->delta_rules.size(); ++i)
+        if (base->delta_rules[i]->range[4][0] <= protocol && protocol <= base->delta_rules[i]->range[4][1]) {
+            split->delta.push_back(base->delta[i]);
+            split->delta_rules.push_back(base->delta_rules[i]);
+        }
+    pextcuts[protocol] = split;
+}
+
+// the inserted rules of all protocols are merged, their trees may share subtrees
+int MultiPextCuts::Reconstruct() {
+    vector<PextCuts*> merged;
+    vector<PextCuts*> all;
+    for (int i = 0; i < 256; ++i)
+        if (OwnTrees(i)) {
+            all.push_back(pextcuts[i]);
+            if (!pextcuts[i]->delta.empty())
+                merged.push_back(pextcuts[i]);
+        }
+    if (merged.empty())
+        return 0;
+    PextMerge merge;
+    return merge.Merge(merged, all);
 }
 
 int MultiPextCuts::Lookup(Trace *trace, int priority) {
     // return pextcuts[trace->key[4]]->Lookup(trace, priority);
+    priority = pextcuts[trace->key[4]]->LookupDelta(trace, priority);
     PextNode *pext_node;
     for (int i = 0; i < pextcuts[trace->key[4]]->trees_num; ++i) {
         pext_node = &pextcuts[trace->key[4]]->trees[i];
@@ -82,21 +188,32 @@ int MultiPextCuts::LookupAccess(Trace *trace, int priority, Rule *ans_rule, Prog
 uint64_t MultiPextCuts::MemorySize() {
     uint64_t memory_size = sizeof(MultiPextCuts);
     for (int i = 0; i < 256; ++i)
-        if (i == 0 || protocol_num[i] > 0)
+        if (OwnTrees(i))
             memory_size += pextcuts[i]->MemorySize();
     return memory_size;
 }
 
+// the lookup accesses of the longest path of each tree
+int MultiPextCuts::RealHeightSum() {
+    int height_sum = 0;
+    for (int i = 0; i < 256; ++i)
+        if (OwnTrees(i))
+            for (int j = 0; j < pextcuts[i]->trees_num; ++j)
+                height_sum += pextcuts[i]->trees[j].RealHeight();
+    return height_sum;
+}
+
 int MultiPextCuts::CalculateState(ProgramState *program_state) {
+    program_state->tree_build_memory_size += build_memory_size;
     for (int i = 0; i < 256; ++i)
-        if (i == 0 || protocol_num[i] > 0)
+        if (OwnTrees(i))
             pextcuts[i]->CalculateState(program_state);
     return 0;
 }
 
 int MultiPextCuts::Free(bool free_self) {
     for (int i = 0; i < 256; ++i)
-        if (i == 0 || protocol_num[i] > 0)
+        if (OwnTrees(i))
             pextcuts[i]->Free(true);
     if (free_self)
         free(this);
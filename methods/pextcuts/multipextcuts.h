@@ -10,22 +10,30 @@ class MultiPextCuts : public Classifier {
 public:
     
     int Create(vector<Rule*> &rules, bool insert);
+    int Build(vector<Rule*> &rules, bool search);  // search : the nodes are searched as set by SetPextSearch
 
     int InsertRule(Rule *rule);
     int DeleteRule(Rule *rule);
+    void RuleTargets(Rule *rule, bool insert, vector<PextCuts*> &targets);  // the PextCuts of the protocols of the rule
+    void SplitProtocol(int protocol);
+    bool OwnTrees(int protocol) {  // false : the protocol uses pextcuts[0]
+        return protocol == 0 || pextcuts[protocol] != pextcuts[0];
+    }
     int Lookup(Trace *trace, int priority);
     int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state);
 
-    int Reconstruct() {return 0;};
+    int Reconstruct();
     uint64_t MemorySize();
     int CalculateState(ProgramState *program_state);
+    int RealHeightSum();
     int GetRules(vector<Rule*> &rules) {return 0;};
     int Free(bool free_self);
     int Test(void *ptr);
 
-    int protocol_num[256];
+    int protocol_num[256];  // rules of the build starting at the protocol
     PextCuts *pextcuts[256];
     int rules_num;
+    uint64_t build_memory_size;  // peak scratch memory of Create
 
 };
 
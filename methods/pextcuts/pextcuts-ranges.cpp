@@ -7,17 +7,25 @@ int pext_check_tuple_cost = 5;
 int pext_check_rule_cost = 3;
 uint32_t INF = 1e9;
 
+// bits of num
 int Log2(int num) {
-    int ans = 0;
-    while (num) {
-        num /= 2;
-        ++ans;
-    }
-    return ans;
+    if (num <= 0)
+        return 0;
+    return 32 - __builtin_clz(num);
 }
 
-void PcDtInfo::PextCalculateXY(int x1, int y1) {
-    int rules_num = rules.size();
+bool CmpPcDtRules(const PcDtRule &rule1, const PcDtRule &rule2) {
+    if (rule1.reduced_src_dst_ip != rule2.reduced_src_dst_ip)
+        return rule1.reduced_src_dst_ip < rule2.reduced_src_dst_ip;
+    return rule1.priority > rule2.priority;
+}
+
+bool CmpPcDtRulesPriority(const PcDtRule &rule1, const PcDtRule &rule2) {
+    return rule1.priority > rule2.priority;
+}
+
+// row_rules are sorted by CmpPcDtRules under the mask of x1 y1, NULL if x1 y1 has no tuple
+void PcDtInfo::PextCalculateXY(int x1, int y1, PcDtRule *row_rules, int rules_num) {
     if (GetIpNumSum(x1, y1, x1, 32) == 0 || GetIpNumSum(x1, y1, 32, y1) == 0) {
         for (int x2 = x1; x2 <= 32; ++x2)
             for (int y2 = y1; y2 <= 32; ++y2) {
@@ -31,49 +39,39 @@ void PcDtInfo::PextCalculateXY(int x1, int y1) {
             }
         return;
     }
-    
-    // reduce rule ip
-    for (int i = 0; i < rules_num; ++i)
-        rules[i]->reduced_src_dst_ip = rules[i]->src_dst_ip & ip_mask_pair[x1][y1];
-    sort(rules.begin(), rules.end(), CmpDtRulesIpPriority);
-    
+
+    // the tables of this x1 y1, the rows are calculated at the same time
+    uint64_t check_tuple_num[33][33];
+    uint64_t check_rule_num[33][33];
+
     // tuple
     check_tuple_num[x1][y1] = max_priority[x1][y1];
     for (int x = x1 + 1; x <= 32; ++x)
-        check_tuple_num[x][y1] = max(check_tuple_num[x - 1][y1], max_priority[x][y1]);
+        check_tuple_num[x][y1] = max<uint64_t>(check_tuple_num[x - 1][y1], max_priority[x][y1]);
     for (int y = y1 + 1; y <= 32; ++y)
-        check_tuple_num[x1][y] = max(check_tuple_num[x1][y - 1], max_priority[x1][y]);
+        check_tuple_num[x1][y] = max<uint64_t>(check_tuple_num[x1][y - 1], max_priority[x1][y]);
     for (int x = x1 + 1; x <= 32; ++x)
         for (int y = y1 + 1; y <= 32; ++y)
-            check_tuple_num[x][y] = max(max(check_tuple_num[x - 1][y], check_tuple_num[x][y - 1]), max_priority[x][y]);
+            check_tuple_num[x][y] = max<uint64_t>(max(check_tuple_num[x - 1][y], check_tuple_num[x][y - 1]), max_priority[x][y]);
 
     for (int x2 = x1; x2 <= 32; ++x2)
         for (int y2 = y1; y2 <= 32; ++y2)
             tuple_info[x1][y1][x2][y2].check_tuple_num = check_tuple_num[x2][y2];
 
-    // group && rule
-    rules[rules_num - 1]->check_num = 1;
-    for (int i = rules_num - 2; i >= 0; --i)
-        if (rules[i]->reduced_src_dst_ip == rules[i + 1]->reduced_src_dst_ip) {
-            rules[i + 1]->first = false;
-            rules[i]->check_num = rules[i + 1]->check_num + 1;
-        } else {
-            rules[i + 1]->first = true;
-            rules[i]->check_num = 1;
-        }
-    rules[0]->first = true;
-
-    int group_num = 0;
-    memset(group_vis, 0, sizeof(group_vis));
-    memset(contain_group_num, 0, sizeof(contain_group_num));
-    memset(match_group_num, 0, sizeof(match_group_num));
-    memset(collide_group_num, 0, sizeof(collide_group_num));
-    memset(check_rule_num, 0, sizeof(check_rule_num));
-
-    for (int i = 0; i < rules_num; ++i) {
-        int px = rules[i]->src_prefix_len;
-        int py = rules[i]->dst_prefix_len;
-        check_rule_num[px][py] += Log2(rules[i]->check_num);
+    // group && rule, a rule checks itself and the lower priority rules of its group
+    for (int x = x1; x <= 32; ++x)
+        for (int y = y1; y <= 32; ++y)
+            check_rule_num[x][y] = 0;
+    int check_num = 0;
+    for (int i = rules_num - 1; i >= 0; --i) {
+        if (i == rules_num - 1 || row_rules[i].reduced_src_dst_ip != row_rules[i + 1].reduced_src_dst_ip)
+            check_num = 1;
+        else
+            ++check_num;
+        int px = row_rules[i].src_prefix_len;
+        int py = row_rules[i].dst_prefix_len;
+        if (px >= x1 && py >= y1)
+            check_rule_num[px][py] += Log2(check_num);
     }
     
     // check_rule_num
@@ -93,10 +91,60 @@ void PcDtInfo::PextCalculateXY(int x1, int y1) {
         }
 }
 
+// The rules are sorted once, for the first y1 of the row with rules. Each smaller y1 drops the lowest dst bit
+// of the mask, so a group is the two groups of the two values of that bit, which are next to each other:
+// they are merged by priority.
+void PcDtInfo::PextCalculateRow(int x1) {
+    int rules_num = rules.size();
+    vector<PcDtRule> row_rules;
+    vector<PcDtRule> merged_rules;
+    int sorted_y1 = -1;  // of the order of row_rules, -1 not sorted
+    for (int y1 = 32; y1 >= 0; --y1) {
+        if (GetIpNumSum(x1, y1, x1, 32) == 0 || GetIpNumSum(x1, y1, 32, y1) == 0) {
+            PextCalculateXY(x1, y1, NULL, rules_num);
+            continue;
+        }
+        if (sorted_y1 == -1) {
+            row_rules.resize(rules_num);
+            merged_rules.resize(rules_num);
+            for (int i = 0; i < rules_num; ++i) {
+                row_rules[i].src_dst_ip = rules[i]->src_dst_ip;
+                row_rules[i].reduced_src_dst_ip = rules[i]->src_dst_ip & ip_mask_pair[x1][y1];
+                row_rules[i].priority = rules[i]->priority;
+                row_rules[i].src_prefix_len = rules[i]->src_prefix_len;
+                row_rules[i].dst_prefix_len = rules[i]->dst_prefix_len;
+            }
+            sort(row_rules.begin(), row_rules.end(), CmpPcDtRules);
+            sorted_y1 = y1;
+        }
+        for (; sorted_y1 > y1; --sorted_y1) {
+            uint64_t mask = ip_mask_pair[x1][sorted_y1 - 1];
+            int begin = 0;
+            while (begin < rules_num) {
+                uint64_t reduced_src_dst_ip = row_rules[begin].reduced_src_dst_ip & mask;
+                int mid = begin;
+                while (mid < rules_num && row_rules[mid].reduced_src_dst_ip == row_rules[begin].reduced_src_dst_ip)
+                    ++mid;
+                int end = mid;
+                while (end < rules_num && (row_rules[end].reduced_src_dst_ip & mask) == reduced_src_dst_ip)
+                    ++end;
+                merge(row_rules.begin() + begin, row_rules.begin() + mid, row_rules.begin() + mid, row_rules.begin() + end,
+                      merged_rules.begin() + begin, CmpPcDtRulesPriority);
+                for (int i = begin; i < end; ++i)
+                    merged_rules[i].reduced_src_dst_ip = reduced_src_dst_ip;
+                begin = end;
+            }
+            row_rules.swap(merged_rules);
+        }
+        PextCalculateXY(x1, y1, &row_rules[0], rules_num);
+    }
+}
+
+// the rows are tasks, in the parallel region of the build or by the calling thread alone
 void PcDtInfo::PextCalculate() {
+    #pragma omp taskloop grainsize(1)
     for (int x1 = 32; x1 >= 0; --x1)
-        for (int y1 = 32; y1 >= 0; --y1)
-            PextCalculateXY(x1, y1);
+        PextCalculateRow(x1);
 }
 
 vector<TupleRange> tuple_range_null;
@@ -9,8 +9,20 @@
 
 using namespace std;
 
+// a rule of a row of the tuple range costs
+struct PcDtRule {
+	uint64_t src_dst_ip;
+	uint64_t reduced_src_dst_ip;  // by the mask of the current x1 y1
+	int priority;
+	char src_prefix_len;
+	char dst_prefix_len;
+};
+
+bool CmpPcDtRules(const PcDtRule &rule1, const PcDtRule &rule2);
+
 struct PcDtInfo : public DtInfo {
-	void PextCalculateXY(int x1, int y1);
+	void PextCalculateXY(int x1, int y1, PcDtRule *row_rules, int rules_num);
+	void PextCalculateRow(int x1);
 	void PextCalculate();
 
 };
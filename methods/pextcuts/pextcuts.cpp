@@ -1,10 +1,11 @@
 #include "pextcuts.h"
 
 #include <immintrin.h>
+#include <mutex>
 
 using namespace std;
 
-int pext_rules_sum = 0;
+// constant after InitPextTables
 int log_2[1025];
 uint32_t bit_head[35];
 uint32_t bit_tail[35];
@@ -12,15 +13,310 @@ uint32_t mask_head[35];
 uint32_t mask_tail[35];
 uint32_t bit16_head[20];
 
-int *bits_child_num = NULL;
-int bits_child_size = 1024;
+static void InitPextTables() {
+	memset(log_2, 0, sizeof(log_2));
+	memset(bit_head, 0, sizeof(bit_head));
+	memset(bit_tail, 0, sizeof(bit_tail));
+	memset(mask_head, 0, sizeof(mask_head));
+	memset(mask_tail, 0, sizeof(mask_tail));
+	memset(bit16_head, 0, sizeof(bit16_head));
+	for (int i = 1; i < 1025; i *= 2)
+		log_2[i] = 1;
+	for (int i = 1; i < 1025; ++i)
+		log_2[i] += log_2[i - 1];
 
-void ExtendBitsChildNum() {
-	bits_child_size *= 2;
+	for (int i = 1; i <= 32; ++i) {
+		bit_head[i] = 1U << (32 - i);
+		mask_head[i] = mask_head[i - 1] + bit_head[i];
+		bit_tail[i] = 1U << (i - 1);
+		mask_tail[i] = mask_tail[i - 1] + bit_tail[i];
+	}
+
+	for (int i = 1; i <= 16; ++i) 
+		bit16_head[i] = 1U << (16 - i);
+}
+
+int pext_beam_width = 1;
+int pext_lookahead = 0;
+int pext_node_budget = 0;
+int pext_build_budget = 0;
+
+int SetPextSearch(int beam_width, int lookahead, int node_budget, int build_budget) {
+	if (beam_width < 1 || beam_width > PEXTBEAMMAX) {
+		printf("Wrong: pext_beam_width %d, should be 1 to %d\n", beam_width, PEXTBEAMMAX);
+		return 1;
+	}
+	if (lookahead != 0 && lookahead != 1) {
+		printf("Wrong: pext_lookahead %d, should be 0 or 1\n", lookahead);
+		return 1;
+	}
+	if (node_budget < 0 || build_budget < 0) {
+		printf("Wrong: pext_node_budget %d pext_build_budget %d\n", node_budget, build_budget);
+		return 1;
+	}
+	pext_beam_width = beam_width;
+	pext_lookahead = lookahead;
+	pext_node_budget = node_budget;
+	pext_build_budget = build_budget;
+	return 0;
+}
+
+// ties keep the cut inserted first, as the greedy search does
+bool PextBeam::Insert(char type, char dim, uint32_t *bits, double cost) {
+	if (cost >= 1e9)
+		return false;
+	for (int i = 0; i < cuts_num; ++i)
+		if (cuts[i].type == type && cuts[i].dim == dim && cuts[i].bits[0] == bits[0] && cuts[i].bits[1] == bits[1])
+			return false;
+	int pos = 0;
+	while (pos < cuts_num && cuts[pos].cost <= cost + 1e-9)
+		++pos;
+	if (pos == width)
+		return false;
+	if (cuts_num < width)
+		++cuts_num;
+	for (int i = cuts_num - 1; i > pos; --i)
+		cuts[i] = cuts[i - 1];
+	cuts[pos].type = type;
+	cuts[pos].dim = dim;
+	cuts[pos].expanded = false;
+	cuts[pos].bits[0] = bits[0];
+	cuts[pos].bits[1] = bits[1];
+	cuts[pos].cost = cost;
+	return true;
+}
+
+void PextBuildContext::Init() {
+	bits_child_size = 1024;
+	bits_child_num = (int*)malloc(sizeof(int) * bits_child_size);
+	arena_block = -1;
+	arena_used = 0;
+	arena_base = 0;
+	arena_peak = 0;
+	port_cache = (PextPortCacheSlot*)calloc(PEXTPORTCACHE, sizeof(PextPortCacheSlot));
+}
+
+// the candidate masks of the nodes repeat, so do the port ranges of their rules
+PrefixRange* PextBuildContext::PortRanges(PextRuleTable *table, uint32_t index, int dim, uint32_t bits, int &ranges_num) {
+	uint64_t key = (uint64_t)(table->port_range_id[index * 2 + dim - 2] + 1) << 16 | bits;
+	PextPortCacheSlot &slot = port_cache[(key * 0x9E3779B97F4A7C15ULL >> 32) % PEXTPORTCACHE];
+	if (slot.key != key) {
+		PrefixRange ranges[PEXTPORTPREFIXES];
+		// the ranges of the replaced slots are dropped all at once
+		if (port_cache_ranges.size() > PEXTPORTCACHE * 2) {
+			memset(port_cache, 0, sizeof(PextPortCacheSlot) * PEXTPORTCACHE);
+			port_cache_ranges.clear();
+		}
+		slot.key = key;
+		slot.begin = port_cache_ranges.size();
+		slot.num = table->PortRanges(index, dim, bits, ranges);
+		port_cache_ranges.insert(port_cache_ranges.end(), ranges, ranges + slot.num);
+	}
+	ranges_num = slot.num;
+	return &port_cache_ranges[slot.begin];
+}
+
+// at least size counters
+void PextBuildContext::Reserve(int size) {
+	if (size <= bits_child_size)
+		return;
+	while (bits_child_size < size)
+		bits_child_size *= 2;
 	free(bits_child_num);
 	bits_child_num = (int*)malloc(sizeof(int) * bits_child_size);
 }
 
+// a block too small for size is skipped, it is used again after a release
+void* PextBuildContext::Alloc(uint64_t size) {
+	size = (size + 7) & ~7ULL;
+	while (arena_block < 0 || arena_used + size > arena_blocks_size[arena_block]) {
+		if (arena_block >= 0)
+			arena_base += arena_blocks_size[arena_block];
+		++arena_block;
+		arena_used = 0;
+		if (arena_block == arena_blocks.size()) {
+			uint64_t block_size = max(size, (uint64_t)PEXTARENABLOCK);
+			arena_blocks.push_back((char*)malloc(block_size));
+			arena_blocks_size.push_back(block_size);
+		}
+	}
+	void *ptr = arena_blocks[arena_block] + arena_used;
+	arena_used += size;
+	arena_peak = max(arena_peak, arena_base + arena_used);
+	return ptr;
+}
+
+void PextBuildContext::Free() {
+	free(bits_child_num);
+	bits_child_num = NULL;
+	free(port_cache);
+	for (int i = 0; i < arena_blocks.size(); ++i)
+		free(arena_blocks[i]);
+	arena_blocks.clear();
+	arena_blocks_size.clear();
+}
+
+void PextRuleTable::Init(vector<Rule*> &_rules) {
+	rules = _rules;
+	sort(rules.begin(), rules.end());
+	rules.erase(unique(rules.begin(), rules.end()), rules.end());
+	int rules_num = rules.size();
+	port_range_id.resize(rules_num * 2);
+	ports_begin.clear();
+	ports.clear();
+	map<pair<uint32_t, uint32_t>, uint32_t> range_ids;
+	for (int i = 0; i < rules_num; ++i)
+		for (int j = 2; j <= 3; ++j) {
+			uint32_t start = rules[i]->range[j][0];
+			uint32_t end = rules[i]->range[j][1];
+			if (start == end || end - start + 1 == 65536)
+				continue;
+			pair<uint32_t, uint32_t> range = make_pair(start, end);
+			if (range_ids.find(range) == range_ids.end()) {
+				range_ids[range] = ports_begin.size();
+				ports_begin.push_back(ports.size());
+				vector<PrefixRange> prefixes = GetPortMask(start, end);
+				ports.insert(ports.end(), prefixes.begin(), prefixes.end());
+			}
+			port_range_id[i * 2 + j - 2] = range_ids[range];
+		}
+	ports_begin.push_back(ports.size());
+}
+
+uint32_t PextRuleTable::Index(Rule *rule) {
+	return lower_bound(rules.begin(), rules.end(), rule) - rules.begin();
+}
+
+int PextRuleTable::PortMinLen(uint32_t index, int dim) {
+	uint32_t start = rules[index]->range[dim][0];
+	uint32_t end = rules[index]->range[dim][1];
+	if (start == end)
+		return 16;
+	if (end - start + 1 == 65536)
+		return 0;
+	uint32_t range_id = port_range_id[index * 2 + dim - 2];
+	int min_len = 16;
+	for (int i = ports_begin[range_id]; i < ports_begin[range_id + 1]; ++i)
+		min_len = min(min_len, (int)ports[i].prefix_len);
+	return min_len;
+}
+
+// A prefix is a range under pext too, its free bits are the low bits. The few ranges are
+// insertion sorted by low, then one pass merges the ranges that overlap or touch.
+int PextPortRanges(PrefixRange *prefixes, int prefixes_num, uint32_t bits, PrefixRange *ranges) {
+	for (int i = 0; i < prefixes_num; ++i) {
+		PrefixRange range;
+		range.low = _pext_u32(prefixes[i].low, bits);
+		range.high = _pext_u32(prefixes[i].high, bits);
+		int j = i;
+		for (; j > 0 && ranges[j - 1].low > range.low; --j)
+			ranges[j] = ranges[j - 1];
+		ranges[j] = range;
+	}
+	int ranges_num = 1;
+	for (int i = 1; i < prefixes_num; ++i) {
+		if (ranges[i].low <= ranges[ranges_num - 1].high + 1) {
+			ranges[ranges_num - 1].high = max(ranges[ranges_num - 1].high, ranges[i].high);
+		} else {
+			ranges[ranges_num++] = ranges[i];
+		}
+	}
+	return ranges_num;
+}
+
+int PextRuleTable::PortRanges(uint32_t index, int dim, uint32_t bits, PrefixRange *ranges) {
+	uint32_t range_id = port_range_id[index * 2 + dim - 2];
+	return PextPortRanges(&ports[ports_begin[range_id]], ports_begin[range_id + 1] - ports_begin[range_id], bits, ranges);
+}
+
+uint64_t PextRuleTable::MemorySize() {
+	return sizeof(Rule*) * rules.size() + sizeof(uint32_t) * (port_range_id.size() + ports_begin.size()) + 
+		   sizeof(PrefixRange) * ports.size();
+}
+
+void PextBuilder::Init(vector<Rule*> &rules) {
+	// the tables are filled once, before any build reads them
+	static once_flag pext_tables_once;
+	call_once(pext_tables_once, InitPextTables);
+	table.Init(rules);
+	contexts_num = omp_get_max_threads();
+	contexts = new PextBuildContext[contexts_num];
+	for (int i = 0; i < contexts_num; ++i)
+		contexts[i].Init();
+	for (int i = 0; i < PEXTSUBTREESHARDS; ++i)
+		omp_init_lock(&subtrees_locks[i]);
+	beam_width = pext_beam_width;
+	lookahead = pext_lookahead;
+	node_budget = pext_node_budget / 1000.0;
+	deadline = pext_build_budget > 0 ? omp_get_wtime() + pext_build_budget / 1000.0 : 0;
+}
+
+// the weights decide the cuts, the used bits the candidates, the layer is kept in the nodes
+bool PextBuilder::ClaimSubtree(PextRules &rules, PextBits &pext_bits, char layer, PextNode *node) {
+	int rules_num = rules.num;
+	PextSubtree subtree;
+	subtree.node = node;
+	subtree.state.reserve(3 + rules_num * 2);
+	subtree.state.push_back(layer);
+	// a leaf of a few rules is built from the rules alone
+	bool leaf = rules_num <= 3;
+	subtree.state.push_back(leaf ? 0 : (uint64_t)pext_bits.ip_bits[1] << 32 | pext_bits.ip_bits[0]);
+	subtree.state.push_back(leaf ? 0 : (uint64_t)pext_bits.protocol_bits << 32 | pext_bits.port_bits[1] << 16 | pext_bits.port_bits[0]);
+	for (int i = 0; i < rules_num; ++i) {
+		subtree.state.push_back(rules.index[i]);
+		uint64_t weight = 0;
+		if (!leaf)
+			memcpy(&weight, &rules.weight[i], sizeof(weight));
+		subtree.state.push_back(weight);
+	}
+	uint64_t hash = 0;
+	for (int i = 0; i < subtree.state.size(); ++i)
+		hash = hash * 1000000007 + subtree.state[i];
+	int shard = (hash ^ hash >> 32) % PEXTSUBTREESHARDS;
+
+	omp_set_lock(&subtrees_locks[shard]);
+	vector<PextSubtree> &same_hash = subtrees[shard][hash];
+	for (int i = 0; i < same_hash.size(); ++i)
+		if (same_hash[i].state == subtree.state) {
+			Context()->shared_nodes.push_back(make_pair(node, same_hash[i].node));
+			omp_unset_lock(&subtrees_locks[shard]);
+			return false;
+		}
+	same_hash.push_back(subtree);
+	omp_unset_lock(&subtrees_locks[shard]);
+	return true;
+}
+
+// the built nodes are complete, each shared node becomes a duplicate of its built node
+void PextBuilder::ShareSubtrees() {
+	for (int i = 0; i < contexts_num; ++i) {
+		vector<pair<PextNode*, PextNode*>> &shared_nodes = contexts[i].shared_nodes;
+		for (int j = 0; j < shared_nodes.size(); ++j) {
+			*shared_nodes[j].first = *shared_nodes[j].second;
+			shared_nodes[j].first->duplicate = true;
+		}
+		shared_nodes.clear();
+	}
+}
+
+uint64_t PextBuilder::MemorySize() {
+	uint64_t memory_size = table.MemorySize();
+	for (int i = 0; i < contexts_num; ++i)
+		memory_size += contexts[i].arena_peak + sizeof(PextPortCacheSlot) * PEXTPORTCACHE + 
+					   sizeof(PrefixRange) * contexts[i].port_cache_ranges.capacity();
+	return memory_size;
+}
+
+void PextBuilder::Free() {
+	for (int i = 0; i < contexts_num; ++i)
+		contexts[i].Free();
+	delete[] contexts;
+	for (int i = 0; i < PEXTSUBTREESHARDS; ++i) {
+		subtrees[i].clear();
+		omp_destroy_lock(&subtrees_locks[i]);
+	}
+}
+
 int GetLog(int num) {
 	int ans = 0;
 	while (true) {
@@ -62,55 +358,129 @@ bool GetIpPextBits(int last_bit, int bit_num, uint32_t pext_bits, uint32_t &sele
 	return true;
 }
 
+// bit_head index of the highest bit, 0 if none
 int FirstBit(int num) {
-	for (int i = 1; i <= 32; ++i)
-		if (num & bit_head[i])
-			return i;
-	return 0;
+	if (num == 0)
+		return 0;
+	return __builtin_clz(num) + 1;
 }
 
+// bit_head index of the lowest bit, 0 if none
 int LastBit(int num) {
-	for (int i = 32; i >= 1; --i)
-		if (num & bit_head[i])
-			return i;
-	return 0;
+	if (num == 0)
+		return 0;
+	return 32 - __builtin_ctz(num);
+}
+
+void PextNodeStats::Init(PextRules &rules, PextRuleTable *table) {
+	int ip_len_num[33][33];
+	int port_len_num[2][17];
+	memset(ip_len_num, 0, sizeof(ip_len_num));
+	memset(port_len_num, 0, sizeof(port_len_num));
+	ip_groups.clear();
+	port_groups[0].clear();
+	port_groups[1].clear();
+	this->table = table;
+	this->rules.resize(rules.num);
+	// a group is added on its first rule and counted at the end
+	PextLenGroup group;
+	group.rules_num = 0;
+	int rules_num = rules.num;
+	for (int i = 0; i < rules_num; ++i) {
+		PextStatsRule &stats_rule = this->rules[i];
+		Rule *rule = table->rules[rules.index[i]];
+		for (int j = 0; j < 2; ++j)
+			for (int k = 0; k < 2; ++k) {
+				stats_rule.ip_range[j][k] = rule->range[j][k];
+				stats_rule.port_range[j][k] = rule->range[j + 2][k];
+			}
+		stats_rule.weight = rules.weight[i];
+		stats_rule.index = rules.index[i];
+		group.len[0] = rule->prefix_len[0];
+		group.len[1] = rule->prefix_len[1];
+		if (ip_len_num[group.len[0]][group.len[1]]++ == 0)
+			ip_groups.push_back(group);
+		for (int j = 0; j < 2; ++j) {
+			int min_len = table->PortMinLen(rules.index[i], j + 2);
+			group.len[0] = min_len;
+			group.len[1] = 0;
+			if (port_len_num[j][min_len]++ == 0)
+				port_groups[j].push_back(group);
+		}
+	}
+	for (int i = 0; i < ip_groups.size(); ++i)
+		ip_groups[i].rules_num = ip_len_num[ip_groups[i].len[0]][ip_groups[i].len[1]];
+	for (int i = 0; i < 2; ++i)
+		for (int j = 0; j < port_groups[i].size(); ++j)
+			port_groups[i][j].rules_num = port_len_num[i][port_groups[i][j].len[0]];
 }
 
-PextRule::PextRule(Rule *_rule) {
-    rule = _rule;
-    weight = 1;
-    if (rule != NULL) {
-    	port_prefix = new PextRulePortPrefix();
-	    port_prefix->ports[0] = GetPortMask(rule->range[2][0], rule->range[2][1]);
-	    port_prefix->ports[1] = GetPortMask(rule->range[3][0], rule->range[3][1]);
-    } else {
-    	port_prefix = NULL;
-    }
+// the ip ranges are prefixes, the cut bits beyond the prefix are the wildcard bits of the children index
+uint32_t PextNodeStats::IpRulesSum(uint32_t *bits) {
+	uint32_t rules_sum = 0;
+	for (int i = 0; i < ip_groups.size(); ++i) {
+		int wildcard_bits = __builtin_popcount(bits[0] & ~mask_head[ip_groups[i].len[0]]) + 
+							__builtin_popcount(bits[1] & ~mask_head[ip_groups[i].len[1]]);
+		rules_sum += ip_groups[i].rules_num << wildcard_bits;
+	}
+	return rules_sum;
+}
+
+uint32_t PextNodeStats::IpAllChildrenRules(uint32_t *bits) {
+	uint32_t rules_num = 0;
+	for (int i = 0; i < ip_groups.size(); ++i)
+		if ((bits[0] & mask_head[ip_groups[i].len[0]]) == 0 && (bits[1] & mask_head[ip_groups[i].len[1]]) == 0)
+			rules_num += ip_groups[i].rules_num;
+	return rules_num;
+}
+
+// the shortest prefix alone falls into 2^(its wildcard cut bits) children
+int PextNodeStats::PortRulesSumMin(int dim, uint32_t bits) {
+	vector<PextLenGroup> &groups = port_groups[dim - 2];
+	int rules_sum = 0;
+	for (int i = 0; i < groups.size(); ++i)
+		rules_sum += groups[i].rules_num << __builtin_popcount(bits & ~(mask_head[groups[i].len[0]] >> 16));
+	return rules_sum;
 }
 
-// src and dst
-double CutIpCostBits(vector<PextRule> &rules, uint32_t* bits, int layer) {
+int PextNodeStats::PortAllChildrenRules(int dim, uint32_t bits) {
+	vector<PextLenGroup> &groups = port_groups[dim - 2];
+	int rules_num = 0;
+	for (int i = 0; i < groups.size(); ++i)
+		if ((bits & (mask_head[groups[i].len[0]] >> 16)) == 0)
+			rules_num += groups[i].rules_num;
+	return rules_num;
+}
+
+// src and dst, a cost not less than max_cost may be partial
+double CutIpCostBits(PextRules &rules, uint32_t* bits, int layer, double max_cost, PextNodeStats *stats, PextBuildContext *context) {
+	uint32_t rules_num = rules.num;
+	double max_rules_rate = 3;
+	// double max_rules_rate = 2 + layer * 0.2;
+	// too many child rules or a child with almost all rules, the scan below would give 1e9
+	if (stats->IpRulesSum(bits) > rules_num * max_rules_rate || 
+		stats->IpAllChildrenRules(bits) >= rules_num - rules_num / 20)
+		return 1e9;
+
 	int max_num = 1;
 	for (int i = 0; i < 2; ++i)
 		max_num <<= Popcnt(bits[i]);
-	while (max_num + 1> bits_child_size)
-		ExtendBitsChildNum();
+	context->Reserve(max_num + 1);
+	int *bits_child_num = context->bits_child_num;
 	for (int i = 0; i < max_num; ++i)
 		bits_child_num[i] = 0;
 	double cost = 0;
 	int src_bits_num = Popcnt(bits[0]);
 
-	uint32_t rules_num = rules.size();
 	uint32_t rules_sum = 0;
 	uint32_t range[2][2];
 	uint32_t range_num[2];
 	uint32_t range_sum;
-	double max_rules_rate = 3;
-	// double max_rules_rate = 2 + layer * 0.2;
+	PextStatsRule *stats_rules = &stats->rules[0];
 	for (int i = 0; i < rules_num; ++i) {
 		for (int j = 0; j < 2; ++j) {
 			for (int k = 0; k < 2; ++k)
-				range[j][k] = _pext_u32(rules[i].rule->range[j][k], bits[j]);
+				range[j][k] = _pext_u32(stats_rules[i].ip_range[j][k], bits[j]);
 			range_num[j] = range[j][1] - range[j][0] + 1;
 		}
 		range_sum = range_num[0] * range_num[1];
@@ -123,8 +493,11 @@ double CutIpCostBits(vector<PextRule> &rules, uint32_t* bits, int layer) {
 			for (int k = range[1][0]; k <= range[1][1]; ++k) {
 				int index = k << src_bits_num | j;
 				++bits_child_num[index];
-				cost += bits_child_num[index] * rules[i].weight / range_sum;
+				cost += bits_child_num[index] * stats_rules[i].weight / range_sum;
 			}
+		// the cost only grows, the candidate can not beat max_cost any more
+		if (cost >= max_cost)
+			break;
 	}
 	int max_child_num = 0;
 	for (int i = 0; i < max_num; ++i)
@@ -137,12 +510,14 @@ double CutIpCostBits(vector<PextRule> &rules, uint32_t* bits, int layer) {
 	return cost;
 }
 
-double CutIpCost(vector<PextRule> &rules, uint32_t* bits, PextBits pext_bits, int layer) {
-	int rules_num = rules.size();
+// the candidates are kept in beam too if it is not NULL
+double CutIpCost(PextRules &rules, uint32_t* bits, PextBits pext_bits, int layer, PextNodeStats *stats, PextBuildContext *context, 
+				 PextBeam *beam) {
+	int rules_num = rules.num;
 	char min_prefix_len[2] = {32, 32};
-	for (int i = 0; i < rules_num; ++i)
+	for (int i = 0; i < stats->ip_groups.size(); ++i)
 		for (int j = 0; j < 2; ++j)
-			min_prefix_len[j] = min(min_prefix_len[j], rules[i].rule->prefix_len[j]);
+			min_prefix_len[j] = min(min_prefix_len[j], stats->ip_groups[i].len[j]);
 	int bits_num = GetLog(rules_num);
 
 	double cost = 1e9;
@@ -162,7 +537,9 @@ double CutIpCost(vector<PextRule> &rules, uint32_t* bits, PextBits pext_bits, in
 			flag[1] = GetIpPextBits(min_prefix_len[1], init_bits_num - i, pext_bits.ip_bits[1], test_bits[1]);
 			if (!flag[0] || !flag[1])
 				continue;
-			double test_cost = CutIpCostBits(rules, test_bits, layer);
+			double test_cost = CutIpCostBits(rules, test_bits, layer, beam ? max(cost, beam->MaxCost()) : cost, stats, context);
+			if (beam)
+				beam->Insert(PextCutIp, 0, test_bits, test_cost);
 			if (test_cost < cost) {
 				cost = test_cost;
 				bits[0] = test_bits[0];
@@ -194,15 +571,17 @@ double CutIpCost(vector<PextRule> &rules, uint32_t* bits, PextBits pext_bits, in
 					test_bits[k & 1] ^= bit_head[index];
 				} else if (k == 2 || k == 3) {
 					int index = LastBit(pre_bits[k & 1]);
-					if (index == 0)
+					// a single bit was tried by k - 2
+					if (index == 0 || index == FirstBit(pre_bits[k & 1]))
 						continue;
 					test_bits[k & 1] ^= bit_head[index];
 				}
 				test_bits[j] |= bit_head[i];
 				if (Popcnt(test_bits[0]) + Popcnt(test_bits[1]) > bits_num)
 					continue;
-				double test_cost = CutIpCostBits(rules, test_bits, layer);
-				
+				double test_cost = CutIpCostBits(rules, test_bits, layer, beam ? max(cost, beam->MaxCost()) : cost, stats, context);
+				if (beam)
+					beam->Insert(PextCutIp, 0, test_bits, test_cost);
 				if (test_cost < cost) {
 					cost = test_cost;
 					bits[0] = test_bits[0];
@@ -216,156 +595,152 @@ double CutIpCost(vector<PextRule> &rules, uint32_t* bits, PextBits pext_bits, in
 	return cost;
 }
 
-uint64_t HashRulePriority(vector<PextRule> &rules) {
-	uint64_t hash = 0;
-	for (int i = 0; i < rules.size(); ++i) {
-		hash = hash * (1e9 + 7) + rules[i].rule->priority;
+// step 0 counts the rules of a child, step 1 places them
+inline void AddChildRule(PextRules &child_rules, int step, uint32_t index, double weight) {
+	if (step == 1) {
+		child_rules.index[child_rules.num] = index;
+		child_rules.weight[child_rules.num] = weight;
 	}
-	return hash;
+	++child_rules.num;
 }
 
-bool SameRules(vector<PextRule> &rules1, vector<PextRule> &rules2) {
-	if (rules1.size() != rules2.size())
-		return false;
-	for (int i = 0; i < rules1.size(); ++i)
-		if (rules1[i].rule->priority != rules2[i].rule->priority)
-			return false;
-	return true;
+// the arrays of the counted children, on top of the arena
+void AllocChildRules(PextRules *child_rules, int children_num, PextBuildContext *context) {
+	for (int i = 0; i < children_num; ++i) {
+		child_rules[i].index = (uint32_t*)context->Alloc(sizeof(uint32_t) * child_rules[i].num);
+		child_rules[i].weight = (double*)context->Alloc(sizeof(double) * child_rules[i].num);
+		child_rules[i].num = 0;
+	}
 }
 
-void PextNode::CreateIpCut(vector<PextRule> &rules, uint32_t *bits, PextBits pext_bits) {
-	type = PextCutIp;
-	dim = 0;
-	max_priority = rules[0].rule->priority;
-	cut_ip_bits = (uint64_t)bits[1] << 32 | bits[0];
-	int rules_num = rules.size();
+void PextNode::CreateChildren(PextRules *child_rules, int children_num, PextBits pext_bits, PextBuilder *builder) {
+	children = (PextNode*)malloc(sizeof(PextNode) * children_num);
+	PextNode *_children = children;
+	char child_layer = layer + 1;
+	for (int i = 0; i < children_num; ++i) {
+		if (child_rules[i].num > PEXTTASKRULES) {
+			#pragma omp task firstprivate(i)
+			_children[i].Create(child_rules[i], pext_bits, child_layer, builder);
+		} else {
+			_children[i].Create(child_rules[i], pext_bits, child_layer, builder);
+		}
+	}
+	#pragma omp taskwait
+}
 
+// the child rules are counted, then placed on top of the arena of the thread
+PextRules* PartitionIpRules(PextRules &rules, uint32_t *bits, PextRuleTable *table, PextBuildContext *context) {
+	int rules_num = rules.num;
 	int max_num = 1;
 	for (int i = 0; i < 2; ++i)
 		max_num <<= Popcnt(bits[i]);
-	vector<PextRule> child_rules[max_num];
+	PextRules *child_rules = (PextRules*)context->Alloc(sizeof(PextRules) * max_num);
 	for (int i = 0; i < max_num; ++i)
-		child_rules[i].clear();
+		child_rules[i].num = 0;
 
 	uint32_t range[2][2];
 	uint32_t range_num[2];
 	uint32_t range_sum;
 	int src_bits_num = Popcnt(bits[0]);
-	PextRule rule(NULL);
-	for (int i = 0; i < rules_num; ++i) {
-		for (int j = 0; j < 2; ++j) {
-			for (int k = 0; k < 2; ++k)
-				range[j][k] = _pext_u32(rules[i].rule->range[j][k], bits[j]);
-			range_num[j] = range[j][1] - range[j][0] + 1;
-		}
-		range_sum = range_num[0] * range_num[1];
-		rule = rules[i];
-		rule.weight /= range_sum;
-
-		for (int j = range[0][0]; j <= range[0][1]; ++j)
-			for (int k = range[1][0]; k <= range[1][1]; ++k) {
-				int index = k << src_bits_num | j;
-				child_rules[index].push_back(rule);
+	for (int step = 0; step < 2; ++step) {
+		if (step == 1)
+			AllocChildRules(child_rules, max_num, context);
+		for (int i = 0; i < rules_num; ++i) {
+			Rule *rule = table->rules[rules.index[i]];
+			for (int j = 0; j < 2; ++j) {
+				for (int k = 0; k < 2; ++k)
+					range[j][k] = _pext_u32(rule->range[j][k], bits[j]);
+				range_num[j] = range[j][1] - range[j][0] + 1;
 			}
-	}
-	pext_bits.ip_bits[0] |= bits[0];
-	pext_bits.ip_bits[1] |= bits[1];
+			range_sum = range_num[0] * range_num[1];
+			double weight = rules.weight[i] / range_sum;
 
-	children = (PextNode*)malloc(sizeof(PextNode) * max_num);
-	map<uint64_t, vector<int>> children_map;
-	for (int i = 0; i < max_num; ++i) {
-		uint64_t hash = HashRulePriority(child_rules[i]);
-		if (children_map.find(hash) != children_map.end()) {
-			vector<int> vc = children_map[hash];
-			bool duplicate_flag = false;
-			for (int j = 0; j < vc.size(); ++j) {
-				int index = vc[j];
-				if (SameRules(child_rules[index], child_rules[i])) {
-					children[i] = children[index];
-					children[i].duplicate = true;
-					duplicate_flag = true;
-					break;
+			for (int j = range[0][0]; j <= range[0][1]; ++j)
+				for (int k = range[1][0]; k <= range[1][1]; ++k) {
+					int index = k << src_bits_num | j;
+					AddChildRule(child_rules[index], step, rules.index[i], weight);
 				}
-			}
-			if (duplicate_flag)
-				continue;
 		}
-		children[i].Create(child_rules[i], pext_bits, layer + 1);
-		children_map[hash].push_back(i);
 	}
+	return child_rules;
 }
 
-vector<PrefixRange> GetPortRrangeBits(PextRule rule, int dim, uint32_t bits) {
-	vector<PrefixRange> ranges;
-	for (int i = 0; i < rule.port_prefix->ports[dim - 2].size(); ++i) {
-		PrefixRange range = rule.port_prefix->ports[dim - 2][i];
-		range.low = _pext_u32(range.low, bits);
-		range.high = _pext_u32(range.high, bits);
-		ranges.push_back(range);
-	}
-	for (int i = ranges.size() - 1; i > 0; --i) {
-		for (int j = 0; j < i; ++j)
-			if ((ranges[i].low <= ranges[j].low + 1 && ranges[j].low <= ranges[i].high + 1) || 
-				(ranges[j].low <= ranges[i].low + 1 && ranges[i].low <= ranges[j].high + 1)){
-				ranges[j].low = min(ranges[j].low, ranges[i].low);
-				ranges[j].high = max(ranges[j].high, ranges[i].high);
-				ranges.erase(ranges.begin() + i);
-				break;
-			}
-	}
-	return ranges;
+// the child rules are released after the children are built
+void PextNode::CreateIpCut(PextRules &rules, uint32_t *bits, PextBits pext_bits, PextBuilder *builder) {
+	PextRuleTable *table = &builder->table;
+	PextBuildContext *context = builder->Context();
+	type = PextCutIp;
+	dim = 0;
+	max_priority = table->rules[rules.index[0]]->priority;
+	cut_ip_bits = (uint64_t)bits[1] << 32 | bits[0];
+
+	PextArenaMark mark = context->Mark();
+	PextRules *child_rules = PartitionIpRules(rules, bits, table, context);
+	pext_bits.ip_bits[0] |= bits[0];
+	pext_bits.ip_bits[1] |= bits[1];
+
+	CreateChildren(child_rules, 1 << (Popcnt(bits[0]) + Popcnt(bits[1])), pext_bits, builder);
+	context->Release(mark);
 }
 
-double CutPortCostBits(vector<PextRule> &rules, int dim, uint32_t bits, int layer) {
+// a cost not less than max_cost may be partial
+double CutPortCostBits(PextRules &rules, int dim, uint32_t bits, int layer, double max_cost, PextNodeStats *stats, PextBuildContext *context) {
+	int rules_num = rules.num;
+	double max_rules_rate = 2.5;
+	// double max_rules_rate = 2 + layer * 0.2;
+	if (stats->PortRulesSumMin(dim, bits) > rules_num * max_rules_rate || 
+		stats->PortAllChildrenRules(dim, bits) >= rules_num - rules_num / 20)
+		return 1e9;
+
 	int max_num = 1 << Popcnt(bits);
-	while (max_num + 1> bits_child_size)
-		ExtendBitsChildNum();
+	context->Reserve(max_num + 1);
+	int *bits_child_num = context->bits_child_num;
 	for (int i = 0; i < max_num; ++i)
 		bits_child_num[i] = 0;
 	double cost = 0;
 
-	int rules_num = rules.size();
 	int rules_sum = 0;
 	uint32_t start;
 	uint32_t end;
 	uint32_t index;
 	uint32_t cut_num;
-	double max_rules_rate = 2.5;
-	// double max_rules_rate = 2 + layer * 0.2;
+	PextStatsRule *stats_rules = &stats->rules[0];
 	for (int i = 0; i < rules_num; ++i) {
 		if (rules_sum > rules_num * max_rules_rate) {
 			cost = 1e9;
 			break;
 		}
-		start = rules[i].rule->range[dim][0];
-		end = rules[i].rule->range[dim][1];
+		start = stats_rules[i].port_range[dim - 2][0];
+		end = stats_rules[i].port_range[dim - 2][1];
 		if (start == end) {
 			index = _pext_u32(start, bits);
 			++bits_child_num[index];
-			cost += bits_child_num[index] * rules[i].weight;
+			cost += bits_child_num[index] * stats_rules[i].weight;
 			rules_sum += 1; 
 		} else if (end - start + 1 == 65536) {
 			cut_num = max_num;
 			for (int j = 0; j < max_num; ++j) {
 				++bits_child_num[j];
-				cost += bits_child_num[j] * rules[i].weight / cut_num;
+				cost += bits_child_num[j] * stats_rules[i].weight / cut_num;
 			}
 			rules_sum += max_num;
 		} else {
 			cut_num = 0;
-			vector<PrefixRange> ranges = GetPortRrangeBits(rules[i], dim, bits);
-			// if (ranges.size() > 2) printf("%ld\n", ranges.size());
-			for (int k = 0; k < ranges.size(); ++k)
+			int ranges_num;
+			PrefixRange *ranges = context->PortRanges(stats->table, stats_rules[i].index, dim, bits, ranges_num);
+			for (int k = 0; k < ranges_num; ++k)
 				cut_num += ranges[k].high - ranges[k].low + 1;
-			for (int k = 0; k < ranges.size(); ++k) {
+			for (int k = 0; k < ranges_num; ++k) {
 				for (int j = ranges[k].low; j <= ranges[k].high; ++j) {
 					++bits_child_num[j];
-					cost += bits_child_num[j] * rules[i].weight / cut_num;
+					cost += bits_child_num[j] * stats_rules[i].weight / cut_num;
 				}
 			}
 			rules_sum += cut_num;
 		}
 		// printf("rules %d cost %.2f\n", i, cost);
+		if (cost >= max_cost)
+			break;
 	}
 	if (rules_sum > rules_num * max_rules_rate)
 		cost = 1e9;
@@ -378,10 +753,11 @@ double CutPortCostBits(vector<PextRule> &rules, int dim, uint32_t bits, int laye
 
 }
 
-// dim 2 or 3
-double CutPortCost(vector<PextRule> &rules, int dim, uint32_t &bits, PextBits pext_bits, int layer) {
+// dim 2 or 3, the candidates are kept in beam too if it is not NULL
+double CutPortCost(PextRules &rules, int dim, uint32_t &bits, PextBits pext_bits, int layer, PextNodeStats *stats, PextBuildContext *context, 
+				   PextBeam *beam) {
 	// printf("CutPortCost dim %d\n", dim);
-	int rules_num = rules.size();
+	int rules_num = rules.num;
 	int bits_num = GetLog(rules_num);
 
 	double cost = 1e9;
@@ -404,7 +780,11 @@ double CutPortCost(vector<PextRule> &rules, int dim, uint32_t &bits, PextBits pe
 			if (Popcnt(test_bits) > bits_num)
 				continue;
 
-			double test_cost = CutPortCostBits(rules, dim, test_bits, layer);
+			double test_cost = CutPortCostBits(rules, dim, test_bits, layer, beam ? max(cost, beam->MaxCost()) : cost, stats, context);
+			if (beam) {
+				uint32_t beam_bits[2] = {test_bits, 0};
+				beam->Insert(PextCutPort, dim, beam_bits, test_cost);
+			}
 			if (test_cost < cost) {
 				cost = test_cost;
 				bits = test_bits;
@@ -417,180 +797,352 @@ double CutPortCost(vector<PextRule> &rules, int dim, uint32_t &bits, PextBits pe
 }
 
 // dim = 2 or 3
-void PextNode::CreatePortCut(vector<PextRule> &rules, uint32_t bits, int _dim, PextBits pext_bits) {
-	type = PextCutPort;
-	dim = _dim;
-	max_priority = rules[0].rule->priority;
-	cut_port_bits = bits;
-	int rules_num = rules.size();
-
+PextRules* PartitionPortRules(PextRules &rules, int dim, uint32_t bits, PextRuleTable *table, PextBuildContext *context) {
+	int rules_num = rules.num;
 	int max_num = 1 << Popcnt(bits);
-	vector<PextRule> child_rules[max_num];
+	PextRules *child_rules = (PextRules*)context->Alloc(sizeof(PextRules) * max_num);
 	for (int i = 0; i < max_num; ++i)
-		child_rules[i].clear();
+		child_rules[i].num = 0;
 
 	uint32_t start;
 	uint32_t end;
 	uint32_t index;
 	uint32_t cut_num;
-	PextRule rule(NULL);
-	for (int i = 0; i < rules_num; ++i) {
-		start = rules[i].rule->range[dim][0];
-		end = rules[i].rule->range[dim][1];
-		if (start == end) {
-			index = _pext_u32(start, bits);
-			child_rules[index].push_back(rules[i]);
-		} else if (end - start + 1 == 65536) {
-			cut_num = max_num;
-			rule = rules[i];
-			rule.weight /= cut_num;
-			for (int j = 0; j < max_num; ++j)
-				child_rules[j].push_back(rule);
-		} else {
-			cut_num = 0;
-			vector<PrefixRange> ranges = GetPortRrangeBits(rules[i], dim, bits);
-			for (int k = 0; k < ranges.size(); ++k)
-				cut_num += ranges[k].high - ranges[k].low + 1;
-			rule = rules[i];
-			rule.weight /= cut_num;
-			for (int k = 0; k < ranges.size(); ++k)
-				for (int j = ranges[k].low; j <= ranges[k].high; ++j)
-					child_rules[j].push_back(rule);
+	PrefixRange ranges[PEXTPORTPREFIXES];
+	for (int step = 0; step < 2; ++step) {
+		if (step == 1)
+			AllocChildRules(child_rules, max_num, context);
+		for (int i = 0; i < rules_num; ++i) {
+			Rule *rule = table->rules[rules.index[i]];
+			start = rule->range[dim][0];
+			end = rule->range[dim][1];
+			if (start == end) {
+				index = _pext_u32(start, bits);
+				AddChildRule(child_rules[index], step, rules.index[i], rules.weight[i]);
+			} else if (end - start + 1 == 65536) {
+				cut_num = max_num;
+				double weight = rules.weight[i] / cut_num;
+				for (int j = 0; j < max_num; ++j)
+					AddChildRule(child_rules[j], step, rules.index[i], weight);
+			} else {
+				cut_num = 0;
+				int ranges_num = table->PortRanges(rules.index[i], dim, bits, ranges);
+				for (int k = 0; k < ranges_num; ++k)
+					cut_num += ranges[k].high - ranges[k].low + 1;
+				double weight = rules.weight[i] / cut_num;
+				for (int k = 0; k < ranges_num; ++k)
+					for (int j = ranges[k].low; j <= ranges[k].high; ++j)
+						AddChildRule(child_rules[j], step, rules.index[i], weight);
+			}
 		}
 	}
+	return child_rules;
+}
+
+// dim = 2 or 3
+void PextNode::CreatePortCut(PextRules &rules, uint32_t bits, int _dim, PextBits pext_bits, PextBuilder *builder) {
+	PextRuleTable *table = &builder->table;
+	PextBuildContext *context = builder->Context();
+	type = PextCutPort;
+	dim = _dim;
+	max_priority = table->rules[rules.index[0]]->priority;
+	cut_port_bits = bits;
+
+	PextArenaMark mark = context->Mark();
+	PextRules *child_rules = PartitionPortRules(rules, dim, bits, table, context);
 	pext_bits.port_bits[dim - 2] |= bits;
 
-	children = (PextNode*)malloc(sizeof(PextNode) * max_num);
-	map<uint64_t, vector<int>> children_map;
-	for (int i = 0; i < max_num; ++i) {
-		uint64_t hash = HashRulePriority(child_rules[i]);
-		if (children_map.find(hash) != children_map.end()) {
-			vector<int> vc = children_map[hash];
-			bool duplicate_flag = false;
-			for (int j = 0; j < vc.size(); ++j) {
-				int index = vc[j];
-				if (SameRules(child_rules[index], child_rules[i])) {
-					children[i] = children[index];
-					children[i].duplicate = true;
-					duplicate_flag = true;
-					break;
-				}
+	CreateChildren(child_rules, 1 << Popcnt(bits), pext_bits, builder);
+	context->Release(mark);
+}
+
+double LeafCost(PextRules &rules) {
+	double cost = 0;
+	for (int i = 0; i < rules.num; ++i)
+		cost += i * rules.weight[i];
+		// cost += (i + 1) * rules[i].weight;
+		// cost += (i + 0.5) * rules[i].weight;
+	return cost;
+}
+
+// the greedy cut of a node
+void SelectCut(PextRules &rules, PextBits pext_bits, int layer, PextRuleTable *table, PextBuildContext *context, PextCut &select) {
+	select.type = PextLeaf;
+	select.dim = 0;
+	select.bits[0] = 0;
+	select.bits[1] = 0;
+	select.cost = LeafCost(rules);
+
+	PextNodeStats stats;
+	stats.Init(rules, table);
+	uint32_t test_bits[2];
+	double test_cost = CutIpCost(rules, test_bits, pext_bits, layer, &stats, context, NULL);
+	if (test_cost + 1e-9 < select.cost) {
+		select.type = PextCutIp;
+		select.dim = 0;
+		select.cost = test_cost;
+		select.bits[0] = test_bits[0];
+		select.bits[1] = test_bits[1];
+	}
+
+	for (int i = 2; i <= 3; ++i) {
+		test_cost = CutPortCost(rules, i, test_bits[0], pext_bits, layer, &stats, context, NULL);
+		if (test_cost + 1e-9 < select.cost) {
+			select.type = PextCutPort;
+			select.dim = i;
+			select.cost = test_cost;
+			select.bits[0] = test_bits[0];
+			select.bits[1] = 0;
+		}
+	}
+}
+
+// Tries the cuts a bit away from cut: a bit added, removed, or added in place of the first or last bit of a dim.
+void ExpandCut(PextRules &rules, PextCut cut, PextBits &pext_bits, int layer, PextNodeStats *stats, PextBuildContext *context, 
+			   PextBeam &beam) {
+	int bits_num = GetLog(rules.num);
+	int dims_num = cut.type == PextCutIp ? 2 : 1;
+	int width = cut.type == PextCutIp ? 32 : 16;
+	uint32_t *head = cut.type == PextCutIp ? bit_head : bit16_head;
+	uint32_t used[2];
+	if (cut.type == PextCutIp) {
+		used[0] = pext_bits.ip_bits[0];
+		used[1] = pext_bits.ip_bits[1];
+	} else {
+		used[0] = pext_bits.port_bits[cut.dim - 2];
+	}
+	// head index of the first and last bit of each dim, 0 if none
+	int first_bit[2] = {0, 0};
+	int last_bit[2] = {0, 0};
+	for (int j = 0; j < dims_num; ++j)
+		for (int i = 1; i <= width; ++i)
+			if (cut.bits[j] & head[i]) {
+				if (first_bit[j] == 0)
+					first_bit[j] = i;
+				last_bit[j] = i;
 			}
-			if (duplicate_flag)
+
+	uint32_t test_bits[2];
+	for (int j = 0; j < dims_num; ++j)
+		for (int i = 1; i <= width; ++i) {
+			if (used[j] & head[i])
 				continue;
+			for (int k = 0; k <= dims_num * 2; ++k) {
+				test_bits[0] = cut.bits[0];
+				test_bits[1] = cut.bits[1];
+				if (cut.bits[j] & head[i]) {
+					if (k > 0)
+						break;
+					test_bits[j] ^= head[i];
+				} else {
+					if (k > 0) {
+						int index = k & 1 ? first_bit[(k - 1) >> 1] : last_bit[(k - 1) >> 1];
+						// a single bit is removed by k - 1
+						if (index == 0 || (k % 2 == 0 && index == first_bit[(k - 1) >> 1]))
+							continue;
+						test_bits[(k - 1) >> 1] ^= head[index];
+					}
+					test_bits[j] |= head[i];
+				}
+				if (test_bits[0] == 0 && test_bits[1] == 0)
+					continue;
+				if (Popcnt(test_bits[0]) + Popcnt(test_bits[1]) > bits_num)
+					continue;
+				double test_cost;
+				if (cut.type == PextCutIp)
+					test_cost = CutIpCostBits(rules, test_bits, layer, beam.MaxCost(), stats, context);
+				else
+					test_cost = CutPortCostBits(rules, cut.dim, test_bits[0], layer, beam.MaxCost(), stats, context);
+				beam.Insert(cut.type, cut.dim, test_bits, test_cost);
+			}
+		}
+}
+
+// the cost of a cut with the leaves of its children replaced by their greedy cuts
+double LookaheadCost(PextRules &rules, PextCut &cut, PextBits pext_bits, int layer, PextRuleTable *table, PextBuildContext *context) {
+	if (cut.type == PextLeaf)
+		return cut.cost;
+	PextArenaMark mark = context->Mark();
+	PextRules *child_rules;
+	int children_num;
+	if (cut.type == PextCutIp) {
+		child_rules = PartitionIpRules(rules, cut.bits, table, context);
+		children_num = 1 << (Popcnt(cut.bits[0]) + Popcnt(cut.bits[1]));
+		pext_bits.ip_bits[0] |= cut.bits[0];
+		pext_bits.ip_bits[1] |= cut.bits[1];
+	} else {
+		child_rules = PartitionPortRules(rules, cut.dim, cut.bits[0], table, context);
+		children_num = 1 << Popcnt(cut.bits[0]);
+		pext_bits.port_bits[cut.dim - 2] |= cut.bits[0];
+	}
+	// the cut cost is the leaf cost of the children and one access of each rule
+	double cost = 0;
+	PextCut child_cut;
+	for (int i = 0; i < children_num; ++i) {
+		if (child_rules[i].num == 0)
+			continue;
+		for (int j = 0; j < child_rules[i].num; ++j)
+			cost += child_rules[i].weight[j];
+		if (child_rules[i].num <= 3) {
+			cost += LeafCost(child_rules[i]);
+		} else {
+			SelectCut(child_rules[i], pext_bits, layer + 1, table, context, child_cut);
+			cost += child_cut.cost;
+		}
+	}
+	context->Release(mark);
+	return cost;
+}
+
+// Beam search of the cut of a node. The greedy candidates seed the beam, then the cheapest cut not
+// expanded yet is expanded until all kept cuts are, within the budgets of the node and the build.
+void SearchCut(PextRules &rules, PextBits pext_bits, int layer, PextBuilder *builder, PextCut &select) {
+	PextRuleTable *table = &builder->table;
+	PextBuildContext *context = builder->Context();
+	double deadline = builder->node_budget > 0 ? omp_get_wtime() + builder->node_budget : 0;
+	if (builder->deadline > 0 && (deadline == 0 || builder->deadline < deadline))
+		deadline = builder->deadline;
+
+	PextBeam beam;
+	beam.Init(builder->beam_width);
+	uint32_t test_bits[2] = {0, 0};
+	beam.Insert(PextLeaf, 0, test_bits, LeafCost(rules));
+	{
+		PextNodeStats stats;
+		stats.Init(rules, table);
+		CutIpCost(rules, test_bits, pext_bits, layer, &stats, context, &beam);
+		for (int i = 2; i <= 3; ++i)
+			CutPortCost(rules, i, test_bits[0], pext_bits, layer, &stats, context, &beam);
+
+		for (int round = 0; round < beam.width * PEXTBEAMROUNDS; ++round) {
+			if (deadline > 0 && omp_get_wtime() > deadline)
+				break;
+			int index = 0;
+			while (index < beam.cuts_num && (beam.cuts[index].expanded || beam.cuts[index].type == PextLeaf))
+				++index;
+			if (index == beam.cuts_num)
+				break;
+			beam.cuts[index].expanded = true;
+			ExpandCut(rules, beam.cuts[index], pext_bits, layer, &stats, context, beam);
+		}
+	}
+
+	select = beam.cuts[0];
+	if (!builder->lookahead)
+		return;
+	double cost = LookaheadCost(rules, beam.cuts[0], pext_bits, layer, table, context);
+	for (int i = 1; i < beam.cuts_num; ++i) {
+		if (deadline > 0 && omp_get_wtime() > deadline)
+			break;
+		double test_cost = LookaheadCost(rules, beam.cuts[i], pext_bits, layer, table, context);
+		if (test_cost + 1e-9 < cost) {
+			cost = test_cost;
+			select = beam.cuts[i];
 		}
-		children[i].Create(child_rules[i], pext_bits, layer + 1);
-		children_map[hash].push_back(i);
 	}
 }
 
-void PextNode::CreateLeaf(vector<PextRule> &rules) {
+void PextNode::CreateLeaf(PextRules &rules, PextRuleTable *table) {
 	type = PextLeaf;
 	dim = 0;
-	max_priority = rules[0].rule->priority;
-	rules_arr_num = rules.size();
+	max_priority = table->rules[rules.index[0]]->priority;
+	rules_arr_num = rules.num;
 	rules_arr = (PextRuleNode*)malloc(sizeof(PextRuleNode) * rules_arr_num);
 	for (int i = 0; i < rules_arr_num; ++i)
-		rules_arr[i].Init(rules[i].rule);
+		rules_arr[i].Init(table->rules[rules.index[i]]);
 }
 
-int node_id;
-
-void PextNode::Create(vector<PextRule> &rules, PextBits pext_bits, char _layer) {
+void PextNode::Create(PextRules &rules, PextBits pext_bits, char _layer, PextBuilder *builder) {
 	layer = _layer;
 	duplicate = false;
-	int rules_num = rules.size();
+	int rules_num = rules.num;
 	if (rules_num == 0) {
 		type = PextLeaf;
+		dim = 0;
+		max_priority = 0;
 		rules_arr_num = 0;
+		rules_arr = NULL;
+		duplicate = true;
+		return;
+	}
+	// the same rules with the same weights and used bits are built once in the build
+	if (!builder->ClaimSubtree(rules, pext_bits, layer, this)) {
 		duplicate = true;
 		return;
 	}
 	// printf("PextNode Create %d layer %d\n", rules_num, layer);
-	int max_bits = GetLog(rules_num);
-	double cost = 0;
-	int select_type = PextLeaf;
-	int select_dim = 0;
-	uint32_t bits[2] = {0, 0};
-
-	for (int i = 0; i < rules_num; ++i)
-		cost += i * rules[i].weight;
-		// cost += (i + 1) * rules[i].weight;
-		// cost += (i + 0.5) * rules[i].weight;
-
-	++node_id;
 	if (rules_num <= 3) {
-		CreateLeaf(rules);
+		CreateLeaf(rules, &builder->table);
 		// for (int i = 0; i < layer; ++i) printf("    ");
-		// printf("layer %d rules %d : select_type %d cost %.2f id %d\n", layer, rules_num, select_type, cost, node_id);
+		// printf("layer %d rules %d : leaf\n", layer, rules_num);
 		return;
 	}
 
-	uint32_t test_bits[2];
-	double test_cost = CutIpCost(rules, test_bits, pext_bits, layer);
-	if (test_cost + 1e-9 < cost) {
-		select_type = PextCutIp;
-		select_dim = 0;
-		cost = test_cost;
-		bits[0] = test_bits[0];
-		bits[1] = test_bits[1];
+	// the stats of the search are freed before the children are built
+	PextCut select;
+	if (builder->Searching())
+		SearchCut(rules, pext_bits, layer, builder, select);
+	else
+		SelectCut(rules, pext_bits, layer, &builder->table, builder->Context(), select);
+	// for (int i = 0; i < layer; ++i) printf("    ");
+	// printf("layer %d rules %d : select_type %d select_dim %d bits %08x %08x cost %.2f\n", 
+	// 		layer, rules_num, select.type, select.dim, select.bits[0], select.bits[1], select.cost);
+
+	if (select.type == PextCutIp) {
+		CreateIpCut(rules, select.bits, pext_bits, builder);
+	} else if (select.type == PextCutPort) {
+		CreatePortCut(rules, select.bits[0], select.dim, pext_bits, builder);
+	} else if (select.type == PextLeaf) {
+		CreateLeaf(rules, &builder->table);
 	}
+}
 
-	for (int i = 2; i <= 3; ++i) {
-		test_cost = CutPortCost(rules, i, test_bits[0], pext_bits, layer);
-		if (test_cost + 1e-9 < cost) {
-			select_type = PextCutPort;
-			select_dim = i;
-			cost = test_cost;
-			bits[0] = test_bits[0];
-			bits[1] = 0;
-		}
-	}
-	// for (int i = 0; i < layer; ++i) printf("    ");
-	// printf("layer %d rules %d : select_type %d select_dim %d bits %08x %08x cost %.2f id %d\n", 
-	// 		layer, rules_num, select_type, select_dim, bits[0], bits[1], cost, node_id);
+// the rules of the same ranges but the protocol have the same key
+uint64_t PextRuleKey(PextRuleNode &rule_node) {
+	uint64_t key = (uint64_t)rule_node.src_ip_begin << 32 | rule_node.src_ip_end;
+	key = key * 1000000007 + ((uint64_t)rule_node.dst_ip_begin << 32 | rule_node.dst_ip_end);
+	key = key * 1000000007 + ((uint64_t)rule_node.src_port_begin << 48 | (uint64_t)rule_node.src_port_end << 32 | 
+							  rule_node.dst_port_begin << 16 | rule_node.dst_port_end);
+	return key;
+}
 
-	if (select_type == PextCutIp) {
-		CreateIpCut(rules, bits, pext_bits);
-	} else if (select_type == PextCutPort) {
-		CreatePortCut(rules, bits[0], select_dim, pext_bits);
-	} else if (select_type == PextLeaf) {
-		CreateLeaf(rules);
-	}
+uint64_t PextRuleKey(Rule *rule) {
+	PextRuleNode rule_node;
+	rule_node.Init(rule);
+	return PextRuleKey(rule_node);
 }
 
 void PextCuts::Init() {
 	trees_num = 0;
 	trees = NULL;
-	memset(log_2, 0, sizeof(log_2));
-	memset(bit_head, 0, sizeof(bit_head));
-	memset(bit_tail, 0, sizeof(bit_tail));
-	memset(mask_head, 0, sizeof(mask_head));
-	memset(mask_tail, 0, sizeof(mask_tail));
-	memset(bit16_head, 0, sizeof(bit16_head));
-	for (int i = 1; i < 1025; i *= 2)
-		log_2[i] = 1;
-	for (int i = 1; i < 1025; ++i)
-		log_2[i] += log_2[i - 1];
-
-	for (int i = 1; i <= 32; ++i) {
-		bit_head[i] = 1U << (32 - i);
-		mask_head[i] = mask_head[i - 1] + bit_head[i];
-		bit_tail[i] = 1U << (i - 1);
-		mask_tail[i] = mask_tail[i - 1] + bit_tail[i];
-	}
-
-	for (int i = 1; i <= 16; ++i) 
-		bit16_head[i] = 1U << (16 - i);
-	bits_child_num = (int*)malloc(sizeof(int) * bits_child_size);
+	tree_ranges.clear();
+	rules_map.clear();
+	delta.clear();
+	delta_rules.clear();
+	cal_time = 0;
+	build_memory_size = 0;
 }
 
 int PextCuts::Create(vector<Rule*> &_rules, bool insert) {
+	PextBuilder builder;
+	builder.Init(_rules);
+	#pragma omp parallel
+	#pragma omp single
+	Build(_rules, &builder);
+	builder.ShareSubtrees();
+	build_memory_size = builder.MemorySize();
+	builder.Free();
+	return 0;
+}
+
+// ignore_protocol : the rules of the same ranges but the protocol are kept once, the first of them
+int PextCuts::Build(vector<Rule*> &_rules, PextBuilder *builder, bool ignore_protocol) {
 	Init();
+	for (int i = 0; i < _rules.size(); ++i)
+		rules_map[PextRuleKey(_rules[i])].push_back(_rules[i]);
 	if (_rules.size() == 0)
 		return 0;
-	pext_rules_sum = _rules.size();
-	vector<Rule*> rules = UniqueRules(_rules);
+	vector<Rule*> rules = ignore_protocol ? UniqueRulesIgnoreProtocol(_rules) : UniqueRules(_rules);
 
 	int rules_num = rules.size();
 
@@ -619,26 +1171,36 @@ int PextCuts::Create(vector<Rule*> &_rules, bool insert) {
 	sort(ranges_rules.begin(), ranges_rules.end(), CmpRangeRules);
 	trees_num = ranges_rules.size();
 	trees = (PextNode*)malloc(sizeof(PextNode) * trees_num);
+	for (int i = 0; i < trees_num; ++i)
+		tree_ranges.push_back(ranges_rules[i]->tuple_range);
 	for (int i = 0; i < trees_num; ++i) {
+		#pragma omp task firstprivate(i) shared(ranges_rules)
+		{
 		// printf("\n\n");
 		// printf("%d %d %d %d: rules %ld priority %d\n", ranges_rules[i]->tuple_range.x1, ranges_rules[i]->tuple_range.y1, 
 			// ranges_rules[i]->tuple_range.x2, ranges_rules[i]->tuple_range.y2, ranges_rules[i]->rules.size(), ranges_rules[i]->max_priority);
-		vector<PextRule> pext_rules;
-		int pext_rules_num = ranges_rules[i]->rules.size();
-		for (int j = 0; j < pext_rules_num; ++j) {
-			pext_rules.push_back(PextRule(ranges_rules[i]->rules[j]));
+		PextBuildContext *context = builder->Context();
+		PextArenaMark mark = context->Mark();
+		PextRules pext_rules;
+		pext_rules.num = ranges_rules[i]->rules.size();
+		pext_rules.index = (uint32_t*)context->Alloc(sizeof(uint32_t) * pext_rules.num);
+		pext_rules.weight = (double*)context->Alloc(sizeof(double) * pext_rules.num);
+		for (int j = 0; j < pext_rules.num; ++j) {
+			pext_rules.index[j] = builder->table.Index(ranges_rules[i]->rules[j]);
+			pext_rules.weight[j] = 1;
 		}
 		PextBits pext_bits;
 		pext_bits.Init();
-		trees[i].Create(pext_rules, pext_bits, 0);
-		for (int j = 0; j < pext_rules_num; ++j)
-			free(pext_rules[j].port_prefix);
+		trees[i].Create(pext_rules, pext_bits, 0, builder);
+		context->Release(mark);
+		}
 	}
-	free(bits_child_num);
+	#pragma omp taskwait
 	return 0;
 }
 
 int PextCuts::Lookup(Trace *trace, int priority) {
+	priority = LookupDelta(trace, priority);
 	PextNode *pext_node;
 	for (int i = 0; i < trees_num; ++i) {
 		pext_node = &trees[i];
@@ -673,6 +1235,15 @@ int PextCuts::Lookup(Trace *trace, int priority) {
 
 int PextCuts::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state) {
 	program_state->AccessClear();
+	for (int i = 0; i < delta.size(); ++i) {
+		if (priority >= delta[i].priority)
+			break;
+		program_state->access_rules.AddNum();
+		if (delta[i].Match(trace)) {
+			priority = delta[i].priority;
+			break;
+		}
+	}
 	PextNode *pext_node;
 	for (int i = 0; i < trees_num; ++i) {
 		pext_node = &trees[i];
@@ -709,6 +1280,401 @@ int PextCuts::LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramSt
 	return priority;
 }
 
+// as PartitionIpRules and PartitionPortRules place the rule
+void PextNode::RuleChildren(Rule *rule, vector<int> &index) {
+	index.clear();
+	if (type == PextCutIp) {
+		uint32_t bits[2] = {(uint32_t)cut_ip_bits, (uint32_t)(cut_ip_bits >> 32)};
+		uint32_t range[2][2];
+		for (int i = 0; i < 2; ++i)
+			for (int j = 0; j < 2; ++j)
+				range[i][j] = _pext_u32(rule->range[i][j], bits[i]);
+		int src_bits_num = Popcnt(bits[0]);
+		for (int i = range[0][0]; i <= range[0][1]; ++i)
+			for (int j = range[1][0]; j <= range[1][1]; ++j)
+				index.push_back(j << src_bits_num | i);
+	} else if (type == PextCutPort) {
+		uint32_t start = rule->range[dim][0];
+		uint32_t end = rule->range[dim][1];
+		if (start == end) {
+			index.push_back(_pext_u32(start, cut_port_bits));
+		} else if (end - start + 1 == 65536) {
+			int children_num = ChildrenNum();
+			for (int i = 0; i < children_num; ++i)
+				index.push_back(i);
+		} else {
+			vector<PrefixRange> prefixes = GetPortMask(start, end);
+			PrefixRange ranges[PEXTPORTPREFIXES];
+			int ranges_num = PextPortRanges(&prefixes[0], prefixes.size(), cut_port_bits, ranges);
+			for (int i = 0; i < ranges_num; ++i)
+				for (int j = ranges[i].low; j <= ranges[i].high; ++j)
+					index.push_back(j);
+		}
+	}
+}
+
+// The rule is deleted in place from all leaves it is in. A shared leaf has the same rules in all its
+// nodes, so the rule is deleted from the other trees of the leaf too, and they have the rule.
+void PextNode::DeleteRule(Rule *rule, PextRuleNode &rule_node) {
+	if (max_priority < rule_node.priority)
+		return;
+	if (type == PextLeaf) {
+		for (int i = 0; i < rules_arr_num && rules_arr[i].priority >= rule_node.priority; ++i)
+			if (rules_arr[i].Same(rule_node)) {
+				for (int j = i; j + 1 < rules_arr_num; ++j)
+					rules_arr[j] = rules_arr[j + 1];
+				rules_arr[rules_arr_num - 1].Delete();
+				--i;
+			}
+		return;
+	}
+	vector<int> index;
+	RuleChildren(rule, index);
+	for (int i = 0; i < index.size(); ++i)
+		children[index[i]].DeleteRule(rule, rule_node);
+}
+
+// the inserted rules are merged into the trees before the delta slows the lookups
+int PextCuts::InsertRule(Rule *rule) {
+	AddRule(rule);
+	if (delta.size() >= PEXTDELTARULES)
+		Reconstruct();
+	return 0;
+}
+
+int PextCuts::DeleteRule(Rule *rule) {
+	if (RemoveRule(rule) > 0)
+		return 1;
+	if (delta.size() >= PEXTDELTARULES)
+		Reconstruct();
+	return 0;
+}
+
+int PextCuts::AddRule(Rule *rule) {
+	rules_map[PextRuleKey(rule)].push_back(rule);
+	AddDelta(rule);
+	return 0;
+}
+
+// after the rules of the same priority
+void PextCuts::AddDelta(Rule *rule) {
+	PextRuleNode rule_node;
+	rule_node.Init(rule);
+	int pos = delta.size();
+	while (pos > 0 && delta[pos - 1].priority < rule->priority)
+		--pos;
+	delta.insert(delta.begin() + pos, rule_node);
+	delta_rules.insert(delta_rules.begin() + pos, rule);
+}
+
+// The trees keep one rule of the same ranges, the rules left of its ranges are inserted again,
+// those in the trees too.
+int PextCuts::RemoveRule(Rule *rule) {
+	map<uint64_t, vector<Rule*>>::iterator it = rules_map.find(PextRuleKey(rule));
+	if (it == rules_map.end())
+		return 1;
+	vector<Rule*> &same_key = it->second;
+	int pos = find(same_key.begin(), same_key.end(), rule) - same_key.begin();
+	for (int i = 0; i < same_key.size() && pos == same_key.size(); ++i)
+		if (SameRule(same_key[i], rule))
+			pos = i;
+	if (pos == same_key.size())
+		return 1;
+	rule = same_key[pos];
+	same_key.erase(same_key.begin() + pos);
+	for (int i = delta_rules.size() - 1; i >= 0; --i)
+		if (delta_rules[i] == rule) {
+			delta.erase(delta.begin() + i);
+			delta_rules.erase(delta_rules.begin() + i);
+		}
+	// a rule is only in the trees RuleTree could select
+	PextRuleNode rule_node;
+	rule_node.Init(rule);
+	for (int i = 0; i < trees_num; ++i)
+		if (tree_ranges[i].x1 <= rule->prefix_len[0] && tree_ranges[i].y1 <= rule->prefix_len[1])
+			trees[i].DeleteRule(rule, rule_node);
+	for (int i = 0; i < same_key.size(); ++i) {
+		bool same_ranges = true;
+		for (int j = 0; j < 4; ++j)
+			same_ranges = same_ranges && same_key[i]->range[j][0] == rule->range[j][0] && same_key[i]->range[j][1] == rule->range[j][1];
+		if (same_ranges && find(delta_rules.begin(), delta_rules.end(), same_key[i]) == delta_rules.end())
+			AddDelta(same_key[i]);
+	}
+	if (same_key.empty())
+		rules_map.erase(it);
+	return 0;
+}
+
+Rule* PextCuts::FindRule(PextRuleNode &rule_node) {
+	map<uint64_t, vector<Rule*>>::iterator it = rules_map.find(PextRuleKey(rule_node));
+	if (it == rules_map.end())
+		return NULL;
+	PextRuleNode same_node;
+	for (int i = 0; i < it->second.size(); ++i) {
+		same_node.Init(it->second[i]);
+		if (same_node.Same(rule_node))
+			return it->second[i];
+	}
+	return NULL;
+}
+
+// The tree of the prefix lens of the rule, or the nearest tree whose prefixes are not longer
+// than the rule, the cuts of a tree would copy a rule of shorter prefixes into many children.
+int PextCuts::RuleTree(Rule *rule) {
+	int x = rule->prefix_len[0];
+	int y = rule->prefix_len[1];
+	int select = -1;
+	int select_distance = 0;
+	for (int i = 0; i < tree_ranges.size(); ++i) {
+		TupleRange &range = tree_ranges[i];
+		if (x < range.x1 || y < range.y1)
+			continue;
+		int distance = max(x - range.x2, 0) + max(y - range.y2, 0);
+		if (select == -1 || distance < select_distance) {
+			select = i;
+			select_distance = distance;
+		}
+	}
+	return select;
+}
+
+int PextCuts::Reconstruct() {
+	if (delta.empty())
+		return 0;
+	vector<PextCuts*> pextcuts(1, this);
+	PextMerge merge;
+	return merge.Merge(pextcuts, pextcuts);
+}
+
+// the lookups stop at the first tree of a lower max_priority
+void PextCuts::SortTrees() {
+	vector<pair<int, int>> order;
+	for (int i = 0; i < trees_num; ++i)
+		order.push_back(make_pair(-trees[i].max_priority, i));
+	sort(order.begin(), order.end());
+	PextNode *sorted_trees = (PextNode*)malloc(sizeof(PextNode) * trees_num);
+	vector<TupleRange> sorted_ranges;
+	for (int i = 0; i < trees_num; ++i) {
+		sorted_trees[i] = trees[order[i].second];
+		sorted_ranges.push_back(tree_ranges[order[i].second]);
+	}
+	free(trees);
+	trees = sorted_trees;
+	tree_ranges = sorted_ranges;
+}
+
+// the rules are routed as MergeNode routes them
+void PextMerge::AddNeeded(PextNode *node, vector<Rule*> &rules) {
+	if (node->children != NULL)
+		needed.push_back(node->children);
+	if (node->type == PextLeaf)
+		return;
+	map<int, vector<Rule*>> child_rules;
+	vector<int> index;
+	for (int i = 0; i < rules.size(); ++i) {
+		node->RuleChildren(rules[i], index);
+		for (int j = 0; j < index.size(); ++j)
+			child_rules[index[j]].push_back(rules[i]);
+	}
+	for (map<int, vector<Rule*>>::iterator it = child_rules.begin(); it != child_rules.end(); ++it)
+		AddNeeded(&node->children[it->first], it->second);
+}
+
+// the nodes sharing the children or rules of a node are the duplicate nodes of the same pointer
+void PextMerge::AddSharers(PextNode *node) {
+	if (node->duplicate) {
+		if (node->children != NULL && binary_search(needed.begin(), needed.end(), (void*)node->children))
+			sharers[node->children].push_back(node);
+		return;
+	}
+	if (node->type == PextLeaf)
+		return;
+	int children_num = node->ChildrenNum();
+	for (int i = 0; i < children_num; ++i)
+		AddSharers(&node->children[i]);
+}
+
+// a node sharing them owns them after their owner, the last node frees them
+void PextMerge::ReleaseStorage(PextNode *node) {
+	if (node->children == NULL)
+		return;
+	map<void*, vector<PextNode*>>::iterator it = sharers.find(node->children);
+	if (node->duplicate) {
+		if (it != sharers.end())
+			it->second.erase(find(it->second.begin(), it->second.end(), node));
+	} else if (it != sharers.end() && !it->second.empty()) {
+		it->second.back()->duplicate = false;
+		it->second.pop_back();
+	} else {
+		node->Free(false);
+	}
+}
+
+// copy on write of the children of a cut
+void PextMerge::MakePrivate(PextNode *node) {
+	map<void*, vector<PextNode*>>::iterator it = sharers.find(node->children);
+	if (!node->duplicate && (it == sharers.end() || it->second.empty()))
+		return;
+	int children_num = node->ChildrenNum();
+	PextNode *children = (PextNode*)malloc(sizeof(PextNode) * children_num);
+	memcpy(children, node->children, sizeof(PextNode) * children_num);
+	for (int i = 0; i < children_num; ++i)
+		if (children[i].children != NULL) {
+			children[i].duplicate = true;
+			if (binary_search(needed.begin(), needed.end(), (void*)children[i].children))
+				sharers[children[i].children].push_back(&children[i]);
+		}
+	ReleaseStorage(node);
+	node->children = children;
+	node->duplicate = false;
+}
+
+// the leaves are emptied here and rebuilt after all trees are merged
+void PextMerge::MergeNode(PextNode *node, vector<Rule*> &rules, PextBits pext_bits, PextCuts *pextcuts) {
+	if (node->type == PextLeaf) {
+		PextMergeLeaf leaf;
+		leaf.node = node;
+		leaf.pext_bits = pext_bits;
+		for (int i = 0; i < node->rules_arr_num; ++i)
+			if (!node->rules_arr[i].Deleted()) {
+				Rule *rule = pextcuts->FindRule(node->rules_arr[i]);
+				if (rule != NULL)
+					leaf.rules.push_back(rule);
+			}
+		leaf.rules.insert(leaf.rules.end(), rules.begin(), rules.end());
+		stable_sort(leaf.rules.begin(), leaf.rules.end(), CmpRulePriority);
+		int rules_num = 0;
+		for (int i = 0; i < leaf.rules.size(); ++i) {
+			int j = rules_num - 1;
+			while (j >= 0 && leaf.rules[j]->priority == leaf.rules[i]->priority && leaf.rules[j] != leaf.rules[i])
+				--j;
+			if (j < 0 || leaf.rules[j] != leaf.rules[i])
+				leaf.rules[rules_num++] = leaf.rules[i];
+		}
+		leaf.rules.resize(rules_num);
+		ReleaseStorage(node);
+		node->duplicate = true;
+		node->rules_arr_num = 0;
+		node->rules_arr = NULL;
+		node->max_priority = rules_num > 0 ? leaf.rules[0]->priority : 0;
+		leaves.push_back(leaf);
+		return;
+	}
+	MakePrivate(node);
+	map<int, vector<Rule*>> child_rules;
+	vector<int> index;
+	for (int i = 0; i < rules.size(); ++i) {
+		node->RuleChildren(rules[i], index);
+		for (int j = 0; j < index.size(); ++j)
+			child_rules[index[j]].push_back(rules[i]);
+	}
+	if (node->type == PextCutIp) {
+		pext_bits.ip_bits[0] |= (uint32_t)node->cut_ip_bits;
+		pext_bits.ip_bits[1] |= (uint32_t)(node->cut_ip_bits >> 32);
+	} else {
+		pext_bits.port_bits[node->dim - 2] |= node->cut_port_bits;
+	}
+	for (map<int, vector<Rule*>>::iterator it = child_rules.begin(); it != child_rules.end(); ++it)
+		MergeNode(&node->children[it->first], it->second, pext_bits, pextcuts);
+	int children_num = node->ChildrenNum();
+	node->max_priority = 0;
+	for (int i = 0; i < children_num; ++i)
+		node->max_priority = max(node->max_priority, node->children[i].max_priority);
+}
+
+// merged : the PextCuts with inserted rules, all : all PextCuts whose trees may share subtrees with them
+int PextMerge::Merge(vector<PextCuts*> &merged, vector<PextCuts*> &all) {
+	// the trees of the rules, the rules far from all trees get new trees first
+	vector<vector<vector<Rule*>>> tree_rules(merged.size());
+	for (int i = 0; i < merged.size(); ++i) {
+		PextCuts *pextcuts = merged[i];
+		tree_rules[i].resize(pextcuts->trees_num);
+		for (int j = 0; j < pextcuts->delta_rules.size(); ++j) {
+			Rule *rule = pextcuts->delta_rules[j];
+			int tree = pextcuts->RuleTree(rule);
+			if (tree == -1) {
+				TupleRange range;
+				range.x1 = range.x2 = rule->prefix_len[0];
+				range.y1 = range.y2 = rule->prefix_len[1];
+				pextcuts->tree_ranges.push_back(range);
+				tree = tree_rules[i].size();
+				tree_rules[i].resize(tree + 1);
+			}
+			tree_rules[i][tree].push_back(rule);
+		}
+		if (tree_rules[i].size() > pextcuts->trees_num) {
+			pextcuts->trees = (PextNode*)realloc(pextcuts->trees, sizeof(PextNode) * tree_rules[i].size());
+			for (int j = pextcuts->trees_num; j < tree_rules[i].size(); ++j) {
+				PextNode *tree = &pextcuts->trees[j];
+				tree->type = PextLeaf;
+				tree->dim = 0;
+				tree->layer = 0;
+				tree->duplicate = true;
+				tree->max_priority = 0;
+				tree->rules_arr_num = 0;
+				tree->rules_arr = NULL;
+			}
+			pextcuts->trees_num = tree_rules[i].size();
+		}
+	}
+
+	// the nodes do not move after the sharers are found
+	for (int i = 0; i < merged.size(); ++i)
+		for (int j = 0; j < merged[i]->trees_num; ++j)
+			if (tree_rules[i][j].size() > 0)
+				AddNeeded(&merged[i]->trees[j], tree_rules[i][j]);
+	sort(needed.begin(), needed.end());
+	needed.erase(unique(needed.begin(), needed.end()), needed.end());
+	for (int i = 0; i < all.size(); ++i)
+		for (int j = 0; j < all[i]->trees_num; ++j)
+			AddSharers(&all[i]->trees[j]);
+	for (int i = 0; i < merged.size(); ++i)
+		for (int j = 0; j < merged[i]->trees_num; ++j)
+			if (tree_rules[i][j].size() > 0) {
+				PextBits pext_bits;
+				pext_bits.Init();
+				MergeNode(&merged[i]->trees[j], tree_rules[i][j], pext_bits, merged[i]);
+			}
+
+	vector<Rule*> rules;
+	for (int i = 0; i < leaves.size(); ++i)
+		rules.insert(rules.end(), leaves[i].rules.begin(), leaves[i].rules.end());
+	PextBuilder builder;
+	builder.Init(rules);
+	#pragma omp parallel
+	#pragma omp single
+	for (int i = 0; i < leaves.size(); ++i) {
+		#pragma omp task firstprivate(i) shared(builder)
+		{
+		PextMergeLeaf &leaf = leaves[i];
+		PextBuildContext *context = builder.Context();
+		PextArenaMark mark = context->Mark();
+		PextRules pext_rules;
+		pext_rules.num = leaf.rules.size();
+		pext_rules.index = (uint32_t*)context->Alloc(sizeof(uint32_t) * pext_rules.num);
+		pext_rules.weight = (double*)context->Alloc(sizeof(double) * pext_rules.num);
+		for (int j = 0; j < pext_rules.num; ++j) {
+			pext_rules.index[j] = builder.table.Index(leaf.rules[j]);
+			pext_rules.weight[j] = 1;
+		}
+		leaf.node->Create(pext_rules, leaf.pext_bits, leaf.node->layer, &builder);
+		context->Release(mark);
+		}
+	}
+	builder.ShareSubtrees();
+	builder.Free();
+
+	for (int i = 0; i < merged.size(); ++i) {
+		merged[i]->SortTrees();
+		merged[i]->delta.clear();
+		merged[i]->delta_rules.clear();
+	}
+	needed.clear();
+	sharers.clear();
+	leaves.clear();
+	return 0;
+}
+
 int PextNode::Height() {
 	int max_height = 0;
 	if (type == PextCutIp) {
@@ -747,6 +1713,13 @@ int PextNode::RealHeight() {
 
 int PextNode::CalculateState(ProgramState *program_state, bool _duplicate) {
 	DecisionTreeInfo *info = NULL;
+	if (duplicate && !_duplicate && !(type == PextLeaf && rules_arr_num == 0)) {
+		// the subtree is kept once, the node would have held a copy of it
+		PextNode node = *this;
+		node.duplicate = false;
+		++program_state->tree_shared_num;
+		program_state->tree_shared_memory_size += node.MemorySize() - sizeof(PextNode);
+	}
 	if (duplicate)
 		_duplicate = true;
 	if (type == PextCutIp) {
@@ -835,6 +1808,8 @@ int PextNode::Free(bool free_self) {
 }
 
 int PextCuts::CalculateState(ProgramState *program_state) {
+	program_state->tree_build_memory_size += build_memory_size;
+	program_state->cal_time += cal_time;
 	program_state->tuples_num = max(program_state->tuples_num, trees_num);
 	program_state->tuples_sum = max(program_state->tuples_sum, trees_num);
 	int tree_height_sum = 0;
@@ -869,6 +1844,7 @@ uint64_t PextCuts::MemorySize() {
 	// printf("PextNode %ld PextRuleNode %ld\n", sizeof(PextNode), sizeof(PextRuleNode)); // 24 32
 	for (int i = 0; i < trees_num; ++i)
 		memory_size += trees[i].MemorySize();
+	memory_size += (sizeof(PextRuleNode) + sizeof(Rule*)) * delta.size();
 	return memory_size;
 }
 
@@ -877,6 +1853,11 @@ int PextCuts::Free(bool free_self) {
 		trees[i].Free(false);
 	if (trees)
 		free(trees);
+	// free skips the destructors
+	vector<TupleRange>().swap(tree_ranges);
+	map<uint64_t, vector<Rule*>>().swap(rules_map);
+	vector<PextRuleNode>().swap(delta);
+	vector<Rule*>().swap(delta_rules);
 	if (free_self)
 		free(this);
 	return 0;
@@ -6,12 +6,162 @@
 #include "pextcuts-ranges.h"
 #include "../../io/io.h"
 
+#include <omp.h>
+
 #define PextCutIp 0
 #define PextCutPort 1
 #define PextLeaf 2
 
+#define PEXTTASKRULES 64  // children with more rules are built as tasks
+#define PEXTSUBTREESHARDS 64  // locks of the subtree table
+#define PEXTARENABLOCK (1 << 20)  // bytes of a block of the rules arena
+
 using namespace std;
 
+struct PextNode;
+struct PextBits;
+
+#define PEXTPORTPREFIXES 32  // at most 30 prefixes of a 16 bits range
+#define PEXTPORTCACHE 4096  // slots of the pext ranges cache of a build thread
+#define PEXTBEAMMAX 16  // widest beam of the cut search
+#define PEXTBEAMROUNDS 8  // cuts expanded by the search of a node, per cut of the beam
+#define PEXTDELTARULES 32  // inserted rules looked up beside the trees, then merged into them
+
+// the cut search of the nodes, 1 0 0 0 is the greedy search
+extern int pext_beam_width;  // cuts kept by the search of a node
+extern int pext_lookahead;  // 1 : the kept cuts are compared by the greedy cuts of their children
+extern int pext_node_budget;  // ms of the search of a node, 0 no limit
+extern int pext_build_budget;  // ms of a build, later nodes are cut greedily, 0 no limit
+int SetPextSearch(int beam_width, int lookahead, int node_budget, int build_budget);
+int PextPortRanges(PrefixRange *prefixes, int prefixes_num, uint32_t bits, PrefixRange *ranges);  // the pext ranges of prefixes
+
+// the rules of all trees of a build, sorted by address, the nodes keep the indexes of their rules
+// The port ranges neither exact nor wildcard are decomposed into prefixes once for each different range,
+// the cuts split the others directly.
+struct PextRuleTable {
+    vector<Rule*> rules;
+    vector<uint32_t> port_range_id;  // of rule i and port dim d, port_range_id[i * 2 + d - 2]
+    vector<uint32_t> ports_begin;  // the prefixes of range r, ports_begin[r] to ports_begin[r + 1]
+    vector<PrefixRange> ports;  // by low
+
+    void Init(vector<Rule*> &_rules);
+    uint32_t Index(Rule *rule);
+    int PortMinLen(uint32_t index, int dim);  // the shortest prefix of the port range
+    int PortRanges(uint32_t index, int dim, uint32_t bits, PrefixRange *ranges);  // the pext ranges of a port range
+    uint64_t MemorySize();
+};
+
+// the rules of a node by priority and their weights, in the arena of a build thread
+struct PextRules {
+    uint32_t *index;  // in the rule table
+    double *weight;
+    int num;
+};
+
+// the pext ranges of a port range under a mask, in the ranges of the cache
+struct PextPortCacheSlot {
+    uint64_t key;  // (range id + 1) << 16 | mask, 0 if empty
+    uint32_t begin;
+    uint32_t num;
+};
+
+// a cut of a node and its cost, the bits of a port cut in bits[0]
+struct PextCut {
+    char type;
+    char dim;
+    bool expanded;  // the cuts a bit away were tried
+    uint32_t bits[2];
+    double cost;
+};
+
+// the cheapest cuts of a node found by the search, by cost
+struct PextBeam {
+    PextCut cuts[PEXTBEAMMAX];
+    int cuts_num;
+    int width;
+
+    void Init(int _width) {
+        cuts_num = 0;
+        width = _width;
+    }
+    double MaxCost() {  // of a cut still kept
+        return cuts_num < width ? 1e9 : cuts[cuts_num - 1].cost;
+    }
+    bool Insert(char type, char dim, uint32_t *bits, double cost);
+};
+
+struct PextArenaMark {
+    int block;
+    uint64_t used;
+    uint64_t base;
+};
+
+// scratch of the cut cost functions, one per build thread
+// The arena is a stack of blocks: the child rules of a node are allocated on top of it and released
+// after its children are built. Tied tasks run nested on their thread, so the releases are in order.
+struct PextBuildContext {
+    int *bits_child_num;
+    int bits_child_size;
+    vector<pair<PextNode*, PextNode*>> shared_nodes;  // node, the node built with its state
+    vector<char*> arena_blocks;
+    vector<uint64_t> arena_blocks_size;
+    int arena_block;
+    uint64_t arena_used;  // in arena_blocks[arena_block]
+    uint64_t arena_base;  // bytes of the blocks below arena_block
+    uint64_t arena_peak;  // most bytes in use
+    PextPortCacheSlot *port_cache;
+    vector<PrefixRange> port_cache_ranges;
+
+    void Init();
+    void Reserve(int size);
+    void* Alloc(uint64_t size);
+    PrefixRange* PortRanges(PextRuleTable *table, uint32_t index, int dim, uint32_t bits, int &ranges_num);
+    PextArenaMark Mark() {
+        PextArenaMark mark = {arena_block, arena_used, arena_base};
+        return mark;
+    }
+    void Release(PextArenaMark mark) {
+        arena_block = mark.block;
+        arena_used = mark.used;
+        arena_base = mark.base;
+    }
+    void Free();
+};
+
+// a built node, the subtree of a node depends only on its state
+struct PextSubtree {
+    vector<uint64_t> state;  // layer, used bits, then each rule index and its weight
+    PextNode *node;
+};
+
+// Builds PextCuts as OpenMP tasks: the PextCuts of MultiPextCuts, the trees of a PextCuts and
+// the large children of a node. Every node is built as in the serial build.
+// A node whose state was already claimed by another node anywhere in the build is not built,
+// ShareSubtrees copies the other node into it after the build, so the trees do not depend on the threads.
+struct PextBuilder {
+    PextRuleTable table;
+    PextBuildContext *contexts;  // by omp thread num in the parallel region of the build
+    int contexts_num;
+    map<uint64_t, vector<PextSubtree>> subtrees[PEXTSUBTREESHARDS];  // by state hash
+    omp_lock_t subtrees_locks[PEXTSUBTREESHARDS];
+    int beam_width;  // the cut search of the build, from pext_beam_width and the others
+    int lookahead;
+    double node_budget;  // s
+    double deadline;  // omp_get_wtime of the end of the search, 0 no limit
+
+    void Init(vector<Rule*> &rules);  // all rules of the trees
+    PextBuildContext* Context() {
+        return &contexts[omp_get_thread_num()];
+    }
+    bool Searching() {  // the nodes built now are searched
+        return (beam_width > 1 || lookahead) && (deadline == 0 || omp_get_wtime() < deadline);
+    }
+    bool ClaimSubtree(PextRules &rules, PextBits &pext_bits, char layer, PextNode *node);  // false : node shares a built node
+    void ShareSubtrees();  // after the parallel region
+    uint64_t MemorySize();  // peak scratch memory of the build
+    void Free();
+};
+
 struct RangeRules {
     vector<Rule*> rules;
     int max_priority;
@@ -37,16 +187,35 @@ struct PextBits {
     }
 };
 
-struct PextRulePortPrefix {
-    vector<PrefixRange> ports[2];
+struct PextLenGroup {
+    char len[2];
+    int rules_num;
 };
 
-struct PextRule {
-    Rule *rule;
+// the ranges of a rule of the node in the order of the node
+struct PextStatsRule {
+    uint32_t ip_range[2][2];
+    uint32_t port_range[2][2];
     double weight;
-    PextRulePortPrefix *port_prefix;
+    uint32_t index;  // in the rule table
+};
 
-    PextRule(Rule *_rule);
+// Prefix length histograms of the rules of a node, built once before its candidate cuts are tried.
+// A cut bit beyond the prefix of a rule doubles the children of the rule, so the child rules of
+// candidate bits and the rules falling into every child follow from the histograms alone.
+// They only reject candidates, the cost of a candidate left is still a full scan of the ranges
+// of the node, stopped once it reaches the best cost so far.
+struct PextNodeStats {
+    vector<PextLenGroup> ip_groups;  // by src and dst prefix len
+    vector<PextLenGroup> port_groups[2];  // by len[0], the shortest prefix of the port range
+    vector<PextStatsRule> rules;
+    PextRuleTable *table;
+
+    void Init(PextRules &rules, PextRuleTable *table);
+    uint32_t IpRulesSum(uint32_t *bits);  // rules of all children
+    uint32_t IpAllChildrenRules(uint32_t *bits);
+    int PortRulesSumMin(int dim, uint32_t bits);  // at most the rules of all children
+    int PortAllChildrenRules(int dim, uint32_t bits);
 };
 
 struct PextRuleNode {
@@ -69,6 +238,30 @@ struct PextRuleNode {
         protocol_end   = rule->range[4][1];
         priority       = rule->priority;
     }
+    // a deleted rule is kept in its leaf until the leaf is rebuilt, after the rules that can match
+    void Delete() {
+        src_ip_begin = 0xFFFFFFFF;
+        src_ip_end = 0;
+        priority = 0;
+    }
+    bool Deleted() {
+        return src_ip_begin > src_ip_end;
+    }
+    bool Same(PextRuleNode &node) {
+        return src_ip_begin == node.src_ip_begin && src_ip_end == node.src_ip_end &&
+               dst_ip_begin == node.dst_ip_begin && dst_ip_end == node.dst_ip_end &&
+               src_port_begin == node.src_port_begin && src_port_end == node.src_port_end &&
+               dst_port_begin == node.dst_port_begin && dst_port_end == node.dst_port_end &&
+               protocol_begin == node.protocol_begin && protocol_end == node.protocol_end &&
+               priority == node.priority;
+    }
+    bool Match(Trace *trace) {
+        return src_ip_begin   <= trace->key[0] && trace->key[0] <= src_ip_end &&
+               dst_ip_begin   <= trace->key[1] && trace->key[1] <= dst_ip_end &&
+               src_port_begin <= trace->key[2] && trace->key[2] <= src_port_end &&
+               dst_port_begin <= trace->key[3] && trace->key[3] <= dst_port_end &&
+               protocol_begin <= trace->key[4] && trace->key[4] <= protocol_end;
+    }
     uint64_t MemorySize() {
         return sizeof(PextRuleNode);
     }
@@ -98,10 +291,16 @@ struct PextNode {
         PextRuleNode *rules_arr;
     };
 
-    void Create(vector<PextRule> &rules, PextBits pext_bits, char _layer);
-    void CreateLeaf(vector<PextRule> &_rules);
-    void CreateIpCut(vector<PextRule> &rules, uint32_t *bits, PextBits pext_bits);
-    void CreatePortCut(vector<PextRule> &rules, uint32_t bits, int _dim, PextBits pext_bits);
+    void Create(PextRules &rules, PextBits pext_bits, char _layer, PextBuilder *builder);
+    void CreateLeaf(PextRules &rules, PextRuleTable *table);
+    void CreateIpCut(PextRules &rules, uint32_t *bits, PextBits pext_bits, PextBuilder *builder);
+    void CreatePortCut(PextRules &rules, uint32_t bits, int _dim, PextBits pext_bits, PextBuilder *builder);
+    void CreateChildren(PextRules *child_rules, int children_num, PextBits pext_bits, PextBuilder *builder);
+    int ChildrenNum() {
+        return type == PextCutIp ? 1 << Popcnt(cut_ip_bits) : 1 << Popcnt(cut_port_bits);
+    }
+    void RuleChildren(Rule *rule, vector<int> &index);  // the children of a cut the rule is in
+    void DeleteRule(Rule *rule, PextRuleNode &rule_node);
     int Height();
     int RealHeight();
     int CalculateState(ProgramState *program_state, bool _duplicate);
@@ -109,18 +308,59 @@ struct PextNode {
     int Free(bool free_self);
 };
 
+class PextCuts;
+
+// a leaf reached by the inserted rules of a merge, rebuilt with them and its rules not deleted
+struct PextMergeLeaf {
+    PextNode *node;
+    vector<Rule*> rules;
+    PextBits pext_bits;
+};
+
+// Merges the inserted rules of some PextCuts into their trees. The nodes on the way of the rules are
+// made private first: a node sharing the children of another node copies them, the copies share the
+// grandchildren. Only the leaves reached are rebuilt, as subtrees of their rules with weight 1.
+struct PextMerge {
+    vector<void*> needed;  // the children and rules on the way of the rules, sorted
+    map<void*, vector<PextNode*>> sharers;  // the duplicate nodes by their children or rules, of those needed
+    vector<PextMergeLeaf> leaves;
+
+    void AddNeeded(PextNode *node, vector<Rule*> &rules);
+    void AddSharers(PextNode *node);  // of the subtree, all trees sharing with the merged trees are added
+    void ReleaseStorage(PextNode *node);  // the node no longer uses its children or rules
+    void MakePrivate(PextNode *node);
+    void MergeNode(PextNode *node, vector<Rule*> &rules, PextBits pext_bits, PextCuts *pextcuts);
+    int Merge(vector<PextCuts*> &merged, vector<PextCuts*> &all);
+};
+
 class PextCuts : public Classifier {
 public:
     
     void Init();
     int Create(vector<Rule*> &_rules, bool insert);
+    int Build(vector<Rule*> &_rules, PextBuilder *builder, bool ignore_protocol = false);  // in a parallel region of builder
 
-    int InsertRule(Rule *rule) {return 0;}
-    int DeleteRule(Rule *rule) {return 0;}
+    int InsertRule(Rule *rule);
+    int DeleteRule(Rule *rule);
+    int AddRule(Rule *rule);  // not merged
+    int RemoveRule(Rule *rule);
+    void AddDelta(Rule *rule);
+    Rule* FindRule(PextRuleNode &rule_node);  // of a leaf
+    int RuleTree(Rule *rule);  // the tree an inserted rule is merged into, -1 a new tree
+    int LookupDelta(Trace *trace, int priority) {
+        for (int i = 0; i < delta.size(); ++i) {
+            if (priority >= delta[i].priority)
+                break;
+            if (delta[i].Match(trace))
+                return delta[i].priority;
+        }
+        return priority;
+    }
     int Lookup(Trace *trace, int priority);
     int LookupAccess(Trace *trace, int priority, Rule *ans_rule, ProgramState *program_state);
 
-    int Reconstruct() {return 0;}
+    int Reconstruct();
+    void SortTrees();
     uint64_t MemorySize();
     int CalculateState(ProgramState *program_state);
     int GetRules(vector<Rule*> &rules);
@@ -129,8 +369,15 @@ public:
 
     int trees_num;
     PextNode *trees;
+    vector<TupleRange> tree_ranges;  // of the prefix lens of the rules of each tree
+
+    // the updates, the rules of the trees are looked up by their ranges
+    map<uint64_t, vector<Rule*>> rules_map;  // all rules by the hash of the ranges but the protocol
+    vector<PextRuleNode> delta;  // the inserted rules not merged, by priority
+    vector<Rule*> delta_rules;
 
     double cal_time;
+    uint64_t build_memory_size;  // peak scratch memory of Create
 };
 
 